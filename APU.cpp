@@ -1,6 +1,9 @@
 #include "APU.h"
 #include "Util.h"
 #include <assert.h>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
 #include "CartridgeData.h"
 
 Register_1::Register_1(Channel ch)
@@ -11,35 +14,36 @@ Register_1::Register_1(Channel ch)
     nrx2 = 0x00;
     nrx3 = 0x00;
     nrx4 = 0x00;
+    enabled = false;
 }
 
 uint8_t Register_1::get_sweep_period()
 {
-    assert(channel != Channel_Square1);     
+    assert(channel == Channel_Square1);     
     return (nrx0 >> 4) & 0x07;
 }
 
 bool Register_1::get_negate()
 {
-    assert(channel != Channel_Square1);
+    assert(channel == Channel_Square1);
     return (nrx0 & 0x08) != 0x00;
 }
     
 uint8_t Register_1::get_shift()
 {
-    assert(channel != Channel_Square1);
+    assert(channel == Channel_Square1);
     return nrx0 & 0x07;
 }    
 
 bool Register_1::get_dac_power()
 {
-    assert(channel != Channel_Wave);
+    assert(channel == Channel_Wave);
     return (nrx0 & 0x80) != 0x00;
 }
 
 uint8_t Register_1::get_duty()
 {
-    assert(!((channel == Channel_Square1) || (channel == Channel_Square2)));
+    assert(channel == Channel_Square1 || channel == Channel_Square2);
     return nrx1 >> 6;
 }
 
@@ -54,37 +58,37 @@ uint16_t Register_1::get_length_load()
 
 uint8_t Register_1::get_starting_volume()
 {
-    assert(channel == Channel_Wave);
+    assert(channel != Channel_Wave);
     return nrx2 >> 4;
 }
 
 uint8_t Register_1::get_volume_code()
 {
-    assert(channel != Channel_Wave);
+    assert(channel == Channel_Wave);
     return (nrx2 >> 5) & 0x03;
 }
 
 bool Register_1::get_envelope_add_mode()
 {
-    assert(channel == Channel_Wave);
+    assert(channel != Channel_Wave);
     return (nrx2 & 0x08) != 0x00;
 }
 
 uint8_t Register_1::get_period()
 {
-    assert(channel == Channel_Wave);
+    assert(channel != Channel_Wave);
     return (nrx2 & 0x07);
 }
 
 uint16_t Register_1::get_frequency()
 {
-    assert(channel == Channel_Noise);
+    assert(channel != Channel_Noise);
     return ((nrx4 & 0x07) << 8) | nrx3;
 }
 
 void Register_1::set_frequency(uint16_t f)
 {
-    assert(channel == Channel_Noise);
+    assert(channel != Channel_Noise);
     uint8_t h = (f >> 8) & 0x07;
     uint8_t l = f;
     nrx4 = (nrx4 & 0xf8) | h;
@@ -93,38 +97,22 @@ void Register_1::set_frequency(uint16_t f)
 
 uint8_t Register_1::get_clock_shift()
 {
-    assert(channel != Channel_Noise);
+    assert(channel == Channel_Noise);
     return (nrx3 >> 4);
 }
 
 bool Register_1::get_width_mode_of_lfsr()
 {
-    assert(channel != Channel_Noise);
+    assert(channel == Channel_Noise);
     return (nrx3 & 0x08) != 0x00;
 }
 
 uint8_t Register_1::get_dividor_code()
 {
-    assert(channel != Channel_Noise);
+    assert(channel == Channel_Noise);
     return (nrx3 & 0x07);
 }    
 
-bool Register_1::get_trigger()
-{
-    return (nrx4 & 0x80) != 0x00;
-}
-
-void Register_1::set_trigger(bool b)
-{
-    if (b)
-    {
-        nrx4 |= 0x80;
-    } else
-    {
-        nrx4 &= 0x7f;
-    }
-}
-
 bool Register_1::get_length_enable()
 {
     return (nrx4 & 0x40) != 0x00;
@@ -132,19 +120,19 @@ bool Register_1::get_length_enable()
 
 uint8_t Register_1::get_l_vol()
 {
-    assert(channel != Channel_Mixer);
+    assert(channel == Channel_Mixer);
     return (nrx0 >> 4) & 0x07;
 }
 
 uint8_t Register_1::get_r_vol()
 {
-    assert(channel != Channel_Mixer);
+    assert(channel == Channel_Mixer);
     return (nrx0 & 0x07);
 }
 
 bool Register_1::get_power()
 {
-    assert(channel != Channel_Mixer);
+    assert(channel == Channel_Mixer);
     return (nrx2 & 0x80) != 0x00;
 }
 
@@ -160,6 +148,11 @@ uint8_t FrameSequencer::next()
     return step;
 }
 
+void FrameSequencer::state(State &s)
+{
+    s.io(step);
+}
+
 LengthCounter::LengthCounter(Register_1 *r): reg(r)
 {
     n = 0x0000;
@@ -170,7 +163,7 @@ void LengthCounter::next()
     if (reg->get_length_enable() && n != 0) {
         n -= 1;
         if (n == 0) {
-            reg->set_trigger(false);
+            reg->enabled = false;
         }
     }
 }
@@ -202,6 +195,18 @@ VolumeEnvelope::VolumeEnvelope(Register_1 *r): reg(r)
     volume = 0x00;
 }
 
+VolumeEnvelope::~VolumeEnvelope()
+{
+    delete timer;
+}
+
+void VolumeEnvelope::state(State &s)
+{
+    s.io(timer->period);
+    s.io(timer->n);
+    s.io(volume);
+}
+
 void VolumeEnvelope::reload() {
     uint8_t p = reg->get_period();
     // The volume envelope and sweep timers treat a period of 0 as 8.
@@ -231,6 +236,20 @@ FrequencySweep::FrequencySweep(Register_1 *r): reg(r)
     newfeq = 0x00;
 }
 
+FrequencySweep::~FrequencySweep()
+{
+    delete timer;
+}
+
+void FrequencySweep::state(State &s)
+{
+    s.io(timer->period);
+    s.io(timer->n);
+    s.io(enable);
+    s.io(shadow);
+    s.io(newfeq);
+}
+
 void FrequencySweep::reload() {
     shadow = reg->get_frequency();
     uint8_t p = reg->get_sweep_period();
@@ -254,7 +273,7 @@ void FrequencySweep::frequency_calculation() {
 
 void FrequencySweep::overflow_check() {
     if (newfeq >= 2048) {
-        reg->set_trigger(false);
+        reg->enabled = false;
     }
 }
 
@@ -274,4 +293,767 @@ void FrequencySweep::next() {
         frequency_calculation();
         overflow_check();
     }
-}
\ No newline at end of file
+}
+
+// The base clock, which the APU is clocked with in both speed modes.
+static const uint32_t APU_CLOCK = 4194304;
+// The frame sequencer ticks at 512 Hz.
+static const uint32_t APU_FRAME = APU_CLOCK / 512;
+// The channels are synthesized at 64 cycles per sample, 128 samples per frame sequencer tick, and the Mixer takes it
+// from there to the output rate.
+static const uint32_t APU_SYNTH_RATE = APU_CLOCK / 64;
+
+struct BlipKernel {
+    int32_t v[Blip::PHASES][Blip::TAPS];
+
+    // A delta adds, to each output sample, how much a band-limited step rises over the sample period before it: the
+    // integral of a Blackman windowed sinc with its cutoff at 45% of the sample rate over one sample, taken
+    // numerically. One row per sub-sample phase. Every row sums to exactly 1 << 15, so a step always settles at its
+    // full height and the running sum never drifts.
+    BlipKernel()
+    {
+        const double pi = 3.14159265358979323846;
+        const double cutoff = 0.9;
+        const double half = Blip::TAPS / 2 + 1;
+        const int steps = 64;
+        for (int p = 0; p < Blip::PHASES; p++)
+        {
+            double row[Blip::TAPS];
+            double sum = 0.0;
+            for (int k = 0; k < Blip::TAPS; k++)
+            {
+                row[k] = 0.0;
+                for (int j = 0; j < steps; j++)
+                {
+                    double t = k - Blip::TAPS / 2 - (double)p / Blip::PHASES + (j + 0.5) / steps;
+                    double x = pi * cutoff * t;
+                    double sinc = (x == 0.0) ? 1.0 : std::sin(x) / x;
+                    double w = (t <= -half || t >= half) ? 0.0 :
+                        0.42 + 0.5 * std::cos(pi * t / half) + 0.08 * std::cos(2.0 * pi * t / half);
+                    row[k] += sinc * w;
+                }
+                sum += row[k];
+            }
+            int32_t total = 0;
+            int centre = 0;
+            for (int k = 0; k < Blip::TAPS; k++)
+            {
+                v[p][k] = (int32_t)std::lround(row[k] / sum * 32768.0);
+                total += v[p][k];
+                if (v[p][k] > v[p][centre])
+                {
+                    centre = k;
+                }
+            }
+            v[p][centre] += 32768 - total;
+        }
+    }
+};
+
+static const BlipKernel &blip_kernel()
+{
+    static const BlipKernel kernel;
+    return kernel;
+}
+
+Blip::Blip(uint32_t clock_rate, uint32_t sample_rate)
+{
+    factor = (uint64_t)((double)sample_rate / clock_rate * 4294967296.0 + 0.5);
+    offset = 0;
+    last = 0;
+    integrator = 0;
+    memset(buf, 0, sizeof(buf));
+    blip_kernel();
+}
+
+void Blip::add_delta(uint32_t t, int32_t delta)
+{
+    uint64_t pos = offset + (uint64_t)t * factor;
+    uint32_t i = (uint32_t)(pos >> 32);
+    if (i >= FRAME_SAMPLES)
+    {
+        return;
+    }
+    const int32_t *k = blip_kernel().v[(pos >> 27) & (PHASES - 1)];
+    int32_t *b = &buf[i];
+    for (int j = 0; j < TAPS; j++)
+    {
+        b[j] += k[j] * delta;
+    }
+}
+
+void Blip::end_frame(uint32_t t)
+{
+    offset += (uint64_t)t * factor;
+}
+
+uint32_t Blip::read_samples(float *out, uint32_t n)
+{
+    uint32_t count = std::min(n, samples_avail());
+    int32_t sum = integrator;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        sum += buf[i];
+        out[i] = (float)sum * (1.0f / 32768.0f);
+    }
+    integrator = sum;
+    memmove(buf, buf + count, (SIZE - count) * sizeof(int32_t));
+    memset(buf + SIZE - count, 0, count * sizeof(int32_t));
+    offset -= (uint64_t)count << 32;
+    return count;
+}
+
+void Blip::state(State &s)
+{
+    s.io(offset);
+    s.io(last);
+    s.io(integrator);
+    s.io(buf, sizeof(buf));
+}
+
+// Read masks of NRx0 to NRx4, bits that are write only or unused read as 1.
+static const uint8_t SQUARE1_MASK[5] = { 0x80, 0x3f, 0x00, 0xff, 0xbf };
+static const uint8_t SQUARE2_MASK[5] = { 0xff, 0x3f, 0x00, 0xff, 0xbf };
+static const uint8_t WAVE_MASK[5] = { 0x7f, 0xff, 0x9f, 0xff, 0xbf };
+static const uint8_t NOISE_MASK[5] = { 0xff, 0xff, 0x00, 0x00, 0xbf };
+
+static uint8_t reg_get(Register_1 *reg, unsigned int i, const uint8_t *mask)
+{
+    uint8_t v = 0x00;
+    switch (i)
+    {
+    case 0: v = reg->nrx0; break;
+    case 1: v = reg->nrx1; break;
+    case 2: v = reg->nrx2; break;
+    case 3: v = reg->nrx3; break;
+    case 4: v = reg->nrx4; break;
+    }
+    return v | mask[i];
+}
+
+static void reg_state(State &s, Register_1 *reg)
+{
+    s.io(reg->nrx0);
+    s.io(reg->nrx1);
+    s.io(reg->nrx2);
+    s.io(reg->nrx3);
+    s.io(reg->nrx4);
+}
+
+// Level of a channel with a volume envelope: silent while the channel is disabled, otherwise the output swings
+// between +volume and -volume so that a silent channel sits at 0.
+static int32_t envelope_level(Register_1 *reg, VolumeEnvelope *ve, bool high)
+{
+    if (!reg->enabled || ve->volume == 0)
+    {
+        return 0;
+    }
+    return high ? ve->volume : -(int32_t)ve->volume;
+}
+
+// Moves a channel timer forward by cycles while its output can not change, without visiting each step. Returns the
+// number of steps that passed.
+static uint32_t skip_steps(uint32_t &countdown, uint32_t period, uint32_t cycles)
+{
+    if (countdown > cycles)
+    {
+        countdown -= cycles;
+        return 0;
+    }
+    uint32_t c = cycles - countdown;
+    countdown = period - c % period;
+    return 1 + c / period;
+}
+
+ChannelSquare::ChannelSquare(Channel channel, Blip *b): blip(b)
+{
+    reg = new Register_1(channel);
+    lc = new LengthCounter(reg);
+    ve = new VolumeEnvelope(reg);
+    fs = (channel == Channel_Square1) ? new FrequencySweep(reg) : NULL;
+    idx = 0;
+    update_period();
+    countdown = period;
+}
+
+ChannelSquare::~ChannelSquare()
+{
+    delete fs;
+    delete ve;
+    delete lc;
+    delete reg;
+}
+
+void ChannelSquare::update_period()
+{
+    period = (2048 - reg->get_frequency()) * 4;
+}
+
+int32_t ChannelSquare::level()
+{
+    static const uint8_t DUTY[4] = { 0b00000001, 0b10000001, 0b10000111, 0b01111110 };
+    return envelope_level(reg, ve, ((DUTY[reg->get_duty()] >> idx) & 0x01) != 0x00);
+}
+
+// Runs the channel for cycles cycles from frame time t. Only the steps of the duty cycle are visited.
+void ChannelSquare::next(uint32_t t, uint32_t cycles)
+{
+    // A disabled channel stays silent and its phase is reset when it is triggered.
+    if (!reg->enabled)
+    {
+        return;
+    }
+    // The volume only changes on frame sequencer ticks, which the APU never runs a channel across.
+    if (ve->volume == 0)
+    {
+        idx = (idx + skip_steps(countdown, period, cycles)) % 8;
+        return;
+    }
+    while (countdown <= cycles)
+    {
+        t += countdown;
+        cycles -= countdown;
+        countdown = period;
+        idx = (idx + 1) % 8;
+        blip->set(t, level());
+    }
+    countdown -= cycles;
+}
+
+uint8_t ChannelSquare::get(unsigned int i)
+{
+    return reg_get(reg, i, fs ? SQUARE1_MASK : SQUARE2_MASK);
+}
+
+void ChannelSquare::set(unsigned int i, uint8_t v)
+{
+    switch (i)
+    {
+    case 0:
+        reg->nrx0 = v;
+        break;
+    case 1:
+        reg->nrx1 = v;
+        lc->n = reg->get_length_load();
+        break;
+    case 2:
+        reg->nrx2 = v;
+        // The DAC is off when the top 5 bits are clear, which disables the channel.
+        if ((v & 0xf8) == 0x00)
+        {
+            reg->enabled = false;
+        }
+        break;
+    case 3:
+        reg->nrx3 = v;
+        update_period();
+        break;
+    case 4:
+        reg->nrx4 = v & 0x7f;
+        update_period();
+        if (v & 0x80)
+        {
+            lc->reload();
+            ve->reload();
+            if (fs)
+            {
+                fs->reload();
+            }
+            countdown = period;
+            reg->enabled = (reg->nrx2 & 0xf8) != 0x00;
+        }
+        break;
+    }
+}
+
+void ChannelSquare::state(State &s)
+{
+    reg_state(s, reg);
+    s.io(reg->enabled);
+    s.io(lc->n);
+    ve->state(s);
+    if (fs)
+    {
+        fs->state(s);
+    }
+    s.io(countdown);
+    s.io(period);
+    s.io(idx);
+}
+
+ChannelWave::ChannelWave(Blip *b): blip(b)
+{
+    reg = new Register_1(Channel_Wave);
+    lc = new LengthCounter(reg);
+    memset(waveram, 0, sizeof(waveram));
+    idx = 0;
+    update_period();
+    countdown = period;
+}
+
+ChannelWave::~ChannelWave()
+{
+    delete lc;
+    delete reg;
+}
+
+void ChannelWave::update_period()
+{
+    period = (2048 - reg->get_frequency()) * 2;
+}
+
+int32_t ChannelWave::level()
+{
+    // Volume code 0 mutes, 1 to 3 shift the 4-bit sample right by 0 to 2.
+    static const uint8_t SHIFT[4] = { 4, 0, 1, 2 };
+    if (!reg->enabled || !reg->get_dac_power())
+    {
+        return 0;
+    }
+    uint8_t shift = SHIFT[reg->get_volume_code()];
+    uint8_t sample = (waveram[idx >> 1] >> ((idx & 0x01) ? 0 : 4)) & 0x0f;
+    return 2 * (int32_t)(sample >> shift) - (15 >> shift);
+}
+
+void ChannelWave::next(uint32_t t, uint32_t cycles)
+{
+    if (!reg->enabled)
+    {
+        return;
+    }
+    if (reg->get_volume_code() == 0 || !reg->get_dac_power())
+    {
+        idx = (idx + skip_steps(countdown, period, cycles)) % 32;
+        return;
+    }
+    while (countdown <= cycles)
+    {
+        t += countdown;
+        cycles -= countdown;
+        countdown = period;
+        idx = (idx + 1) % 32;
+        blip->set(t, level());
+    }
+    countdown -= cycles;
+}
+
+uint8_t ChannelWave::get(unsigned int i)
+{
+    return reg_get(reg, i, WAVE_MASK);
+}
+
+void ChannelWave::set(unsigned int i, uint8_t v)
+{
+    switch (i)
+    {
+    case 0:
+        reg->nrx0 = v;
+        if (!reg->get_dac_power())
+        {
+            reg->enabled = false;
+        }
+        break;
+    case 1:
+        reg->nrx1 = v;
+        lc->n = reg->get_length_load();
+        break;
+    case 2:
+        reg->nrx2 = v;
+        break;
+    case 3:
+        reg->nrx3 = v;
+        update_period();
+        break;
+    case 4:
+        reg->nrx4 = v & 0x7f;
+        update_period();
+        if (v & 0x80)
+        {
+            lc->reload();
+            idx = 0;
+            countdown = period;
+            reg->enabled = reg->get_dac_power();
+        }
+        break;
+    }
+}
+
+void ChannelWave::state(State &s)
+{
+    reg_state(s, reg);
+    s.io(reg->enabled);
+    s.io(lc->n);
+    s.io(waveram, sizeof(waveram));
+    s.io(countdown);
+    s.io(period);
+    s.io(idx);
+}
+
+static inline uint16_t lfsr_next(uint16_t lfsr, bool width)
+{
+    uint16_t bit = (lfsr ^ (lfsr >> 1)) & 0x0001;
+    lfsr = (lfsr >> 1) | (bit << 14);
+    if (width)
+    {
+        lfsr = (lfsr & ~0x0040) | (bit << 6);
+    }
+    return lfsr;
+}
+
+ChannelNoise::ChannelNoise(Blip *b): blip(b)
+{
+    reg = new Register_1(Channel_Noise);
+    lc = new LengthCounter(reg);
+    ve = new VolumeEnvelope(reg);
+    lfsr = 0x7fff;
+    update_period();
+    countdown = period;
+}
+
+ChannelNoise::~ChannelNoise()
+{
+    delete ve;
+    delete lc;
+    delete reg;
+}
+
+void ChannelNoise::update_period()
+{
+    static const uint32_t DIVISOR[8] = { 8, 16, 32, 48, 64, 80, 96, 112 };
+    period = DIVISOR[reg->get_dividor_code()] << reg->get_clock_shift();
+}
+
+int32_t ChannelNoise::level()
+{
+    // The output is the inverse of bit 0.
+    return envelope_level(reg, ve, (lfsr & 0x0001) == 0x0000);
+}
+
+void ChannelNoise::next(uint32_t t, uint32_t cycles)
+{
+    if (!reg->enabled)
+    {
+        return;
+    }
+    bool width = reg->get_width_mode_of_lfsr();
+    if (ve->volume == 0)
+    {
+        // Silent, but the register still has to end up where it would have been.
+        for (uint32_t k = skip_steps(countdown, period, cycles); k > 0; k--)
+        {
+            lfsr = lfsr_next(lfsr, width);
+        }
+        return;
+    }
+    while (countdown <= cycles)
+    {
+        t += countdown;
+        cycles -= countdown;
+        countdown = period;
+        lfsr = lfsr_next(lfsr, width);
+        blip->set(t, level());
+    }
+    countdown -= cycles;
+}
+
+uint8_t ChannelNoise::get(unsigned int i)
+{
+    return reg_get(reg, i, NOISE_MASK);
+}
+
+void ChannelNoise::set(unsigned int i, uint8_t v)
+{
+    switch (i)
+    {
+    case 0:
+        reg->nrx0 = v;
+        break;
+    case 1:
+        reg->nrx1 = v;
+        lc->n = reg->get_length_load();
+        break;
+    case 2:
+        reg->nrx2 = v;
+        if ((v & 0xf8) == 0x00)
+        {
+            reg->enabled = false;
+        }
+        break;
+    case 3:
+        reg->nrx3 = v;
+        update_period();
+        break;
+    case 4:
+        reg->nrx4 = v & 0x7f;
+        if (v & 0x80)
+        {
+            lc->reload();
+            ve->reload();
+            lfsr = 0x7fff;
+            countdown = period;
+            reg->enabled = (reg->nrx2 & 0xf8) != 0x00;
+        }
+        break;
+    }
+}
+
+void ChannelNoise::state(State &s)
+{
+    reg_state(s, reg);
+    s.io(reg->enabled);
+    s.io(lc->n);
+    ve->state(s);
+    s.io(lfsr);
+    s.io(countdown);
+    s.io(period);
+}
+
+// The registers start with the values the boot ROM leaves behind, without triggering any channel.
+Apu::Apu(uint32_t rate): out(rate)
+{
+    sample_rate = rate;
+    for (int i = 0; i < 4; i++)
+    {
+        blips[i] = new Blip(APU_CLOCK, APU_SYNTH_RATE);
+    }
+    mixer = new Mixer(APU_SYNTH_RATE, rate);
+    channel1 = new ChannelSquare(Channel_Square1, blips[0]);
+    channel2 = new ChannelSquare(Channel_Square2, blips[1]);
+    channel3 = new ChannelWave(blips[2]);
+    channel4 = new ChannelNoise(blips[3]);
+    reg = new Register_1(Channel_Mixer);
+    fseq = new FrameSequencer();
+    countdown = APU_FRAME;
+    frame_time = 0;
+    output = true;
+    clock = NULL;
+    synced = 0;
+
+    channel1->reg->nrx0 = 0x80;
+    channel1->reg->nrx1 = 0xbf;
+    channel1->reg->nrx2 = 0xf3;
+    channel1->reg->nrx4 = 0x3f;
+    channel2->reg->nrx1 = 0x3f;
+    channel2->reg->nrx4 = 0x3f;
+    channel3->reg->nrx0 = 0x7f;
+    channel3->reg->nrx1 = 0xff;
+    channel3->reg->nrx2 = 0x9f;
+    channel3->reg->nrx4 = 0x3f;
+    channel4->reg->nrx1 = 0xff;
+    channel4->reg->nrx4 = 0x3f;
+    reg->nrx0 = 0x77;
+    reg->nrx1 = 0xf3;
+    reg->nrx2 = 0x80;
+    channel1->update_period();
+    channel2->update_period();
+    channel3->update_period();
+    channel4->update_period();
+}
+
+Apu::~Apu()
+{
+    delete channel1;
+    delete channel2;
+    delete channel3;
+    delete channel4;
+    for (int i = 0; i < 4; i++)
+    {
+        delete blips[i];
+    }
+    delete mixer;
+    delete reg;
+    delete fseq;
+}
+
+uint8_t Apu::get(unsigned int a)
+{
+    if (a >= 0xff10 && a <= 0xff14) { return channel1->get(a - 0xff10); }
+    if (a >= 0xff15 && a <= 0xff19) { return channel2->get(a - 0xff15); }
+    if (a >= 0xff1a && a <= 0xff1e) { return channel3->get(a - 0xff1a); }
+    if (a >= 0xff1f && a <= 0xff23) { return channel4->get(a - 0xff1f); }
+    if (a == 0xff24) { return reg->nrx0; }
+    if (a == 0xff25) { return reg->nrx1; }
+    if (a == 0xff26)
+    {
+        uint8_t v = (reg->nrx2 & 0x80) | 0x70;
+        v |= channel1->reg->enabled ? 0x01 : 0x00;
+        v |= channel2->reg->enabled ? 0x02 : 0x00;
+        v |= channel3->reg->enabled ? 0x04 : 0x00;
+        v |= channel4->reg->enabled ? 0x08 : 0x00;
+        return v;
+    }
+    if (a >= 0xff30 && a <= 0xff3f) { return channel3->waveram[a - 0xff30]; }
+    return 0xff;
+}
+
+void Apu::set(unsigned int a, uint8_t v)
+{
+    if (a >= 0xff30 && a <= 0xff3f)
+    {
+        channel3->waveram[a - 0xff30] = v;
+        return;
+    }
+    // While the APU is off only NR52 can be written.
+    if (a != 0xff26 && !reg->get_power())
+    {
+        return;
+    }
+
+    if (a >= 0xff10 && a <= 0xff14) { channel1->set(a - 0xff10, v); }
+    if (a >= 0xff15 && a <= 0xff19) { channel2->set(a - 0xff15, v); }
+    if (a >= 0xff1a && a <= 0xff1e) { channel3->set(a - 0xff1a, v); }
+    if (a >= 0xff1f && a <= 0xff23) { channel4->set(a - 0xff1f, v); }
+    if (a == 0xff24) { reg->nrx0 = v; }
+    if (a == 0xff25) { reg->nrx1 = v; }
+    if (a == 0xff26)
+    {
+        bool power = (v & 0x80) != 0x00;
+        if (!power && reg->get_power())
+        {
+            // Powering off clears every register but the wave table.
+            for (unsigned int i = 0xff10; i <= 0xff25; i++)
+            {
+                set(i, 0x00);
+            }
+        }
+        reg->nrx2 = v & 0x80;
+    }
+    update_levels();
+}
+
+// Moves the output of every channel to its current level, after something other than its timer changed it.
+void Apu::update_levels()
+{
+    blips[0]->set(frame_time, channel1->level());
+    blips[1]->set(frame_time, channel2->level());
+    blips[2]->set(frame_time, channel3->level());
+    blips[3]->set(frame_time, channel4->level());
+}
+
+void Apu::next(uint32_t cycles)
+{
+    while (cycles > 0)
+    {
+        uint32_t n = std::min(cycles, countdown);
+        if (reg->get_power())
+        {
+            channel1->next(frame_time, n);
+            channel2->next(frame_time, n);
+            channel3->next(frame_time, n);
+            channel4->next(frame_time, n);
+        }
+        frame_time += n;
+        countdown -= n;
+        cycles -= n;
+        if (countdown == 0)
+        {
+            countdown = APU_FRAME;
+            tick();
+        }
+    }
+}
+
+// A frame sequencer tick: clocks the length counters, envelopes and sweep, then ends the Blip frame and mixes it.
+void Apu::tick()
+{
+    if (reg->get_power())
+    {
+        uint8_t step = fseq->next();
+        if (step % 2 == 0)
+        {
+            channel1->lc->next();
+            channel2->lc->next();
+            channel3->lc->next();
+            channel4->lc->next();
+        }
+        if (step == 7)
+        {
+            channel1->ve->next();
+            channel2->ve->next();
+            channel4->ve->next();
+        }
+        if (step == 2 || step == 6)
+        {
+            channel1->fs->next();
+            channel1->update_period();
+        }
+        update_levels();
+    }
+
+    for (int i = 0; i < 4; i++)
+    {
+        blips[i]->end_frame(frame_time);
+    }
+    frame_time = 0;
+    mix();
+}
+
+// Sums the channels into stereo. NR51 routes each channel to the left (bits 4-7) and right (bits 0-3) terminal, NR50
+// scales each terminal by (volume + 1) / 8. A channel swings at most 15 steps either way, four of them at full volume
+// reach 1.
+//
+// The Blips are read even when the samples are dropped, they only have room for one frame.
+void Apu::mix()
+{
+    float ch[4][Blip::FRAME_SAMPLES];
+    uint32_t n = blips[0]->samples_avail();
+    for (int i = 0; i < 4; i++)
+    {
+        blips[i]->read_samples(ch[i], n);
+    }
+
+    if (!output || out.fill() > sample_rate)
+    {
+        return;
+    }
+    float l_vol = (float)(reg->get_l_vol() + 1) / 8.0f / 15.0f * 0.25f;
+    float r_vol = (float)(reg->get_r_vol() + 1) / 8.0f / 15.0f * 0.25f;
+    float gl[4];
+    float gr[4];
+    for (int i = 0; i < 4; i++)
+    {
+        gl[i] = (reg->nrx1 & (0x10 << i)) ? l_vol : 0.0f;
+        gr[i] = (reg->nrx1 & (0x01 << i)) ? r_vol : 0.0f;
+    }
+    const float *const chs[4] = { ch[0], ch[1], ch[2], ch[3] };
+    mixer->process(chs, gl, gr, n, out);
+}
+
+void Apu::catch_up()
+{
+    while (synced != *clock)
+    {
+        uint32_t n = (uint32_t)std::min<uint64_t>(*clock - synced, 1u << 30);
+        next(n);
+        synced += n;
+    }
+}
+
+void Apu::set_clock(const uint64_t *c)
+{
+    clock = c;
+    synced = *c;
+}
+
+size_t Apu::read(float *dst, size_t n)
+{
+    sync();
+    return out.read(dst, n);
+}
+
+void Apu::state(State &s)
+{
+    reg_state(s, reg);
+    fseq->state(s);
+    s.io(countdown);
+    s.io(frame_time);
+    s.io(synced);
+    channel1->state(s);
+    channel2->state(s);
+    channel3->state(s);
+    channel4->state(s);
+    for (int i = 0; i < 4; i++)
+    {
+        blips[i]->state(s);
+    }
+}
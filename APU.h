@@ -3,7 +3,10 @@
 #define APU_1
 
 #include <vector>
+#include <cstdint>
 #include "Cartridge.h"
+#include "Mixer.h"
+#include "AudioRing.h"
 typedef enum{
     Channel_Square1,
     Channel_Square2,
@@ -64,7 +67,11 @@ public:
     uint8_t nrx1;
     uint8_t nrx2;
     uint8_t nrx3;
+    // Without the trigger bit, which is write only.
     uint8_t nrx4;
+    // The internal enabled flag of the channel, reported in NR52. It is set by a trigger and cleared by the length
+    // counter, a sweep overflow or turning the DAC off.
+    bool enabled;
 
 public:
     Register_1(Channel channel);    
@@ -99,10 +106,6 @@ public:
 
     uint8_t get_dividor_code();    
 
-    bool get_trigger();    
-
-    void set_trigger(bool b);    
-
     bool get_length_enable();    
 
     uint8_t get_l_vol();    
@@ -134,6 +137,7 @@ private:
 public:
     FrameSequencer();
     uint8_t next();
+    void state(State &s);
 };
 
 // A length counter disables a channel when it decrements to zero. It contains an internal counter and enabled flag.
@@ -148,6 +152,7 @@ class LengthCounter
 {
 private:
     Register_1 *reg;
+public:
     uint16_t n;
 public:
     LengthCounter(Register_1 *r);    
@@ -179,11 +184,14 @@ class VolumeEnvelope
 private:
     Register_1 *reg;
     Clock *timer;
+public:
     uint8_t volume;
 public:
     VolumeEnvelope(Register_1 *r);   
+    ~VolumeEnvelope();
     void next();
     void reload(); 
+    void state(State &s);
 };
 
 // The first square channel has a frequency sweep unit, controlled by NR10. This has a timer, internal enabled flag,
@@ -218,17 +226,194 @@ private:
 
 public:
     FrequencySweep(Register_1 *r);    
+    ~FrequencySweep();
     void next();
     void overflow_check();
     void frequency_calculation();
     void reload();
+    void state(State &s);
+};
+
+// Band-limited step synthesizer, in the manner of blip_buf. A channel only reports the moments its output level
+// changes, as deltas stamped in base clock cycles. Each delta is added to the output as a band-limited step, a
+// windowed sinc picked from a table by the sub-sample phase of its time, and the steps are summed up when the samples
+// are read. The work is proportional to the number of level changes plus the number of output samples, not to the
+// number of cycles, and there is no aliasing from sampling a square wave at the output rate.
+//
+// Times are relative to the start of the current frame, end_frame() closes it after t cycles. Frames are expected to
+// be short (the APU ends one every 8192 cycles) and the samples to be read after each of them.
+class Blip
+{
+public:
+    // Kernel width in output samples and number of sub-sample phases of the kernel table.
+    static const int TAPS = 16;
+    static const int PHASES = 32;
+    // Most samples a frame may produce before they are read.
+    static const int FRAME_SAMPLES = 256;
+    static const int SIZE = FRAME_SAMPLES + TAPS;
+
+    Blip(uint32_t clock_rate, uint32_t sample_rate);
+
+    // Output level changes to ampl at time t. Amplitudes are in units of one step of a 4-bit DAC.
+    void set(uint32_t t, int32_t ampl)
+    {
+        if (ampl != last)
+        {
+            add_delta(t, ampl - last);
+            last = ampl;
+        }
+    }
+
+    void add_delta(uint32_t t, int32_t delta);
+    void end_frame(uint32_t t);
+    uint32_t samples_avail() { return (uint32_t)(offset >> 32); }
+    // Reads up to n samples into out, in DAC steps. Returns the number of samples read.
+    uint32_t read_samples(float *out, uint32_t n);
+    void state(State &s);
+
+private:
+    // Output samples per clock cycle and position of the start of the frame in output samples, both 32.32 fixed
+    // point.
+    uint64_t factor;
+    uint64_t offset;
+    int32_t last;
+    int32_t integrator;
+    // Deltas in 1.15 fixed point, the output is their running sum.
+    int32_t buf[SIZE];
+};
+
+// The square channels. Channel 1 has a frequency sweep, channel 2 does not (fs is NULL).
+class ChannelSquare
+{
+public:
+    Register_1 *reg;
+    LengthCounter *lc;
+    VolumeEnvelope *ve;
+    FrequencySweep *fs;
+    Blip *blip;
+    // Cycles left until the duty cycle moves to its next step, and the cycles of one step.
+    uint32_t countdown;
+    uint32_t period;
+    uint8_t idx;
+
+    ChannelSquare(Channel channel, Blip *b);
+    ~ChannelSquare();
+    void update_period();
+    int32_t level();
+    void next(uint32_t t, uint32_t cycles);
+    uint8_t get(unsigned int a);
+    void set(unsigned int a, uint8_t v);
+    void state(State &s);
+};
+
+// The wave channel plays the 32 4-bit samples of the wave table.
+class ChannelWave
+{
+public:
+    Register_1 *reg;
+    LengthCounter *lc;
+    Blip *blip;
+    uint8_t waveram[16];
+    uint32_t countdown;
+    uint32_t period;
+    uint8_t idx;
+
+    ChannelWave(Blip *b);
+    ~ChannelWave();
+    void update_period();
+    int32_t level();
+    void next(uint32_t t, uint32_t cycles);
+    uint8_t get(unsigned int a);
+    void set(unsigned int a, uint8_t v);
+    void state(State &s);
 };
 
+// The noise channel outputs bit 0 of a 15-bit linear feedback shift register, or a 7-bit one in width mode.
+class ChannelNoise
+{
+public:
+    Register_1 *reg;
+    LengthCounter *lc;
+    VolumeEnvelope *ve;
+    Blip *blip;
+    uint16_t lfsr;
+    uint32_t countdown;
+    uint32_t period;
+
+    ChannelNoise(Blip *b);
+    ~ChannelNoise();
+    void update_period();
+    int32_t level();
+    void next(uint32_t t, uint32_t cycles);
+    uint8_t get(unsigned int a);
+    void set(unsigned int a, uint8_t v);
+    void state(State &s);
+};
+
+// Output sample rate of the APU.
+static const uint32_t APU_SAMPLE_RATE = 48000;
+
+// The audio processing unit. It synthesizes the four channels into Blip buffers at 65536 Hz. Every tick of the frame
+// sequencer (512 Hz) ends a Blip frame, and the Mixer mixes the channels with the NR50 master volume and NR51 panning,
+// filters and resamples them, and appends the stereo samples to out.
+//
+// The APU is not clocked along with the CPU. It keeps the base clock cycle it is synchronized to, and only catches up
+// to Mmunit::clock when it has to: before a register is read or written, and when the host reads samples. Between
+// two such events nothing can change its output, so the whole interval is synthesized in one go, and most
+// instructions cost it nothing.
 class Apu: public Memory
 {
+public:
+    // Mixer registers: NR50 in nrx0, NR51 in nrx1, NR52 in nrx2.
+    Register_1 *reg;
+    FrameSequencer *fseq;
+    // Cycles left until the next frame sequencer tick, and cycles passed since the last one.
+    uint32_t countdown;
+    uint32_t frame_time;
+    ChannelSquare *channel1;
+    ChannelSquare *channel2;
+    ChannelWave *channel3;
+    ChannelNoise *channel4;
+    Blip *blips[4];
+    // Host side like out, it is not part of the save state. Restoring one leaves its filter history as it is, which
+    // is inaudible.
+    Mixer *mixer;
+    uint32_t sample_rate;
+    // Stereo samples waiting for the host, in -1..1. The ring holds a second or a bit more, and is allocated once.
+    // Samples beyond one second are dropped until the host reads.
+    AudioRing out;
+    // Cleared while frames that will be rolled back are emulated, their samples are thrown away.
+    bool output;
+    // The clock the APU follows, and the cycle of it the APU has caught up to.
+    const uint64_t *clock;
+    uint64_t synced;
+
+public:
+    Apu(uint32_t sample_rate);
+    ~Apu();
+
+    uint8_t get(unsigned int a);
+    void set(unsigned int a, uint8_t v);
+    // Runs the APU for cycles base clock cycles.
+    void next(uint32_t cycles);
+    void set_clock(const uint64_t *c);
+    // Catches up to the clock.
+    void sync()
+    {
+        if (clock && *clock != synced)
+        {
+            catch_up();
+        }
+    }
+    // Catches up, then moves up to n stereo samples from out to dst. Returns the number moved.
+    size_t read(float *dst, size_t n);
+    void state(State &s);
+
 private:
-    /* data */
-public:    
+    void catch_up();
+    void update_levels();
+    void tick();
+    void mix();
 };
 
 
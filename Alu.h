@@ -0,0 +1,147 @@
+#ifndef Alu_1
+#define Alu_1
+
+#include <cstdint>
+#include <cstddef>
+#include "CPU.h"
+
+// Lookup tables for the 8-bit operations whose result and flags depend only on their inputs. They are generated at
+// compile time, so Cpu::alu_* is reduced to a single load plus a write to F.
+//
+// Entries of the shift and DAA tables are packed as (result << 8) | F, the low nibble of F is always zero.
+//
+// Size:
+//   ALU_INC, ALU_DEC, ALU_SWAP      256 * 1 byte  * 3 =   768 bytes
+//   ALU_SHIFT                 7 * 512 * 2 bytes      =  7168 bytes
+//   ALU_DAA                      2048 * 2 bytes      =  4096 bytes
+// which fits comfortably in a 32K L1 data cache.
+
+typedef enum {
+    AluShift_Rlc,
+    AluShift_Rrc,
+    AluShift_Rl,
+    AluShift_Rr,
+    AluShift_Sla,
+    AluShift_Sra,
+    AluShift_Srl,
+    AluShift_Count,
+} AluShift;
+
+template <typename T, size_t N>
+struct AluTable {
+    T v[N];
+
+    constexpr const T &operator[](size_t i) const { return v[i]; }
+};
+
+// Flags of INC r8, indexed by the operand. C is not affected and is left out.
+constexpr AluTable<uint8_t, 256> alu_make_inc()
+{
+    AluTable<uint8_t, 256> t {};
+    for (size_t a = 0; a < 256; a++)
+    {
+        uint8_t r = (uint8_t)(a + 1);
+        uint8_t f = 0x00;
+        if (r == 0x00) f |= Flag_Z;
+        if ((a & 0x0f) == 0x0f) f |= Flag_H;
+        t.v[a] = f;
+    }
+    return t;
+}
+
+// Flags of DEC r8, indexed by the operand. C is not affected and is left out.
+constexpr AluTable<uint8_t, 256> alu_make_dec()
+{
+    AluTable<uint8_t, 256> t {};
+    for (size_t a = 0; a < 256; a++)
+    {
+        uint8_t r = (uint8_t)(a - 1);
+        uint8_t f = Flag_N;
+        if (r == 0x00) f |= Flag_Z;
+        if ((a & 0x0f) == 0x00) f |= Flag_H;
+        t.v[a] = f;
+    }
+    return t;
+}
+
+// Flags of SWAP r8, indexed by the operand. The result is the nibble swap of the operand.
+constexpr AluTable<uint8_t, 256> alu_make_swap()
+{
+    AluTable<uint8_t, 256> t {};
+    for (size_t a = 0; a < 256; a++)
+    {
+        t.v[a] = (a == 0x00) ? Flag_Z : 0x00;
+    }
+    return t;
+}
+
+constexpr uint16_t alu_shift_entry(AluShift op, uint8_t a, bool c)
+{
+    uint8_t r = 0x00;
+    bool o = false;
+    switch (op)
+    {
+    case AluShift_Rlc: o = (a & 0x80) != 0; r = (uint8_t)(a << 1) | (o ? 0x01 : 0x00); break;
+    case AluShift_Rrc: o = (a & 0x01) != 0; r = (uint8_t)(a >> 1) | (o ? 0x80 : 0x00); break;
+    case AluShift_Rl:  o = (a & 0x80) != 0; r = (uint8_t)(a << 1) | (c ? 0x01 : 0x00); break;
+    case AluShift_Rr:  o = (a & 0x01) != 0; r = (uint8_t)(a >> 1) | (c ? 0x80 : 0x00); break;
+    case AluShift_Sla: o = (a & 0x80) != 0; r = (uint8_t)(a << 1); break;
+    case AluShift_Sra: o = (a & 0x01) != 0; r = (uint8_t)(a >> 1) | (a & 0x80); break;
+    case AluShift_Srl: o = (a & 0x01) != 0; r = (uint8_t)(a >> 1); break;
+    default: break;
+    }
+    uint8_t f = 0x00;
+    if (r == 0x00) f |= Flag_Z;
+    if (o) f |= Flag_C;
+    return ((uint16_t)r << 8) | f;
+}
+
+// Result and flags of the rotate and shift group, indexed by [op][carry << 8 | operand].
+constexpr AluTable<AluTable<uint16_t, 512>, AluShift_Count> alu_make_shift()
+{
+    AluTable<AluTable<uint16_t, 512>, AluShift_Count> t {};
+    for (size_t op = 0; op < AluShift_Count; op++)
+    {
+        for (size_t i = 0; i < 512; i++)
+        {
+            t.v[op].v[i] = alu_shift_entry((AluShift)op, (uint8_t)i, i >= 256);
+        }
+    }
+    return t;
+}
+
+// Result and flags of DAA, indexed by (F & (N|H|C)) << 4 | A.
+constexpr AluTable<uint16_t, 2048> alu_make_daa()
+{
+    AluTable<uint16_t, 2048> t {};
+    for (size_t i = 0; i < 2048; i++)
+    {
+        uint8_t a = (uint8_t)i;
+        uint8_t fl = (uint8_t)((i >> 4) & 0x70);
+        bool n = (fl & Flag_N) != 0;
+        bool h = (fl & Flag_H) != 0;
+        bool c = (fl & Flag_C) != 0;
+        if (!n)
+        {
+            if (c || a > 0x99) { a = (uint8_t)(a + 0x60); c = true; }
+            if (h || (a & 0x0f) > 0x09) { a = (uint8_t)(a + 0x06); }
+        } else
+        {
+            if (c) { a = (uint8_t)(a - 0x60); }
+            if (h) { a = (uint8_t)(a - 0x06); }
+        }
+        uint8_t f = n ? Flag_N : 0x00;
+        if (a == 0x00) f |= Flag_Z;
+        if (c) f |= Flag_C;
+        t.v[i] = ((uint16_t)a << 8) | f;
+    }
+    return t;
+}
+
+static constexpr AluTable<uint8_t, 256> ALU_INC = alu_make_inc();
+static constexpr AluTable<uint8_t, 256> ALU_DEC = alu_make_dec();
+static constexpr AluTable<uint8_t, 256> ALU_SWAP = alu_make_swap();
+static constexpr AluTable<AluTable<uint16_t, 512>, AluShift_Count> ALU_SHIFT = alu_make_shift();
+static constexpr AluTable<uint16_t, 2048> ALU_DAA = alu_make_daa();
+
+#endif
@@ -0,0 +1,137 @@
+#include "AudioCapture.h"
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+using namespace std;
+
+AudioCapture::AudioCapture() : ring(RING_FRAMES)
+{
+    dropped = 0;
+    format = CaptureFormat_Wav;
+    sample_rate = 0;
+    frames = 0;
+    running = false;
+    opened = false;
+}
+
+AudioCapture::~AudioCapture()
+{
+    close();
+}
+
+bool AudioCapture::open(const string &path, CaptureFormat f, uint32_t rate)
+{
+    file.open(path, ios::binary | ios::trunc);
+    if (!file)
+    {
+        return false;
+    }
+    format = f;
+    sample_rate = rate;
+    frames = 0;
+    dropped = 0;
+    // The sizes in the header are filled in by close(), until then they claim an empty file.
+    write_header();
+    running = true;
+    writer = std::thread(&AudioCapture::loop, this);
+    opened = true;
+    return true;
+}
+
+void AudioCapture::capture(Apu *apu)
+{
+    float buf[1024 * 2];
+    size_t n;
+    while ((n = apu->read(buf, 1024)) > 0)
+    {
+        dropped += n - ring.write(buf, n);
+    }
+}
+
+void AudioCapture::close()
+{
+    if (!opened)
+    {
+        return;
+    }
+    running = false;
+    writer.join();
+    write_header();
+    file.close();
+    opened = false;
+}
+
+// Drains the ring until close() stops it and nothing is left. An empty ring is polled every few milliseconds, which
+// keeps the emulation side free of any wake up call.
+void AudioCapture::loop()
+{
+    vector<float> in(CHUNK * 2);
+    vector<int16_t> out(CHUNK * 2);
+    while (true)
+    {
+        bool stopping = !running;
+        size_t n = ring.read(&in[0], CHUNK);
+        if (n == 0)
+        {
+            if (stopping)
+            {
+                return;
+            }
+            this_thread::sleep_for(chrono::milliseconds(5));
+            continue;
+        }
+        for (size_t i = 0; i < n * 2; i++)
+        {
+            float v = in[i] * 32767.0f;
+            v = v > 32767.0f ? 32767.0f : (v < -32768.0f ? -32768.0f : v);
+            out[i] = (int16_t)lrintf(v);
+        }
+        // The file is little endian, so is every host this runs on.
+        file.write((const char *)&out[0], n * 2 * sizeof(int16_t));
+        frames += n;
+    }
+}
+
+static void put_u32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static void put_u16(uint8_t *p, uint16_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+// RIFF header of a 16-bit stereo PCM file holding frames frames. Sizes over 4 GiB are clamped, players then read to
+// the end of the file.
+void AudioCapture::write_header()
+{
+    if (format != CaptureFormat_Wav)
+    {
+        return;
+    }
+    uint64_t bytes = frames * 4;
+    uint32_t data = bytes > 0xffffffffull - 36 ? 0xffffffffu - 36 : (uint32_t)bytes;
+    uint8_t h[44];
+    memcpy(h, "RIFF", 4);
+    put_u32(h + 4, 36 + data);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    put_u32(h + 16, 16);
+    put_u16(h + 20, 1);
+    put_u16(h + 22, 2);
+    put_u32(h + 24, sample_rate);
+    put_u32(h + 28, sample_rate * 4);
+    put_u16(h + 32, 4);
+    put_u16(h + 34, 16);
+    memcpy(h + 36, "data", 4);
+    put_u32(h + 40, data);
+    file.seekp(0);
+    file.write((const char *)h, sizeof(h));
+    file.seekp(0, ios::end);
+}
@@ -0,0 +1,57 @@
+#ifndef AudioCapture_1
+#define AudioCapture_1
+
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <thread>
+#include "AudioRing.h"
+#include "APU.h"
+
+typedef enum {
+    CaptureFormat_Wav, // 16-bit stereo PCM with a RIFF header.
+    CaptureFormat_Pcm, // The same samples without a header, signed 16-bit little endian, left then right.
+} CaptureFormat;
+
+// Streams the output of the APU to a file. The emulation thread only copies samples into an AudioRing. A writer
+// thread converts them to 16-bit and writes them out in chunks of CHUNK frames, so the emulation never waits on the
+// disk.
+//
+// The ring holds several seconds of sound. Should the writer still fall that far behind, samples are dropped rather
+// than the emulation blocked, and dropped counts them.
+class AudioCapture
+{
+public:
+    // Frames per write, and frames the ring holds.
+    static const uint32_t CHUNK = 32768;
+    static const uint32_t RING_FRAMES = 1 << 20;
+
+    std::atomic<uint64_t> dropped;
+
+    AudioCapture();
+    ~AudioCapture();
+
+    // Creates the file and starts the writer. Returns false if the file can not be created.
+    bool open(const std::string &path, CaptureFormat f, uint32_t rate);
+    // Moves the samples waiting in apu into the capture. It has to be called at least once per emulated second, the
+    // APU keeps no more than that.
+    void capture(Apu *apu);
+    // Writes what is left, completes the header and closes the file.
+    void close();
+
+private:
+    AudioRing ring;
+    std::ofstream file;
+    CaptureFormat format;
+    uint32_t sample_rate;
+    uint64_t frames;
+    std::thread writer;
+    std::atomic<bool> running;
+    bool opened;
+
+    void loop();
+    void write_header();
+};
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef AudioRing_1
+#define AudioRing_1
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+
+// Queue of interleaved stereo samples from the emulation thread to the audio device, for exactly one producer and one
+// consumer. Neither side ever blocks or takes a lock, which matters on the consumer side: it runs in the callback of
+// the audio device, where waiting on the emulation would be an underrun.
+//
+// head and tail count the frames (stereo samples) written and read since creation. Each is stored only by its own
+// side, with release order so the samples it covers are visible first, and loaded by the other side with acquire.
+// They sit on separate cache lines so the two sides do not invalidate each other's on every update.
+class AudioRing
+{
+public:
+    // Capacity in frames, rounded up to a power of two.
+    AudioRing(size_t frames)
+    {
+        size = 1;
+        while (size < frames)
+        {
+            size <<= 1;
+        }
+        buf = new float[size * 2];
+        head = 0;
+        tail = 0;
+    }
+
+    ~AudioRing()
+    {
+        delete[] buf;
+    }
+
+    // Producer side. Appends up to n frames of src and returns the number appended, frames that do not fit are
+    // dropped.
+    size_t write(const float *src, size_t n)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        size_t t = tail.load(std::memory_order_acquire);
+        n = std::min(n, size - (h - t));
+        size_t i = h & (size - 1);
+        size_t first = std::min(n, size - i);
+        memcpy(buf + i * 2, src, first * 2 * sizeof(float));
+        memcpy(buf, src + first * 2, (n - first) * 2 * sizeof(float));
+        head.store(h + n, std::memory_order_release);
+        return n;
+    }
+
+    // Consumer side. Moves up to n frames to dst and returns the number moved.
+    size_t read(float *dst, size_t n)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t h = head.load(std::memory_order_acquire);
+        n = std::min(n, h - t);
+        size_t i = t & (size - 1);
+        size_t first = std::min(n, size - i);
+        memcpy(dst, buf + i * 2, first * 2 * sizeof(float));
+        memcpy(dst + first * 2, buf, (n - first) * 2 * sizeof(float));
+        tail.store(t + n, std::memory_order_release);
+        return n;
+    }
+
+    // Frames waiting to be read. Either side may ask, the answer is only a snapshot. tail is loaded first: head only
+    // grows, so it can not be behind it then.
+    size_t fill() const
+    {
+        size_t t = tail.load(std::memory_order_acquire);
+        return head.load(std::memory_order_acquire) - t;
+    }
+
+    size_t capacity() const
+    {
+        return size;
+    }
+
+private:
+    float *buf;
+    size_t size;
+    char pad0[64];
+    std::atomic<size_t> head;
+    char pad1[64];
+    std::atomic<size_t> tail;
+    char pad2[64];
+};
+
+#endif
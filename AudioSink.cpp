@@ -0,0 +1,142 @@
+#include "AudioSink.h"
+#include <chrono>
+#include <cstring>
+
+using namespace std;
+
+AudioSink::AudioSink(AudioRing *r, uint32_t rate)
+{
+    ring = r;
+    sample_rate = rate;
+    opened = false;
+    underruns = 0;
+#ifdef __APPLE__
+    queue = NULL;
+#else
+    running = false;
+#endif
+}
+
+AudioSink::~AudioSink()
+{
+    close();
+}
+
+void AudioSink::pull(float *dst, uint32_t n)
+{
+    uint32_t got = (uint32_t)ring->read(dst, n);
+    if (got < n)
+    {
+        memset(dst + got * 2, 0, (n - got) * 2 * sizeof(float));
+        underruns += n - got;
+    }
+}
+
+#ifdef __APPLE__
+
+void AudioSink::callback(void *user, AudioQueueRef q, AudioQueueBufferRef b)
+{
+    AudioSink *sink = (AudioSink *)user;
+    sink->pull((float *)b->mAudioData, PERIOD);
+    b->mAudioDataByteSize = PERIOD * 2 * sizeof(float);
+    AudioQueueEnqueueBuffer(q, b, 0, NULL);
+}
+
+bool AudioSink::open()
+{
+    if (opened)
+    {
+        return true;
+    }
+    AudioStreamBasicDescription format;
+    memset(&format, 0, sizeof(format));
+    format.mSampleRate = sample_rate;
+    format.mFormatID = kAudioFormatLinearPCM;
+    format.mFormatFlags = kLinearPCMFormatFlagIsFloat | kAudioFormatFlagIsPacked;
+    format.mBytesPerPacket = 2 * sizeof(float);
+    format.mFramesPerPacket = 1;
+    format.mBytesPerFrame = 2 * sizeof(float);
+    format.mChannelsPerFrame = 2;
+    format.mBitsPerChannel = 32;
+    if (AudioQueueNewOutput(&format, callback, this, NULL, NULL, 0, &queue) != noErr)
+    {
+        queue = NULL;
+        return false;
+    }
+    // The buffers start out silent, the first callbacks come once they have played.
+    for (int i = 0; i < BUFFERS; i++)
+    {
+        AudioQueueBufferRef b;
+        if (AudioQueueAllocateBuffer(queue, PERIOD * 2 * sizeof(float), &b) != noErr)
+        {
+            AudioQueueDispose(queue, true);
+            queue = NULL;
+            return false;
+        }
+        memset(b->mAudioData, 0, PERIOD * 2 * sizeof(float));
+        b->mAudioDataByteSize = PERIOD * 2 * sizeof(float);
+        AudioQueueEnqueueBuffer(queue, b, 0, NULL);
+    }
+    if (AudioQueueStart(queue, NULL) != noErr)
+    {
+        AudioQueueDispose(queue, true);
+        queue = NULL;
+        return false;
+    }
+    opened = true;
+    return true;
+}
+
+void AudioSink::close()
+{
+    if (!opened)
+    {
+        return;
+    }
+    AudioQueueStop(queue, true);
+    AudioQueueDispose(queue, true);
+    queue = NULL;
+    opened = false;
+}
+
+#else
+
+// Consumes one period per period of the device rate, on deadlines counted from the start so the rate does not drift.
+void AudioSink::loop()
+{
+    float buf[PERIOD * 2];
+    uint64_t periods = 0;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    while (running)
+    {
+        periods++;
+        this_thread::sleep_until(start + chrono::duration_cast<chrono::steady_clock::duration>(
+            chrono::duration<double>((double)periods * PERIOD / sample_rate)));
+        pull(buf, PERIOD);
+    }
+}
+
+bool AudioSink::open()
+{
+    if (opened)
+    {
+        return true;
+    }
+    running = true;
+    thread = std::thread(&AudioSink::loop, this);
+    opened = true;
+    return true;
+}
+
+void AudioSink::close()
+{
+    if (!opened)
+    {
+        return;
+    }
+    running = false;
+    thread.join();
+    opened = false;
+}
+
+#endif
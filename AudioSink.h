@@ -0,0 +1,54 @@
+#ifndef AudioSink_1
+#define AudioSink_1
+
+#include <atomic>
+#include <cstdint>
+#include "AudioRing.h"
+#ifdef __APPLE__
+#include <AudioToolbox/AudioToolbox.h>
+#else
+#include <thread>
+#endif
+
+// The audio device, fed from an AudioRing. The device pulls PERIOD frames at a time, whatever the ring can not supply
+// is played as silence and counted in underruns.
+//
+// On macOS the device is an AudioQueue and the ring is read in its callback. Elsewhere there is no device backend: a
+// thread takes the samples at the device rate and discards them, so the emulation paced by it still runs at the
+// speed it would with sound.
+class AudioSink
+{
+public:
+    // Frames per device buffer, and number of buffers queued on the device.
+    static const uint32_t PERIOD = 512;
+    static const int BUFFERS = 3;
+
+    // Frames the device played as silence because the ring was empty.
+    std::atomic<uint64_t> underruns;
+
+    AudioSink(AudioRing *r, uint32_t rate);
+    ~AudioSink();
+
+    // Starts pulling from the ring. Returns false if the device can not be opened.
+    bool open();
+    void close();
+
+private:
+    AudioRing *ring;
+    uint32_t sample_rate;
+    bool opened;
+
+    // Fills dst with n frames from the ring, padded with silence.
+    void pull(float *dst, uint32_t n);
+
+#ifdef __APPLE__
+    AudioQueueRef queue;
+    static void callback(void *user, AudioQueueRef q, AudioQueueBufferRef b);
+#else
+    std::thread thread;
+    std::atomic<bool> running;
+    void loop();
+#endif
+};
+
+#endif
@@ -1,9 +1,13 @@
 #include "CPU.h"
 #include "Cartridge.h"
 #include "Util.h"
+#include "Alu.h"
+#include "Mmunit.h"
 #include <iostream>
 #include <thread>
 #include <ctime>
+#include <cerrno>
+#include <utility>
 
 // Nintendo documents describe the CPU & instructions speed in machine cycles while this document describes them in
 // clock cycles. Here is the translation:
@@ -160,27 +164,31 @@ Register::Register(Term term)
     pc = 0x0100;
 }    
 
-uint8_t Cpu::imm()
+template <typename M>
+uint8_t Cpu<M>::imm()
 {    
     uint8_t v = mem->get(reg->pc);
     reg->pc += 1;
     return v;
 }
 
-uint16_t Cpu::imm_word()
+template <typename M>
+uint16_t Cpu<M>::imm_word()
 {
     uint16_t v = mem->get_word(reg->pc);
     reg->pc += 2;
     return v;
 }
 
-void Cpu::stack_add(uint16_t v)
+template <typename M>
+void Cpu<M>::stack_add(uint16_t v)
 {        
     reg->sp -= 2;
     mem->set_word(reg->sp, v);
 }
 
-uint16_t Cpu::stack_pop() 
+template <typename M>
+uint16_t Cpu<M>::stack_pop() 
 {        
     uint16_t r = mem->get_word(reg->sp);
     reg->sp += 2;
@@ -195,7 +203,8 @@ uint16_t Cpu::stack_pop()
 // N - Reset.
 // H - Set if carry from bit 3.
 // C - Set if carry from bit 7.
-void Cpu::alu_add(uint8_t n)
+template <typename M>
+void Cpu<M>::alu_add(uint8_t n)
 {
     uint8_t a = reg->a;
     uint8_t r = wrapping_add(a, n);
@@ -214,7 +223,8 @@ void Cpu::alu_add(uint8_t n)
 // N - Reset.
 // H - Set if carry from bit 3.
 // C - Set if carry from bit 7.
-void Cpu::alu_adc(uint8_t n)
+template <typename M>
+void Cpu<M>::alu_adc(uint8_t n)
 {    
     uint8_t a = reg->a;
     uint8_t c = (uint8_t)reg->get_flag(Flag_C);
@@ -235,7 +245,8 @@ void Cpu::alu_adc(uint8_t n)
 // N - Set.
 // H - Set if no borrow from bit 4.
 // C - Set if no borrow
-void Cpu::alu_sub(uint8_t n) 
+template <typename M>
+void Cpu<M>::alu_sub(uint8_t n) 
 {    
     uint8_t a = reg->a;
     uint8_t r = wrapping_sub(a, n);
@@ -254,7 +265,8 @@ void Cpu::alu_sub(uint8_t n)
 // N - Set.
 // H - Set if no borrow from bit 4.
 // C - Set if no borrow.
-void Cpu::alu_sbc(uint8_t n)
+template <typename M>
+void Cpu<M>::alu_sbc(uint8_t n)
 {    
     uint8_t a = reg->a;
     uint8_t c = (uint8_t)reg->get_flag(Flag_C);
@@ -275,7 +287,8 @@ void Cpu::alu_sbc(uint8_t n)
 // N - Reset.
 // H - Set.
 // C - Reset
-void Cpu::alu_and(uint8_t n)
+template <typename M>
+void Cpu<M>::alu_and(uint8_t n)
 {
     uint8_t r = reg->a & n;
     reg->set_flag(Flag_C, false);
@@ -293,7 +306,8 @@ void Cpu::alu_and(uint8_t n)
 // N - Reset.
 // H - Reset.
 // C - Reset.
-void Cpu::alu_or(uint8_t n)
+template <typename M>
+void Cpu<M>::alu_or(uint8_t n)
 {    
     uint8_t r = reg->a | n;
     reg->set_flag(Flag_C, false);
@@ -311,7 +325,8 @@ void Cpu::alu_or(uint8_t n)
 // N - Reset.
 // H - Reset.
 // C - Reset.
-void Cpu::alu_xor(uint8_t n)
+template <typename M>
+void Cpu<M>::alu_xor(uint8_t n)
 {    
     uint8_t r = reg->a ^ n;
     reg->set_flag(Flag_C, false);
@@ -329,7 +344,8 @@ void Cpu::alu_xor(uint8_t n)
 // N - Set.
 // H - Set if no borrow from bit 4.
 // C - Set for no borrow. (Set if A < n.)
-void Cpu::alu_cp(uint8_t n)
+template <typename M>
+void Cpu<M>::alu_cp(uint8_t n)
 {
     uint8_t r = reg->a;
     alu_sub(n);
@@ -344,13 +360,11 @@ void Cpu::alu_cp(uint8_t n)
 // N - Reset.
 // H - Set if carry from bit 3.
 // C - Not affected.
-uint8_t Cpu::alu_inc(uint8_t a)
-{    
-    uint8_t r = wrapping_add(a, 1);
-    reg->set_flag(Flag_H, (a & 0x0f) + 0x01 > 0x0f);
-    reg->set_flag(Flag_N, false);
-    reg->set_flag(Flag_Z, r == 0x00);
-    return r;
+template <typename M>
+uint8_t Cpu<M>::alu_inc(uint8_t a)
+{
+    reg->f = (reg->f & Flag_C) | ALU_INC[a];
+    return wrapping_add(a, 1);
 }
 
 // Decrement register n.
@@ -361,13 +375,11 @@ uint8_t Cpu::alu_inc(uint8_t a)
 // N - Set.
 // H - Set if no borrow from bit 4.
 // C - Not affected
-uint8_t Cpu::alu_dec(uint8_t a)
-{    
-    uint8_t r = wrapping_sub(a, 1);
-    reg->set_flag(Flag_H, trailing_zeros(a) >= 4);
-    reg->set_flag(Flag_N, true);
-    reg->set_flag(Flag_Z, r == 0);
-    return r;
+template <typename M>
+uint8_t Cpu<M>::alu_dec(uint8_t a)
+{
+    reg->f = (reg->f & Flag_C) | ALU_DEC[a];
+    return wrapping_sub(a, 1);
 }
 
 // Add n to HL
@@ -378,7 +390,8 @@ uint8_t Cpu::alu_dec(uint8_t a)
 // N - Reset.
 // H - Set if carry from bit 11.
 // C - Set if carry from bit 15.
-void Cpu::alu_add_hl(uint16_t n)
+template <typename M>
+void Cpu<M>::alu_add_hl(uint16_t n)
 {    
     uint16_t a = reg->get_hl();
     uint16_t r = wrapping_add_16(a, n);
@@ -396,7 +409,8 @@ void Cpu::alu_add_hl(uint16_t n)
 // N - Reset.
 // H - Set or reset according to operation.
 // C - Set or reset according to operation.
-void Cpu::alu_add_sp()
+template <typename M>
+void Cpu<M>::alu_add_sp()
 {
     uint16_t a = reg->sp;
     uint16_t b = (uint16_t)(int16_t)(int8_t)imm();
@@ -415,12 +429,10 @@ void Cpu::alu_add_sp()
 // N - Reset.
 // H - Reset.
 // C - Reset.
-uint8_t Cpu::alu_swap(uint8_t a)
-{    
-    reg->set_flag(Flag_C, false);
-    reg->set_flag(Flag_H, false);
-    reg->set_flag(Flag_N, false);
-    reg->set_flag(Flag_Z, a == 0x00);
+template <typename M>
+uint8_t Cpu<M>::alu_swap(uint8_t a)
+{
+    reg->f = ALU_SWAP[a];
     return (a >> 4) | (a << 4);
 }
 
@@ -432,35 +444,12 @@ uint8_t Cpu::alu_swap(uint8_t a)
 // N - Not affected.
 // H - Reset.
 // C - Set or reset according to operation
-void Cpu::alu_daa()
+template <typename M>
+void Cpu<M>::alu_daa()
 {
-    uint8_t a = reg->a;
-    uint8_t adjust = reg->get_flag(Flag_C) ? 0x60 : 0x00;
-    if (reg->get_flag(Flag_H))
-    {
-        adjust |= 0x06;
-    }
-
-    if (reg->get_flag(Flag_N))
-    {
-        if (a & 0x0f > 0x09)
-        {
-            adjust |= 0x06;
-        };
-        if (a > 0x99)
-        {
-            adjust |= 0x60;
-        }
-        a = wrapping_add(a, adjust);
-    } else
-    {
-        a = wrapping_add(a, adjust);
-    }
-    
-    reg->set_flag(Flag_C, adjust >= 0x60);
-    reg->set_flag(Flag_H, false);
-    reg->set_flag(Flag_Z, a == 0x00);
-    reg->a = a;
+    uint16_t r = ALU_DAA[((uint16_t)(reg->f & (Flag_N | Flag_H | Flag_C)) << 4) | reg->a];
+    reg->f = (uint8_t)r;
+    reg->a = (uint8_t)(r >> 8);
 }
 
 // Complement A register. (Flip all bits.)
@@ -470,7 +459,8 @@ void Cpu::alu_daa()
 // N - Set.
 // H - Set.
 // C - Not affected.
-void Cpu::alu_cpl() {    
+template <typename M>
+void Cpu<M>::alu_cpl() {    
     reg->a = !reg->a;
     reg->set_flag(Flag_H, true);
     reg->set_flag(Flag_N, true);
@@ -483,7 +473,8 @@ void Cpu::alu_cpl() {
 // N - Reset.
 // H - Reset.
 // C - Complemented.
-void Cpu::alu_ccf() {    
+template <typename M>
+void Cpu<M>::alu_ccf() {    
     bool v = !reg->get_flag(Flag_C);
     reg->set_flag(Flag_C, v);
     reg->set_flag(Flag_H, false);
@@ -497,12 +488,21 @@ void Cpu::alu_ccf() {
 // N - Reset.
 // H - Reset.
 // C - Set.
-void Cpu::alu_scf() {    
+template <typename M>
+void Cpu<M>::alu_scf() {    
     reg->set_flag(Flag_C, true);
     reg->set_flag(Flag_H, false);
     reg->set_flag(Flag_N, false);
 }
 
+// Shared body of the rotate and shift group: a single load from ALU_SHIFT, indexed by the operand and the old carry.
+static inline uint8_t alu_shift(Register *reg, AluShift op, uint8_t a)
+{
+    uint16_t r = ALU_SHIFT[op][((uint16_t)(reg->f & Flag_C) << 4) | a];
+    reg->f = (uint8_t)r;
+    return (uint8_t)(r >> 8);
+}
+
 // Rotate A left. Old bit 7 to Carry flag.
 //
 // Flags affected:
@@ -510,15 +510,10 @@ void Cpu::alu_scf() {
 // N - Reset.
 // H - Reset.
 // C - Contains old bit 7 data.
-uint8_t Cpu::alu_rlc(uint8_t a)
-{       
-    bool c = (a & 0x80) >> 7 == 0x01;
-    uint8_t r = (a << 1) | (uint8_t)c;
-    reg->set_flag(Flag_C, c);
-    reg->set_flag(Flag_H, false);
-    reg->set_flag(Flag_N, false);
-    reg->set_flag(Flag_Z, r == 0x00);
-    return r;
+template <typename M>
+uint8_t Cpu<M>::alu_rlc(uint8_t a)
+{
+    return alu_shift(reg, AluShift_Rlc, a);
 }
 
 // Rotate A left through Carry flag.
@@ -528,15 +523,10 @@ uint8_t Cpu::alu_rlc(uint8_t a)
 // N - Reset.
 // H - Reset.
 // C - Contains old bit 7 data.
-uint8_t Cpu::alu_rl(uint8_t a)
-{    
-    bool c = (a & 0x80) >> 7 == 0x01;
-    uint8_t r = (a << 1) + (uint8_t)reg->get_flag(Flag_C);
-    reg->set_flag(Flag_C, c);
-    reg->set_flag(Flag_H, false);
-    reg->set_flag(Flag_N, false);
-    reg->set_flag(Flag_Z, r == 0x00);
-    return r;
+template <typename M>
+uint8_t Cpu<M>::alu_rl(uint8_t a)
+{
+    return alu_shift(reg, AluShift_Rl, a);
 }
 
 // Rotate A right. Old bit 0 to Carry flag.
@@ -546,15 +536,10 @@ uint8_t Cpu::alu_rl(uint8_t a)
 // N - Reset.
 // H - Reset.
 // C - Contains old bit 0 data
-uint8_t Cpu::alu_rrc(uint8_t a)
-{    
-    bool c = a & 0x01 == 0x01;
-    uint8_t r = c ? (0x80 | (a >> 1)) : (a >> 1);
-    reg->set_flag(Flag_C, c);
-    reg->set_flag(Flag_H, false);
-    reg->set_flag(Flag_N, false);
-    reg->set_flag(Flag_Z, r == 0x00);
-    return r;
+template <typename M>
+uint8_t Cpu<M>::alu_rrc(uint8_t a)
+{
+    return alu_shift(reg, AluShift_Rrc, a);
 }
 
 // Rotate A right through Carry flag.
@@ -564,15 +549,10 @@ uint8_t Cpu::alu_rrc(uint8_t a)
 // N - Reset.
 // H - Reset.
 // C - Contains old bit 0 data.
-uint8_t Cpu::alu_rr(uint8_t a)
-{    
-    bool c = a & 0x01 == 0x01;
-    uint8_t r = reg->get_flag(Flag_C) ? (0x80 | (a >> 1)) : (a >> 1);
-    reg->set_flag(Flag_C, c);
-    reg->set_flag(Flag_H, false);
-    reg->set_flag(Flag_N, false);
-    reg->set_flag(Flag_Z, r == 0x00);
-    return r;
+template <typename M>
+uint8_t Cpu<M>::alu_rr(uint8_t a)
+{
+    return alu_shift(reg, AluShift_Rr, a);
 }
 
 // Shift n left into Carry. LSB of n set to 0.
@@ -583,15 +563,10 @@ uint8_t Cpu::alu_rr(uint8_t a)
 // N - Reset.
 // H - Reset.
 // C - Contains old bit 7 data
-uint8_t Cpu::alu_sla(uint8_t a)
-{    
-    bool c = (a & 0x80) >> 7 == 0x01;
-    uint8_t r = a << 1;
-    reg->set_flag(Flag_C, c);
-    reg->set_flag(Flag_H, false);
-    reg->set_flag(Flag_N, false);
-    reg->set_flag(Flag_Z, r == 0x00);
-    return r;
+template <typename M>
+uint8_t Cpu<M>::alu_sla(uint8_t a)
+{
+    return alu_shift(reg, AluShift_Sla, a);
 }
 
 // Shift n right into Carry. MSB doesn't change.
@@ -602,15 +577,10 @@ uint8_t Cpu::alu_sla(uint8_t a)
 // N - Reset.
 // H - Reset.
 // C - Contains old bit 0 data.
-uint8_t Cpu::alu_sra(uint8_t a)
-{    
-    bool c = a & 0x01 == 0x01;
-    uint8_t r = (a >> 1) | (a & 0x80);
-    reg->set_flag(Flag_C, c);
-    reg->set_flag(Flag_H, false);
-    reg->set_flag(Flag_N, false);
-    reg->set_flag(Flag_Z, r == 0x00);
-    return r;
+template <typename M>
+uint8_t Cpu<M>::alu_sra(uint8_t a)
+{
+    return alu_shift(reg, AluShift_Sra, a);
 }
 
 // Shift n right into Carry. MSB set to 0.
@@ -621,15 +591,10 @@ uint8_t Cpu::alu_sra(uint8_t a)
 // N - Reset.
 // H - Reset.
 // C - Contains old bit 0 data.
-uint8_t Cpu::alu_srl(uint8_t a)
-{    
-    bool c = a & 0x01 == 0x01;
-    uint8_t r = a >> 1;
-    reg->set_flag(Flag_C, c);
-    reg->set_flag(Flag_H, false);
-    reg->set_flag(Flag_N, false);
-    reg->set_flag(Flag_Z, r == 0x00);
-    return r;
+template <typename M>
+uint8_t Cpu<M>::alu_srl(uint8_t a)
+{
+    return alu_shift(reg, AluShift_Srl, a);
 }
 
 // Test bit b in register r.
@@ -640,19 +605,19 @@ uint8_t Cpu::alu_srl(uint8_t a)
 // N - Reset.
 // H - Set.
 // C - Not affected
-void Cpu::alu_bit(uint8_t a, uint8_t b)
-{    
-    bool r = a & (1 << b) == 0x00;
-    reg->set_flag(Flag_H, true);
-    reg->set_flag(Flag_N, false);
-    reg->set_flag(Flag_Z, r);    
+template <typename M>
+void Cpu<M>::alu_bit(uint8_t a, uint8_t b)
+{
+    bool r = (a & (1 << b)) == 0x00;
+    reg->f = (reg->f & Flag_C) | Flag_H | (r ? Flag_Z : 0x00);
 }
 
 // Set bit b in register r.
 // b = 0 - 7, r = A,B,C,D,E,H,L,(HL)
 //
 // Flags affected:  None.
-uint8_t Cpu::alu_set(uint8_t a, uint8_t b)
+template <typename M>
+uint8_t Cpu<M>::alu_set(uint8_t a, uint8_t b)
 {
     return a | (1 << b);
 }
@@ -661,31 +626,256 @@ uint8_t Cpu::alu_set(uint8_t a, uint8_t b)
 // b = 0 - 7, r = A,B,C,D,E,H,L,(HL)
 //
 // Flags affected:  None.
-uint8_t Cpu::alu_res(uint8_t a, uint8_t b)
+template <typename M>
+uint8_t Cpu<M>::alu_res(uint8_t a, uint8_t b)
 {
-    return a & !(1 << b);
+    return a & ~(1 << b);
 }
 
 // Add n to current address and jump to it.
 // n = one byte signed immediate value
-void Cpu::alu_jr(uint8_t n)
+template <typename M>
+void Cpu<M>::alu_jr(uint8_t n)
 {    
     int8_t v = (int8_t)n;
-    reg->pc = (uint16_t)((int32_t)(uint32_t)reg->pc + (int32_t)n);
+    reg->pc = (uint16_t)((int32_t)(uint32_t)reg->pc + (int32_t)v);
+}
+
+// Operand of a 0xcb prefixed instruction, encoded in bits 2-0: B, C, D, E, H, L, (HL), A. (HL) never reaches here.
+static inline uint8_t &cb_reg(Register *reg, uint8_t r)
+{
+    switch (r)
+    {
+    case 0x00: return reg->b;
+    case 0x01: return reg->c;
+    case 0x02: return reg->d;
+    case 0x03: return reg->e;
+    case 0x04: return reg->h;
+    case 0x05: return reg->l;
+    default: return reg->a;
+    }
 }
 
-Cpu::Cpu(Term term, Memory *m): mem(m)
+// Operation of a 0xcb prefixed instruction. Op is bits 7-6, B is bits 5-3 which is either the bit index or, for
+// Op = CbOp_Rot, the rotate/shift to perform: RLC, RRC, RL, RR, SLA, SRA, SWAP, SRL.
+template <uint8_t Op, uint8_t B, typename M>
+static inline uint8_t cb_alu(Cpu<M> *cpu, uint8_t v)
+{
+    switch (Op)
+    {
+    case CbOp_Rot:
+        switch (B)
+        {
+        case 0x00: return cpu->alu_rlc(v);
+        case 0x01: return cpu->alu_rrc(v);
+        case 0x02: return cpu->alu_rl(v);
+        case 0x03: return cpu->alu_rr(v);
+        case 0x04: return cpu->alu_sla(v);
+        case 0x05: return cpu->alu_sra(v);
+        case 0x06: return cpu->alu_swap(v);
+        default: return cpu->alu_srl(v);
+        }
+    case CbOp_Bit:
+        cpu->alu_bit(v, B);
+        return v;
+    case CbOp_Res:
+        return cpu->alu_res(v, B);
+    default:
+        return cpu->alu_set(v, B);
+    }
+}
+
+// Every 0xcb prefixed instruction is an instance of this handler. Register operands are read and written in place,
+// only the (HL) variants go through the memory bus, and BIT (HL) never writes back.
+template <typename M>
+template <uint8_t Op, uint8_t B, uint8_t R>
+void Cpu<M>::cb()
+{
+    if (R == 0x06)
+    {
+        uint16_t a = reg->get_hl();
+        uint8_t v = cb_alu<Op, B>(this, mem->get(a));
+        if (Op != CbOp_Bit)
+        {
+            mem->set(a, v);
+        }
+        return;
+    }
+    uint8_t &r = cb_reg(reg, R);
+    uint8_t v = cb_alu<Op, B>(this, r);
+    if (Op != CbOp_Bit)
+    {
+        r = v;
+    }
+}
+
+template <typename M, size_t... I>
+struct CbTable {
+    typedef void (Cpu<M>::*Handler)();
+    static const Handler handlers[sizeof...(I)];
+};
+
+template <typename M, size_t... I>
+const typename CbTable<M, I...>::Handler CbTable<M, I...>::handlers[sizeof...(I)] = {
+    &Cpu<M>::template cb<(uint8_t)(I >> 6), (uint8_t)((I >> 3) & 0x07), (uint8_t)(I & 0x07)>...
+};
+
+template <typename M, size_t... I>
+CbTable<M, I...> cb_table(index_sequence<I...>);
+
+// Dense jump table of the 256 0xcb prefixed instructions, indexed by the second opcode byte.
+template <typename M>
+struct CbHandlers: public decltype(cb_table<M>(make_index_sequence<256>())) {};
+
+template <typename M>
+Cpu<M>::Cpu(Term term, M *m): mem(m)
 {
     reg = new Register(term);
     halted = false;
     ei = true;
+    fusion = false;
+    horizon = 0;
 }
 
-Cpu::~Cpu()
+template <typename M>
+Cpu<M>::~Cpu()
 {
     delete reg;
 }
 
+// Condition of JR/JP/CALL/RET cc, selected by bits 4-3 of the opcode: NZ, Z, NC, C.
+template <typename M>
+bool Cpu<M>::cond(uint8_t opcode)
+{
+    switch ((opcode >> 3) & 0x03)
+    {
+    case 0x00: return !reg->get_flag(Flag_Z);
+    case 0x01: return reg->get_flag(Flag_Z);
+    case 0x02: return !reg->get_flag(Flag_C);
+    default: return reg->get_flag(Flag_C);
+    }
+}
+
+// Superinstructions only ever write to memory without side effects on the peripherals, so that performing the write
+// before the peripherals caught up with the preceding instructions is unobservable: VRAM, external RAM, WRAM and HRAM.
+// Writes below 0x8000 select MBC banks, and the echo of WRAM, OAM and the IO registers are left to the interpreter.
+static inline bool fusable_addr(uint16_t a)
+{
+    return (a >= 0x8000 && a < 0xe000) || (a >= 0xff80 && a <= 0xfffe);
+}
+
+// Superinstructions fuse a frequent instruction sequence into one dispatch and return the summed machine cycles, or 0
+// when the code at PC does not match or the sequence may not be fused. Peripherals only catch up after the whole
+// sequence, so a sequence is fused only when its worst case duration fits in `horizon`: no interrupt can be requested
+// and no scanline rendered in between, and the result is identical to running the instructions one by one.
+template <typename M>
+uint32_t Cpu<M>::fused()
+{
+    switch (mem->get(reg->pc))
+    {
+    case 0x2a: return fuse_copy();
+    case 0x0b: return fuse_delay();
+    case 0xf0: return fuse_poll();
+    default: return 0;
+    }
+}
+
+// LD A, (HL+); LD (DE), A; INC DE; DEC B; JR NZ, e
+// Body of the usual byte copy loop.
+template <typename M>
+uint32_t Cpu<M>::fuse_copy()
+{
+    uint16_t pc = reg->pc;
+    if (horizon < 10 * 4)
+    {
+        return 0;
+    }
+    if (mem->get(pc + 1) != 0x12 || mem->get(pc + 2) != 0x13 || mem->get(pc + 3) != 0x05 || mem->get(pc + 4) != 0x20)
+    {
+        return 0;
+    }
+    // The opcodes are read before the write, which must not land on them.
+    uint16_t de = reg->get_de();
+    if (!fusable_addr(de) || (uint16_t)(de - pc) < 6)
+    {
+        return 0;
+    }
+    uint8_t n = mem->get(pc + 5);
+    reg->pc = pc + 6;
+
+    uint16_t hl = reg->get_hl();
+    reg->a = mem->get(hl);
+    reg->set_hl(hl + 1);
+    mem->set(de, reg->a);
+    reg->set_de(wrapping_add_16(de, 1));
+    reg->b = alu_dec(reg->b);
+    if (cond(0x20))
+    {
+        alu_jr(n);
+        return 10;
+    }
+    return 9;
+}
+
+// DEC BC; LD A, B; OR C; JR NZ, e
+// Body of the usual 16-bit delay loop.
+template <typename M>
+uint32_t Cpu<M>::fuse_delay()
+{
+    uint16_t pc = reg->pc;
+    if (horizon < 7 * 4)
+    {
+        return 0;
+    }
+    if (mem->get(pc + 1) != 0x78 || mem->get(pc + 2) != 0xb1 || mem->get(pc + 3) != 0x20)
+    {
+        return 0;
+    }
+    uint8_t n = mem->get(pc + 4);
+    reg->pc = pc + 5;
+
+    reg->set_bc(wrapping_sub_16(reg->get_bc(), 1));
+    reg->a = reg->b;
+    alu_or(reg->c);
+    if (cond(0x20))
+    {
+        alu_jr(n);
+        return 7;
+    }
+    return 6;
+}
+
+// LDH A, (a8); CP d8; JR [cc,] e
+// Polling of an IO register, usually LY or STAT. Only the first instruction reads memory, so the IO register is read
+// with the peripherals exactly up to date.
+template <typename M>
+uint32_t Cpu<M>::fuse_poll()
+{
+    uint16_t pc = reg->pc;
+    if (horizon < 8 * 4)
+    {
+        return 0;
+    }
+    uint8_t jr = mem->get(pc + 4);
+    if (mem->get(pc + 2) != 0xfe || (jr != 0x18 && jr != 0x20 && jr != 0x28 && jr != 0x30 && jr != 0x38))
+    {
+        return 0;
+    }
+    uint8_t a = mem->get(pc + 1);
+    uint8_t v = mem->get(pc + 3);
+    uint8_t n = mem->get(pc + 5);
+    reg->pc = pc + 6;
+
+    reg->a = mem->get(0xff00 | (uint16_t)a);
+    alu_cp(v);
+    if (jr == 0x18 || cond(jr))
+    {
+        alu_jr(n);
+        return 8;
+    }
+    return 7;
+}
+
 // The IME (interrupt master enable) flag is reset by DI and prohibits all interrupts. It is set by EI and
 // acknowledges the interrupt setting by the IE register.
 // 1. When an interrupt is generated, the IF flag will be set.
@@ -693,7 +883,8 @@ Cpu::~Cpu()
 // 3. Reset the IME flag and prevent all interrupts.
 // 4. The PC (program counter) is pushed onto the stack.
 // 5. Jump to the starting address of the interrupt.
-uint32_t Cpu::hi()
+template <typename M>
+uint32_t Cpu<M>::hi()
 {
     if (!halted && !ei)
     {
@@ -732,8 +923,18 @@ uint32_t Cpu::hi()
     return 4;
 }
 
-uint32_t Cpu::ex()
+template <typename M>
+uint32_t Cpu<M>::ex()
 {
+    if (fusion)
+    {
+        uint32_t c = fused();
+        if (c != 0)
+        {
+            return c;
+        }
+    }
+
     uint8_t opcode = imm();
     uint8_t cbcode = 0;
     
@@ -817,7 +1018,7 @@ uint32_t Cpu::ex()
     }
 
     // LD A, (HL-)
-    if (opcode == 0x2a)
+    if (opcode == 0x3a)
     {        
         uint16_t v = reg->get_hl();
         reg->a = mem->get(v);
@@ -1325,15 +1526,9 @@ uint32_t Cpu::ex()
     }
 
     // JR IF
-    if (opcode == (0x20 | 0x28 | 0x30 | 0x38 )) {
-        bool cond = false;        
-        if (opcode == 0x20 ) cond = !reg->get_flag(Flag_Z);
-        if (opcode == 0x28 ) cond = reg->get_flag(Flag_Z);
-        if (opcode == 0x30 ) cond = !reg->get_flag(Flag_C);
-        if (opcode == 0x38 ) cond = reg->get_flag(Flag_C);
-    
+    if (opcode == 0x20 || opcode == 0x28 || opcode == 0x30 || opcode == 0x38) {
         uint8_t n = imm();
-        if (cond) {
+        if (cond(opcode)) {
             alu_jr( n );
         }
     }
@@ -1418,470 +1613,7 @@ uint32_t Cpu::ex()
     if (opcode == 0xcb) {
         cbcode = mem->get(reg->pc);
         reg->pc += 1;
-        
-        switch (cbcode) {
-                // RLC r8
-                case 0x00: reg->b = alu_rlc(reg->b); break;
-                case 0x01: reg->c = alu_rlc(reg->c); break;
-                case 0x02: reg->d = alu_rlc(reg->d); break;
-                case 0x03: reg->e = alu_rlc(reg->e); break;
-                case 0x04: reg->h = alu_rlc(reg->h); break;
-                case 0x05: reg->l = alu_rlc(reg->l); break;
-                case 0x06: {
-                    uint16_t a = reg->get_hl();
-                    uint8_t v = mem->get(a);
-                    uint8_t h = alu_rlc(v);
-                    mem->set(a, h);
-                }
-                break;
-                case 0x07: reg->a = alu_rlc(reg->a); break;
-
-                // RRC r8
-                case 0x08: reg->b = alu_rrc(reg->b); break;
-                case 0x09: reg->c = alu_rrc(reg->c); break;
-                case 0x0a: reg->d = alu_rrc(reg->d); break;
-                case 0x0b: reg->e = alu_rrc(reg->e); break;
-                case 0x0c: reg->h = alu_rrc(reg->h); break;
-                case 0x0d: reg->l = alu_rrc(reg->l); break;
-                case 0x0e: {
-                    uint16_t a = reg->get_hl();
-                    uint8_t v = mem->get(a);
-                    uint8_t h = alu_rrc(v);
-                    mem->set(a, h);
-                }
-                break;
-                case 0x0f: reg->a = alu_rrc(reg->a); break;
-
-                // RL r8
-                case 0x10: reg->b = alu_rl(reg->b); break;
-                case 0x11: reg->c = alu_rl(reg->c); break;
-                case 0x12: reg->d = alu_rl(reg->d); break;
-                case 0x13: reg->e = alu_rl(reg->e); break;
-                case 0x14: reg->h = alu_rl(reg->h); break;
-                case 0x15: reg->l = alu_rl(reg->l); break;
-                case 0x16: {
-                    uint16_t a = reg->get_hl();
-                    uint8_t v = mem->get(a);
-                    uint8_t h = alu_rl(v);
-                    mem->set(a, h);
-                }
-                break;
-                case 0x17: reg->a = alu_rl(reg->a); break;
-
-                // RR r8
-                case 0x18: reg->b = alu_rr(reg->b); break;
-                case 0x19: reg->c = alu_rr(reg->c); break;
-                case 0x1a: reg->d = alu_rr(reg->d); break;
-                case 0x1b: reg->e = alu_rr(reg->e); break;
-                case 0x1c: reg->h = alu_rr(reg->h); break;
-                case 0x1d: reg->l = alu_rr(reg->l); break;
-                case 0x1e: {
-                    uint16_t a = reg->get_hl();
-                    uint8_t v = mem->get(a);
-                    uint8_t h =alu_rr(v);
-                    mem->set(a, h);
-                }
-                break;
-                case 0x1f: reg->a = alu_rr(reg->a); break;
-
-                // SLA r8
-                case 0x20: reg->b = alu_sla(reg->b); break;
-                case 0x21: reg->c = alu_sla(reg->c); break;
-                case 0x22: reg->d = alu_sla(reg->d); break;
-                case 0x23: reg->e = alu_sla(reg->e); break;
-                case 0x24: reg->h = alu_sla(reg->h); break;
-                case 0x25: reg->l = alu_sla(reg->l); break;
-                case 0x26: {
-                    uint16_t a =reg->get_hl();
-                    uint8_t v = mem->get(a);
-                    uint8_t h =alu_sla(v);
-                    mem->set(a, h);
-                }
-                break;
-                case 0x27: reg->a = alu_sla(reg->a); break;
-
-                // SRA r8
-                case 0x28: reg->b = alu_sra(reg->b); break;
-                case 0x29: reg->c = alu_sra(reg->c); break;
-                case 0x2a: reg->d = alu_sra(reg->d); break;
-                case 0x2b: reg->e = alu_sra(reg->e); break;
-                case 0x2c: reg->h = alu_sra(reg->h); break;
-                case 0x2d: reg->l = alu_sra(reg->l); break;
-                case 0x2e: {
-                    uint16_t a =reg->get_hl();
-                    uint8_t v = mem->get(a);
-                    uint8_t h = alu_sra(v);
-                    mem->set(a, h);
-                }
-                break;
-                case 0x2f: reg->a = alu_sra(reg->a); break;
-
-                // SWAP r8
-                case 0x30: reg->b = alu_swap(reg->b); break;
-                case 0x31: reg->c = alu_swap(reg->c); break;
-                case 0x32: reg->d = alu_swap(reg->d); break;
-                case 0x33: reg->e = alu_swap(reg->e); break;
-                case 0x34: reg->h = alu_swap(reg->h); break;
-                case 0x35: reg->l = alu_swap(reg->l); break;
-                case 0x36: {
-                    uint16_t a =reg->get_hl();
-                    uint8_t v = mem->get(a);
-                    uint8_t h =alu_swap(v);
-                    mem->set(a, h);
-                }
-                break;
-                case 0x37: reg->a = alu_swap(reg->a); break;
-
-                // SRL r8
-                case 0x38: reg->b = alu_srl(reg->b); break;
-                case 0x39: reg->c = alu_srl(reg->c); break;
-                case 0x3a: reg->d = alu_srl(reg->d); break;
-                case 0x3b: reg->e = alu_srl(reg->e); break;
-                case 0x3c: reg->h = alu_srl(reg->h); break;
-                case 0x3d: reg->l = alu_srl(reg->l); break;
-                case 0x3e: {
-                    uint16_t a =reg->get_hl();
-                    uint8_t v = mem->get(a);
-                    uint8_t h =alu_srl(v);
-                    mem->set(a, h);
-                }
-                break;
-                case 0x3f: reg->a = alu_srl(reg->a); break;
-
-                // BIT b, r8
-                case 0x40: alu_bit(reg->b, 0); break;
-                case 0x41: alu_bit(reg->c, 0); break;
-                case 0x42: alu_bit(reg->d, 0); break;
-                case 0x43: alu_bit(reg->e, 0); break;
-                case 0x44: alu_bit(reg->h, 0); break;
-                case 0x45: alu_bit(reg->l, 0); break;
-                case 0x46: {
-                    uint16_t a =reg->get_hl();
-                    uint8_t v = mem->get(a);
-                    alu_bit(v, 0);
-                }
-                break;
-                case 0x47: alu_bit(reg->a, 0); break;
-                case 0x48: alu_bit(reg->b, 1); break;
-                case 0x49: alu_bit(reg->c, 1); break;
-                case 0x4a: alu_bit(reg->d, 1); break;
-                case 0x4b: alu_bit(reg->e, 1); break;
-                case 0x4c: alu_bit(reg->h, 1); break;
-                case 0x4d: alu_bit(reg->l, 1); break;
-                case 0x4e: {
-                    uint16_t a =reg->get_hl();
-                    uint8_t v = mem->get(a);
-                    alu_bit(v, 1);
-                }
-                break;
-                case 0x4f: alu_bit(reg->a, 1); break;
-                case 0x50: alu_bit(reg->b, 2); break;
-                case 0x51: alu_bit(reg->c, 2); break;
-                case 0x52: alu_bit(reg->d, 2); break;
-                case 0x53: alu_bit(reg->e, 2); break;
-                case 0x54: alu_bit(reg->h, 2); break;
-                case 0x55: alu_bit(reg->l, 2); break;
-                case 0x56: {
-                    uint16_t a =reg->get_hl();
-                    uint8_t v = mem->get(a);
-                    alu_bit(v, 2);
-                }
-                break;
-                case 0x57: alu_bit(reg->a, 2); break;
-                case 0x58: alu_bit(reg->b, 3); break;
-                case 0x59: alu_bit(reg->c, 3); break;
-                case 0x5a: alu_bit(reg->d, 3); break;
-                case 0x5b: alu_bit(reg->e, 3); break;
-                case 0x5c: alu_bit(reg->h, 3); break;
-                case 0x5d: alu_bit(reg->l, 3); break;
-                case 0x5e: {
-                    uint16_t a =reg->get_hl();
-                    uint8_t v = mem->get(a);
-                    alu_bit(v, 3);
-                }
-                break;
-                case 0x5f: alu_bit(reg->a, 3); break;
-                case 0x60: alu_bit(reg->b, 4); break;
-                case 0x61: alu_bit(reg->c, 4); break;
-                case 0x62: alu_bit(reg->d, 4); break;
-                case 0x63: alu_bit(reg->e, 4); break;
-                case 0x64: alu_bit(reg->h, 4); break;
-                case 0x65: alu_bit(reg->l, 4); break;
-                case 0x66: {
-                    uint16_t a =reg->get_hl();
-                    uint8_t v = mem->get(a);
-                    alu_bit(v, 4);
-                }
-                break;
-                case 0x67: alu_bit(reg->a, 4); break;
-                case 0x68: alu_bit(reg->b, 5); break;
-                case 0x69: alu_bit(reg->c, 5); break;
-                case 0x6a: alu_bit(reg->d, 5); break;
-                case 0x6b: alu_bit(reg->e, 5); break;
-                case 0x6c: alu_bit(reg->h, 5); break;
-                case 0x6d: alu_bit(reg->l, 5); break;
-                case 0x6e: {
-                    uint16_t a =reg->get_hl();
-                    uint8_t v = mem->get(a);
-                    alu_bit(v, 5);
-                }
-                break;
-                case 0x6f: alu_bit(reg->a, 5); break;
-                case 0x70: alu_bit(reg->b, 6); break;
-                case 0x71: alu_bit(reg->c, 6); break;
-                case 0x72: alu_bit(reg->d, 6); break;
-                case 0x73: alu_bit(reg->e, 6); break;
-                case 0x74: alu_bit(reg->h, 6); break;
-                case 0x75: alu_bit(reg->l, 6); break;
-                case 0x76: {
-                    uint16_t a =reg->get_hl();
-                    uint8_t v = mem->get(a);
-                    alu_bit(v, 6);
-                }
-                break;
-                case 0x77: alu_bit(reg->a, 6); break;
-                case 0x78: alu_bit(reg->b, 7); break;
-                case 0x79: alu_bit(reg->c, 7); break;
-                case 0x7a: alu_bit(reg->d, 7); break;
-                case 0x7b: alu_bit(reg->e, 7); break;
-                case 0x7c: alu_bit(reg->h, 7); break;
-                case 0x7d: alu_bit(reg->l, 7); break;
-                case 0x7e: {
-                    uint16_t a =reg->get_hl();
-                    uint8_t v = mem->get(a);
-                    alu_bit(v, 7);
-                }
-                break;
-                case 0x7f: alu_bit(reg->a, 7); break;
-
-                // RES b, r8
-                case 0x80: reg->b = alu_res(reg->b, 0); break;
-                case 0x81: reg->c = alu_res(reg->c, 0); break;
-                case 0x82: reg->d = alu_res(reg->d, 0); break;
-                case 0x83: reg->e = alu_res(reg->e, 0); break;
-                case 0x84: reg->h = alu_res(reg->h, 0); break;
-                case 0x85: reg->l = alu_res(reg->l, 0); break;
-                case 0x86: {
-                    uint16_t a =reg->get_hl();
-                    uint8_t v = mem->get(a);
-                    uint8_t h =alu_res(v, 0);
-                    mem->set(a, h);
-                }
-                break;
-                case 0x87: reg->a = alu_res(reg->a, 0); break;
-                case 0x88: reg->b = alu_res(reg->b, 1); break;
-                case 0x89: reg->c = alu_res(reg->c, 1); break;
-                case 0x8a: reg->d = alu_res(reg->d, 1); break;
-                case 0x8b: reg->e = alu_res(reg->e, 1); break;
-                case 0x8c: reg->h = alu_res(reg->h, 1); break;
-                case 0x8d: reg->l = alu_res(reg->l, 1); break;
-                case 0x8e: {
-                    uint16_t a =reg->get_hl();
-                    uint8_t v = mem->get(a);
-                    uint8_t h =alu_res(v, 1);
-                    mem->set(a, h);
-                }
-                break;
-                case 0x8f: reg->a = alu_res(reg->a, 1); break;
-                case 0x90: reg->b = alu_res(reg->b, 2); break;
-                case 0x91: reg->c = alu_res(reg->c, 2); break;
-                case 0x92: reg->d = alu_res(reg->d, 2); break;
-                case 0x93: reg->e = alu_res(reg->e, 2); break;
-                case 0x94: reg->h = alu_res(reg->h, 2); break;
-                case 0x95: reg->l = alu_res(reg->l, 2); break;
-                case 0x96: {
-                    uint16_t a =reg->get_hl();
-                    uint8_t v = mem->get(a);
-                    uint8_t h =alu_res(v, 2);
-                    mem->set(a, h);
-                }
-                break;
-                case 0x97: reg->a = alu_res(reg->a, 2); break;
-                case 0x98: reg->b = alu_res(reg->b, 3); break;
-                case 0x99: reg->c = alu_res(reg->c, 3); break;
-                case 0x9a: reg->d = alu_res(reg->d, 3); break;
-                case 0x9b: reg->e = alu_res(reg->e, 3); break;
-                case 0x9c: reg->h = alu_res(reg->h, 3); break;
-                case 0x9d: reg->l = alu_res(reg->l, 3); break;
-                case 0x9e: {
-                    uint16_t a =reg->get_hl();
-                    uint8_t v = mem->get(a);
-                    uint8_t h =alu_res(v, 3);
-                    mem->set(a, h);
-                }
-                break;
-                case 0x9f: reg->a = alu_res(reg->a, 3); break;
-                case 0xa0: reg->b = alu_res(reg->b, 4); break;
-                case 0xa1: reg->c = alu_res(reg->c, 4); break;
-                case 0xa2: reg->d = alu_res(reg->d, 4); break;
-                case 0xa3: reg->e = alu_res(reg->e, 4); break;
-                case 0xa4: reg->h = alu_res(reg->h, 4); break;
-                case 0xa5: reg->l = alu_res(reg->l, 4); break;
-                case 0xa6: {
-                    uint16_t a =reg->get_hl();
-                    uint8_t v = mem->get(a);
-                    uint8_t h =alu_res(v, 4);
-                    mem->set(a, h);
-                }
-                break;
-                case 0xa7: reg->a = alu_res(reg->a, 4); break;
-                case 0xa8: reg->b = alu_res(reg->b, 5); break;
-                case 0xa9: reg->c = alu_res(reg->c, 5); break;
-                case 0xaa: reg->d = alu_res(reg->d, 5); break;
-                case 0xab: reg->e = alu_res(reg->e, 5); break;
-                case 0xac: reg->h = alu_res(reg->h, 5); break;
-                case 0xad: reg->l = alu_res(reg->l, 5); break;
-                case 0xae: {
-                    uint16_t a =reg->get_hl();
-                    uint8_t v = mem->get(a);
-                    uint8_t h =alu_res(v, 5);
-                    mem->set(a, h);
-                }
-                break;
-                case 0xaf: reg->a = alu_res(reg->a, 5); break;
-                case 0xb0: reg->b = alu_res(reg->b, 6); break;
-                case 0xb1: reg->c = alu_res(reg->c, 6); break;
-                case 0xb2: reg->d = alu_res(reg->d, 6); break;
-                case 0xb3: reg->e = alu_res(reg->e, 6); break;
-                case 0xb4: reg->h = alu_res(reg->h, 6); break;
-                case 0xb5: reg->l = alu_res(reg->l, 6); break;
-                case 0xb6: {
-                    uint16_t a =reg->get_hl();
-                    uint8_t v = mem->get(a);
-                    uint8_t h =alu_res(v, 6);
-                    mem->set(a, h);
-                }
-                break;
-                case 0xb7: reg->a = alu_res(reg->a, 6); break;
-                case 0xb8: reg->b = alu_res(reg->b, 7); break;
-                case 0xb9: reg->c = alu_res(reg->c, 7); break;
-                case 0xba: reg->d = alu_res(reg->d, 7); break;
-                case 0xbb: reg->e = alu_res(reg->e, 7); break;
-                case 0xbc: reg->h = alu_res(reg->h, 7); break;
-                case 0xbd: reg->l = alu_res(reg->l, 7); break;
-                case 0xbe: {
-                    uint16_t a =reg->get_hl();
-                    uint8_t v = mem->get(a);
-                    uint8_t h =alu_res(v, 7);
-                    mem->set(a, h);
-                }
-                break;
-                case 0xbf: reg->a = alu_res(reg->a, 7); break;
-
-                // SET b, r8
-                case 0xc0: reg->b = alu_set(reg->b, 0); break;
-                case 0xc1: reg->c = alu_set(reg->c, 0); break;
-                case 0xc2: reg->d = alu_set(reg->d, 0); break;
-                case 0xc3: reg->e = alu_set(reg->e, 0); break;
-                case 0xc4: reg->h = alu_set(reg->h, 0); break;
-                case 0xc5: reg->l = alu_set(reg->l, 0); break;
-                case 0xc6: {
-                    uint16_t a =reg->get_hl();
-                    uint8_t v = mem->get(a);
-                    uint8_t h =alu_set(v, 0);
-                    mem->set(a, h);
-                }
-                break;
-                case 0xc7: reg->a = alu_set(reg->a, 0); break;
-                case 0xc8: reg->b = alu_set(reg->b, 1); break;
-                case 0xc9: reg->c = alu_set(reg->c, 1); break;
-                case 0xca: reg->d = alu_set(reg->d, 1); break;
-                case 0xcb: reg->e = alu_set(reg->e, 1); break;
-                case 0xcc: reg->h = alu_set(reg->h, 1); break;
-                case 0xcd: reg->l = alu_set(reg->l, 1); break;
-                case 0xce: {
-                    uint16_t a =reg->get_hl();
-                    uint8_t v = mem->get(a);
-                    uint8_t h =alu_set(v, 1);
-                    mem->set(a, h);
-                }
-                break;
-                case 0xcf: reg->a = alu_set(reg->a, 1); break;
-                case 0xd0: reg->b = alu_set(reg->b, 2); break;
-                case 0xd1: reg->c = alu_set(reg->c, 2); break;
-                case 0xd2: reg->d = alu_set(reg->d, 2); break;
-                case 0xd3: reg->e = alu_set(reg->e, 2); break;
-                case 0xd4: reg->h = alu_set(reg->h, 2); break;
-                case 0xd5: reg->l = alu_set(reg->l, 2); break;
-                case 0xd6: {
-                    uint16_t a =reg->get_hl();
-                    uint8_t v = mem->get(a);
-                    uint8_t h =alu_set(v, 2);
-                    mem->set(a, h);
-                }
-                break;
-                case 0xd7: reg->a = alu_set(reg->a, 2); break;
-                case 0xd8: reg->b = alu_set(reg->b, 3); break;
-                case 0xd9: reg->c = alu_set(reg->c, 3); break;
-                case 0xda: reg->d = alu_set(reg->d, 3); break;
-                case 0xdb: reg->e = alu_set(reg->e, 3); break;
-                case 0xdc: reg->h = alu_set(reg->h, 3); break;
-                case 0xdd: reg->l = alu_set(reg->l, 3); break;
-                case 0xde: {
-                    uint16_t a =reg->get_hl();
-                    uint8_t v = mem->get(a);
-                    uint8_t h =alu_set(v, 3);
-                    mem->set(a, h);
-                }
-                break;
-                case 0xdf: reg->a = alu_set(reg->a, 3); break;
-                case 0xe0: reg->b = alu_set(reg->b, 4); break;
-                case 0xe1: reg->c = alu_set(reg->c, 4); break;
-                case 0xe2: reg->d = alu_set(reg->d, 4); break;
-                case 0xe3: reg->e = alu_set(reg->e, 4); break;
-                case 0xe4: reg->h = alu_set(reg->h, 4); break;
-                case 0xe5: reg->l = alu_set(reg->l, 4); break;
-                case 0xe6: {
-                    uint16_t a =reg->get_hl();
-                    uint8_t v = mem->get(a);
-                    uint8_t h =alu_set(v, 4);
-                    mem->set(a, h);
-                }
-                break;
-                case 0xe7: reg->a = alu_set(reg->a, 4); break;
-                case 0xe8: reg->b = alu_set(reg->b, 5); break;
-                case 0xe9: reg->c = alu_set(reg->c, 5); break;
-                case 0xea: reg->d = alu_set(reg->d, 5); break;
-                case 0xeb: reg->e = alu_set(reg->e, 5); break;
-                case 0xec: reg->h = alu_set(reg->h, 5); break;
-                case 0xed: reg->l = alu_set(reg->l, 5); break;
-                case 0xee: {
-                    uint16_t a =reg->get_hl();
-                    uint8_t v = mem->get(a);
-                    uint8_t h =alu_set(v, 5);
-                    mem->set(a, h);
-                }
-                break;
-                case 0xef: reg->a = alu_set(reg->a, 5); break;
-                case 0xf0: reg->b = alu_set(reg->b, 6); break;
-                case 0xf1: reg->c = alu_set(reg->c, 6); break;
-                case 0xf2: reg->d = alu_set(reg->d, 6); break;
-                case 0xf3: reg->e = alu_set(reg->e, 6); break;
-                case 0xf4: reg->h = alu_set(reg->h, 6); break;
-                case 0xf5: reg->l = alu_set(reg->l, 6); break;
-                case 0xf6: {
-                    uint16_t a =reg->get_hl();
-                    uint8_t v = mem->get(a);
-                    uint8_t h =alu_set(v, 6);
-                    mem->set(a, h);
-                }
-                break;
-                case 0xf7: reg->a = alu_set(reg->a, 6); break;
-                case 0xf8: reg->b = alu_set(reg->b, 7); break;
-                case 0xf9: reg->c = alu_set(reg->c, 7); break;
-                case 0xfa: reg->d = alu_set(reg->d, 7); break;
-                case 0xfb: reg->e = alu_set(reg->e, 7); break;
-                case 0xfc: reg->h = alu_set(reg->h, 7); break;
-                case 0xfd: reg->l = alu_set(reg->l, 7); break;
-                case 0xfe: {
-                    uint16_t a =reg->get_hl();
-                    uint8_t v = mem->get(a);
-                    uint8_t h =alu_set(v, 7);
-                    mem->set(a, h);
-                }
-                break;
-                case 0xff: reg->a = alu_set(reg->a, 7); break;
-        }
+        (this->*CbHandlers<M>::handlers[cbcode])();
     }
 
     if (opcode == 0xd3) cout << "Opcode 0xd3 is not implemented" << endl;
@@ -1897,19 +1629,8 @@ uint32_t Cpu::ex()
     if (opcode == 0xfd) cout << "Opcode 0xfd is not implemented" << endl;
 
     uint8_t ecycle = 0x00;
-    if (opcode == (0x20 | 0x30)) {
-        if (reg->get_flag(Flag_Z)) {
-            ecycle = 0x00;
-        } else {
-            ecycle = 0x01;
-        }
-    }
-    if (opcode == (0x28 | 0x38)) {
-        if (reg->get_flag(Flag_Z)) {
-            ecycle = 0x01;
-        } else {
-            ecycle = 0x00;
-        }
+    if (opcode == 0x20 || opcode == 0x28 || opcode == 0x30 || opcode == 0x38) {
+        ecycle = cond(opcode) ? 0x01 : 0x00;
     }
     if (opcode == (0xc0 | 0xd0)) {
         if (reg->get_flag(Flag_Z)) {
@@ -1954,7 +1675,16 @@ uint32_t Cpu::ex()
     }
 }
 
-uint32_t Cpu::next()
+template <typename M>
+void Cpu<M>::state(State &s)
+{
+    s.io(*reg);
+    s.io(halted);
+    s.io(ei);
+}
+
+template <typename M>
+uint32_t Cpu<M>::next()
 {
     uint32_t mac;
     uint32_t c = hi();
@@ -1972,9 +1702,10 @@ uint32_t Cpu::next()
     return mac * 4;    
 }
 
-Rtc::Rtc(Term term, Memory *m)
+Rtc::Rtc(Term term, Mmunit *m)
 {
-    cpu = new Cpu(term, m);
+    cpu = new Cpu<Mmunit>(term, m);
+    speed = 1.0;
     step_flip = false;
     step_cycles = 0;
     step_zero = chrono::steady_clock::now();
@@ -1986,47 +1717,68 @@ Rtc::~Rtc()
 }
 
 uint32_t CLOCK_FREQUENCY = 4194304;
-uint32_t STEP_TIME = 16;
-uint32_t STEP_CYCLES = (uint32_t)((double)STEP_TIME / (double)(1000.0 / (double)CLOCK_FREQUENCY));
-
-uint64_t saturating_sub(uint64_t x, uint64_t y)
+// clock_nanosleep wakes up late by the timer slack of the host, up to tens of microseconds, so the sleep aims this
+// much early and the rest is spun.
+static const chrono::microseconds SPIN_MARGIN(200);
+// A host that falls further behind than this, e.g. stopped in a debugger, restarts pacing from now rather than
+// running flat out to catch up.
+static const chrono::milliseconds MAX_LAG(100);
+
+static void sleep_until(chrono::steady_clock::time_point t)
 {
-    uint64_t res = x - y;
-    res &= -(res <= x);
-
-    return res;
+    chrono::steady_clock::time_point coarse = t - SPIN_MARGIN;
+    if (chrono::steady_clock::now() < coarse)
+    {
+#if defined(__linux__)
+        // steady_clock is CLOCK_MONOTONIC on Linux.
+        chrono::nanoseconds ns = chrono::duration_cast<chrono::nanoseconds>(coarse.time_since_epoch());
+        struct timespec ts;
+        ts.tv_sec = (time_t)(ns.count() / 1000000000);
+        ts.tv_nsec = (long)(ns.count() % 1000000000);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        {
+        }
+#else
+        this_thread::sleep_until(coarse);
+#endif
+    }
+    while (chrono::steady_clock::now() < t)
+    {
+    }
 }
 
-// Function next simulates real hardware execution speed, by limiting the frequency of the function cpu.next().
 uint32_t Rtc::next()
 {
-    if (step_cycles > STEP_CYCLES)
-    {
-        step_flip = true;
-        step_cycles -= STEP_CYCLES;
-        chrono::steady_clock::time_point now = chrono::steady_clock::now();
-        uint64_t d = chrono::duration_cast<std::chrono::milliseconds>(now - step_zero).count();
-        uint64_t s = saturating_sub(STEP_TIME, d);
-        cout << "CPU: sleep " << s << " millis" << endl;
-
-        // sleep
-        chrono::duration<int, std::milli> ms(s);
-        this_thread::sleep_for(ms);        
+    return cpu->next();
+}
 
-        chrono::duration<int, std::milli> st(STEP_TIME);
-        step_zero += st;
+void Rtc::pace(uint32_t cycles, double rate)
+{
+    step_flip = true;
+    step_cycles += cycles;
+    double s = speed * rate;
+    if (s <= 0.0)
+    {
+        step_cycles = 0;
+        step_zero = chrono::steady_clock::now();
+        return;
+    }
 
-        // If now is after the just updated target frame time, reset to
-        // avoid drift.
-        if (now > step_zero)
-        {
-            step_zero = now;
-        }        
+    double seconds = (double)step_cycles / ((double)CLOCK_FREQUENCY * s);
+    chrono::steady_clock::time_point deadline =
+        step_zero + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(seconds));
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    if (now > deadline + MAX_LAG)
+    {
+        step_cycles = 0;
+        step_zero = now;
+        return;
     }
+    sleep_until(deadline);
 
-    uint32_t cycles = cpu->next();
-    step_cycles += cycles;
-    return cycles;
+    // Rebase on the deadline itself, not on the time of waking up.
+    step_cycles = 0;
+    step_zero = deadline;
 }
 
 bool Rtc::flip()
@@ -2037,4 +1789,7 @@ bool Rtc::flip()
         step_flip = false;
     }
     return r;    
-}
\ No newline at end of file
+}
+
+template class Cpu<Mmunit>;
+template class Cpu<Memory>;
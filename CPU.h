@@ -4,6 +4,8 @@
 #include <vector>
 #include <chrono>
 class Memory;
+class Mmunit;
+class State;
 
 typedef enum {
     Term_GB,  // Original GameBoy (GameBoy Classic)
@@ -25,6 +27,14 @@ typedef enum {
     Flag_C = 0b00010000,
 } Flag;
 
+// Operation group of the 0xcb prefixed instructions, bits 7-6 of the second opcode byte.
+typedef enum {
+    CbOp_Rot = 0x00, // RLC, RRC, RL, RR, SLA, SRA, SWAP, SRL
+    CbOp_Bit = 0x01,
+    CbOp_Res = 0x02,
+    CbOp_Set = 0x03,
+} CbOp;
+
 class Register
 {
 public:
@@ -63,21 +73,39 @@ public:
     void set_flag(Flag fl, bool v);    
 };
 
+// M is the memory bus the CPU is bound to. The emulator uses Cpu<Mmunit>, where every fetch, operand and stack access
+// is a direct call that the compiler can inline. Cpu<Memory> goes through the virtual Memory interface instead, so any
+// Memory implementation (e.g. a flat RAM in tests) can be plugged in. Both are instantiated in CPU.cpp.
+template <typename M>
 class Cpu
 {
 public:        
     Register *reg;      // 寄存器
-    Memory *mem;        // 可访问的内存空间
+    M *mem;             // 可访问的内存空间
     bool halted;        // 表明 CPU 是否处于工作状态
     bool ei;            // enable interrupt 的简写, 表明 CPU 是否接收硬件中断
+    bool fusion;        // 是否启用指令融合 (superinstruction), 关闭时逐条解释执行, 便于对比两者的结果
+    uint32_t horizon;   // 距离外设下一次可能请求中断的时钟周期数, 融合后的指令序列不能跨越它
 
 public:
-    Cpu(Term term, Memory *m);
+    Cpu(Term term, M *m);
     ~Cpu();
 
     uint32_t hi();
     uint32_t ex();
     uint32_t next();
+    void state(State &s);
+
+    bool cond(uint8_t opcode);
+
+    uint32_t fused();
+    uint32_t fuse_copy();
+    uint32_t fuse_delay();
+    uint32_t fuse_poll();
+
+    // Handler of a 0xcb prefixed instruction with operation Op (bits 7-6), bit index B (bits 5-3) and operand R
+    // (bits 2-0). All 256 instances are collected into a jump table in CPU.cpp.
+    template <uint8_t Op, uint8_t B, uint8_t R> void cb();
 
     uint8_t imm();
     uint16_t imm_word();
@@ -348,16 +376,27 @@ public:
 class Rtc
 {
 private:
-    uint32_t step_cycles;
+    // Base clock cycles paced since step_zero. The deadline of the emulation is step_zero plus the host time of these
+    // cycles, so rounding never accumulates into drift.
+    uint64_t step_cycles;
     bool step_flip;    
     std::chrono::steady_clock::time_point step_zero;    
 public:
-    Cpu *cpu;
-    Rtc(Term term, Memory *m);
+    Cpu<Mmunit> *cpu;
+    // Emulation speed as a multiple of real time: 1 for 1x, N for Nx, 0 runs unthrottled.
+    double speed;
+
+    Rtc(Term term, Mmunit *m);
     ~Rtc();
 
-    // Function next simulates real hardware execution speed, by limiting the frequency of the function cpu.next().
+    // Function next runs one instruction, pacing is left to pace().
     uint32_t next();
+    // Function pace simulates real hardware execution speed. It adds cycles base clock (4194304 Hz) cycles to the
+    // emulated time and blocks until the host clock reaches their deadline. It is meant to be called once per frame.
+    //
+    // rate scales speed for these cycles only, it is how audio pacing trims the emulation to the audio device. A rate
+    // of 0 does not wait and starts the deadlines over from now.
+    void pace(uint32_t cycles, double rate = 1.0);
     bool flip();
 };
 
@@ -147,8 +147,7 @@ vector<uint8_t> ram_read(string path, unsigned int size)
     ifstream inFile(path, ios::binary);
     if (!inFile)
     {
-        uint8_t v[size];
-        vector<uint8_t> ram(v, v+size);
+        vector<uint8_t> ram(size, 0x00);
         return ram;
     }
 	
@@ -217,8 +216,7 @@ Cartridge *createCart(std::string path)
     if (category == 0x02)
     {
         unsigned int i = ram_size(rom[0x0149]);
-        uint8_t v[i];
-        vector<uint8_t> ram(v, v+i);
+        vector<uint8_t> ram(i, 0x00);
         cart = new Mbc1(rom, ram, "");
     }
     
@@ -232,8 +230,7 @@ Cartridge *createCart(std::string path)
 
     if (category == 0x05)
     {        
-        uint8_t v[512];
-        vector<uint8_t> ram(v, v+512);
+        vector<uint8_t> ram(512, 0x00);
         cart = new Mbc2(rom, ram, "");
     }
 
@@ -269,8 +266,7 @@ Cartridge *createCart(std::string path)
     if (category == 0x12)
     {
         unsigned int i = ram_size(rom[0x0149]);
-        uint8_t v[i];
-        vector<uint8_t> ram(v, v+i);
+        vector<uint8_t> ram(i, 0x00);
         cart = new Mbc3(rom, ram, "", "");
     }
 
@@ -3,6 +3,7 @@
 #define Cartridge_1
 
 #include <vector>
+#include "State.h"
 
 class Memory
 {
@@ -10,6 +11,9 @@ protected:
     std::vector<uint8_t> rom;
 
 public:    
+    // Memories are deleted through their own type and through this one, e.g. the Gpu lanes of a Renderer.
+    virtual ~Memory() {}
+
     virtual uint8_t get(unsigned int a)
     {
         return rom[a];
@@ -18,7 +22,7 @@ public:
 
     virtual uint16_t get_word(unsigned int a)
     {
-        return (uint16_t)a | (uint16_t)get(a+1) << 8;
+        return (uint16_t)get(a) | (uint16_t)get(a+1) << 8;
     };
 
     virtual void set_word(unsigned int a, uint16_t v)
@@ -39,7 +43,40 @@ public:
 class Cartridge: public Memory, public Stable
 {
 public:
+    // Save files are only written while set. Run-ahead clears it for the frames it rolls back, their writes happen
+    // again when the frames are emulated for real.
+    bool persist = true;
+
     std::string title();    
+
+    // Bank 0 (0000-3FFF) is fixed for every supported cartridge type, so the bus may read it directly instead of
+    // going through get(). NULL if the ROM is too small to hold a full bank.
+    const uint8_t *bank0()
+    {
+        return (rom.size() >= 0x4000) ? &rom[0] : NULL;
+    }
+
+    // Banking registers and external RAM, for save states. A ROM without a mapper has none.
+    virtual void state(State &s) {}
+
+    // Base clock cycles of the machine, which a cartridge RTC counts emulated time with.
+    virtual void set_clock(const uint64_t *clock) {}
+    // Moves a cartridge RTC forward by the host time that passed since it was saved. Without it the RTC only counts
+    // emulated time, which keeps replays and regression runs deterministic.
+    virtual void sync_host() {}
+
+    // Host memory backing address a with the current banking, for bulk copies that bypass get(). len is set to the
+    // number of bytes that follow contiguously in the same bank. NULL if a is not plain memory, e.g. disabled external
+    // RAM or the MBC3 clock registers.
+    virtual const uint8_t *host(unsigned int a, unsigned int &len)
+    {
+        if (a > 0x7fff || a >= rom.size())
+        {
+            return NULL;
+        }
+        len = ((rom.size() < 0x8000) ? rom.size() : 0x8000) - a;
+        return &rom[a];
+    }
 };
 
 bool ensure_header_checksum(Cartridge *cart);
@@ -18,6 +18,17 @@ static inline time_t current_time()
     return timep;
 }
 
+// Pointer to v[i] for Cartridge::host, len is clipped to both the n bytes left in the bank and the end of v.
+static inline const uint8_t *slice(const vector<uint8_t> &v, size_t i, unsigned int n, unsigned int &len)
+{
+    if (i >= v.size())
+    {
+        return NULL;
+    }
+    len = (v.size() - i < n) ? (unsigned int)(v.size() - i) : n;
+    return &v[i];
+}
+
 RomOnly::RomOnly(std::vector <uint8_t> v)
 {
     rom = v;
@@ -121,11 +132,13 @@ void Mbc1::set(unsigned int a, uint8_t v)
     
     if (a >= 0x00 && a <= 0x1fff)
     {
+        // Games disable RAM when they are done with it, flush it then rather than on every write to this range.
+        bool was_enabled = ram_enable;
         ram_enable = ((v & 0x0f) == 0x0a);
-        if (!ram_enable)
+        if (was_enabled && !ram_enable && persist)
         {
             save(save_path);
-        }        
+        }
     }
     
     if (a >= 0x2000 && a <= 0x3fff)
@@ -159,6 +172,34 @@ void Mbc1::set(unsigned int a, uint8_t v)
     }
 }
 
+const uint8_t *Mbc1::host(unsigned int a, unsigned int &len)
+{
+    if (a >= 0x0000 && a <= 0x3fff)
+    {
+        return slice(rom, a, 0x4000 - a, len);
+    }
+
+    if (a >= 0x4000 && a <= 0x7fff)
+    {
+        return slice(rom, rom_bank() * 0x4000 + a - 0x4000, 0x8000 - a, len);
+    }
+
+    if (a >= 0xa000 && a <= 0xbfff && ram_enable)
+    {
+        return slice(ram, ram_bank() * 0x2000 + a - 0xa000, 0xc000 - a, len);
+    }
+
+    return NULL;
+}
+
+void Mbc1::state(State &s)
+{
+    s.io(bank_mode);
+    s.io(bank);
+    s.io(ram_enable);
+    s.io(ram.data(), ram.size());
+}
+
 void Mbc1::save(std::string path)
 {
     if (path.empty())
@@ -239,6 +280,29 @@ void Mbc2::set(unsigned int a, uint8_t v)
     }
 }
 
+// The 512 x 4 bits of built-in RAM are left to get(), only the ROM is resolved.
+const uint8_t *Mbc2::host(unsigned int a, unsigned int &len)
+{
+    if (a >= 0x0000 && a <= 0x3fff)
+    {
+        return slice(rom, a, 0x4000 - a, len);
+    }
+
+    if (a >= 0x4000 && a <= 0x7fff)
+    {
+        return slice(rom, rom_bank * 0x4000 + a - 0x4000, 0x8000 - a, len);
+    }
+
+    return NULL;
+}
+
+void Mbc2::state(State &s)
+{
+    s.io(rom_bank);
+    s.io(ram_enable);
+    s.io(ram.data(), ram.size());
+}
+
 void Mbc2::save(std::string path)
 {
     if (path.empty())
@@ -257,48 +321,98 @@ void Mbc2::save(std::string path)
     outFile.close();
 }
 
+// The RTC runs on its own 32768 Hz crystal, which is base clock cycles at 4194304 Hz in any CPU speed mode.
+static const uint64_t RTC_CYCLES_PER_SECOND = 4194304;
+// The day counter has 9 bits, it sets the carry bit of dh when it overflows.
+static const uint64_t RTC_WRAP_SECONDS = 512 * 86400;
+
+// The save file holds the seconds counted followed by the host time of the save. A file of an older version holds
+// only the host time the clock started at.
 RealTimeClock::RealTimeClock(std::string path): save_path(path)
 {
-    ifstream inFile(path);
-    if (!inFile || !inFile.is_open())
-    {
-        zero = current_time();
-    } else
-    {
-        uint64_t t;
-        inFile.read((char *)&t, sizeof(t));
-        zero = t;
-        inFile.close();
-    }
-    
     s = 0;
     m = 0;
     h = 0;
     dl = 0;
     dh = 0;
+    seconds = 0;
+    base = 0;
+    clock = NULL;
+    saved_at = 0;
+
+    ifstream inFile(path, ios::binary);
+    if (inFile && inFile.is_open())
+    {
+        uint64_t t[2];
+        inFile.read((char *)t, sizeof(t));
+        if (inFile.gcount() == sizeof(t))
+        {
+            seconds = t[0];
+            saved_at = t[1];
+        } else if (inFile.gcount() == sizeof(uint64_t))
+        {
+            saved_at = t[0];
+        }
+        inFile.close();
+    }
 }
 
-void RealTimeClock::tic()
+void RealTimeClock::set_clock(const uint64_t *c)
 {
-    time_t d = current_time() - zero;
-    s = d % 60;
-    m = d / 60 % 60;
-    h = d / 3600 % 24;
+    clock = c;
+    base = *c;
+}
 
-    uint16_t days = d / 3600 / 24;
-    dl = days % 256;
+void RealTimeClock::sync_host()
+{
+    uint64_t now = (uint64_t)current_time();
+    if (saved_at != 0 && now > saved_at && (dh & 0x40) == 0x00)
+    {
+        seconds += now - saved_at;
+    }
+    saved_at = now;
+}
+
+void RealTimeClock::catch_up()
+{
+    if (clock == NULL)
+    {
+        return;
+    }
+    if ((dh & 0x40) != 0x00)
+    {
+        // Halted, the time that passed is not counted.
+        base = *clock;
+        return;
+    }
+    uint64_t n = (*clock - base) / RTC_CYCLES_PER_SECOND;
+    seconds += n;
+    base += n * RTC_CYCLES_PER_SECOND;
+}
 
-    if (days >= 0x0000 && days <= 0x00ff)
-    {}
-    else if (days >= 0x0100 && days <= 0x01ff)
+void RealTimeClock::wrap()
+{
+    if (seconds >= RTC_WRAP_SECONDS)
     {
-        dh |= 0x01;
-    } else {
-        dh |= 0x01;
+        seconds %= RTC_WRAP_SECONDS;
         dh |= 0x80;
     }
 }
 
+// Latches the counter into the registers.
+void RealTimeClock::tic()
+{
+    catch_up();
+    wrap();
+    s = seconds % 60;
+    m = seconds / 60 % 60;
+    h = seconds / 3600 % 24;
+
+    uint16_t days = seconds / 86400;
+    dl = days % 256;
+    dh = (dh & 0xfe) | (days >> 8);
+}
+
 uint8_t RealTimeClock::get(unsigned int a)
 {
     if (a == 0x08)
@@ -332,35 +446,64 @@ uint8_t RealTimeClock::get(unsigned int a)
 
 void RealTimeClock::set(unsigned int a, uint8_t v)
 {
+    // Count the time before the write, in particular before a change of the halt bit.
+    catch_up();
+    wrap();
+    // A write sets one field of the counter itself, the others keep the time counted so far. The latched registers
+    // only change on the next latch, except for the halt and carry bits of dh, which are live.
+    uint64_t sec = seconds % 60;
+    uint64_t min = seconds / 60 % 60;
+    uint64_t hour = seconds / 3600 % 24;
+    uint64_t days = seconds / 86400;
     if (a == 0x08)
     {
-        s = v;
+        sec = v % 60;
     }
 
     else if (a == 0x09)
     {
-        m = v;
+        min = v % 60;
     }
 
     else if (a == 0x0a)
     {
-        h = v;
+        hour = v % 24;
     }
 
     else if (a == 0x0b)
     {
-        dl = v;
+        days = (days & 0x100) | v;
     }
 
     else if (a == 0x0c)
     {
-        dh = v;
+        days = (days & 0xff) | ((uint64_t)(v & 0x01) << 8);
+        dh = (dh & 0x01) | (v & 0xfe);
     }
     
     else
     {
         cout << "No entry" << endl;
+        return;
     }    
+
+    // Writing the seconds also restarts the fraction of the current second.
+    seconds = sec + min * 60 + hour * 3600 + days * 86400;
+    if (a == 0x08 && clock != NULL)
+    {
+        base = *clock;
+    }
+}
+
+void RealTimeClock::state(State &st)
+{
+    st.io(s);
+    st.io(m);
+    st.io(h);
+    st.io(dl);
+    st.io(dh);
+    st.io(seconds);
+    st.io(base);
 }
 
 void RealTimeClock::save(std::string path)
@@ -376,7 +519,10 @@ void RealTimeClock::save(std::string path)
         exit(1);
     }
     
-    outFile.write(reinterpret_cast<char*>(&zero), sizeof(zero));
+    catch_up();
+    saved_at = (uint64_t)current_time();
+    uint64_t t[2] = { seconds, saved_at };
+    outFile.write(reinterpret_cast<char*>(t), sizeof(t));
     outFile.close();
 }
 
@@ -446,7 +592,13 @@ void Mbc3::set(unsigned int a, uint8_t v)
     
     if (a >= 0x00 && a <= 0x1fff)
     {
+        // Like Mbc1, RAM and the clock are flushed when the game disables them.
+        bool was_enabled = ram_enable;
         ram_enable = ((v & 0x0f) == 0x0a);
+        if (was_enabled && !ram_enable && persist)
+        {
+            save(save_path);
+        }
     }
     
     if (a >= 0x2000 && a <= 0x3fff)
@@ -474,8 +626,49 @@ void Mbc3::set(unsigned int a, uint8_t v)
     }
 }
 
+const uint8_t *Mbc3::host(unsigned int a, unsigned int &len)
+{
+    if (a >= 0x0000 && a <= 0x3fff)
+    {
+        return slice(rom, a, 0x4000 - a, len);
+    }
+
+    if (a >= 0x4000 && a <= 0x7fff)
+    {
+        return slice(rom, rom_bank * 0x4000 + a - 0x4000, 0x8000 - a, len);
+    }
+
+    // Banks 0x08-0x0c select the clock registers, which are not memory.
+    if (a >= 0xa000 && a <= 0xbfff && ram_enable && ram_bank <= 0x03)
+    {
+        return slice(ram, ram_bank * 0x2000 + a - 0xa000, 0xc000 - a, len);
+    }
+
+    return NULL;
+}
+
+void Mbc3::state(State &s)
+{
+    s.io(rom_bank);
+    s.io(ram_bank);
+    s.io(ram_enable);
+    s.io(ram.data(), ram.size());
+    rtc->state(s);
+}
+
+void Mbc3::set_clock(const uint64_t *clock)
+{
+    rtc->set_clock(clock);
+}
+
+void Mbc3::sync_host()
+{
+    rtc->sync_host();
+}
+
 void Mbc3::save(std::string path)
 {
+    rtc->save(rtc->save_path);
     if (path.empty())
     {
         return;
@@ -560,6 +753,34 @@ void Mbc5::set(unsigned int a, uint8_t v)
     }
 }
 
+const uint8_t *Mbc5::host(unsigned int a, unsigned int &len)
+{
+    if (a >= 0x0000 && a <= 0x3fff)
+    {
+        return slice(rom, a, 0x4000 - a, len);
+    }
+
+    if (a >= 0x4000 && a <= 0x7fff)
+    {
+        return slice(rom, rom_bank * 0x4000 + a - 0x4000, 0x8000 - a, len);
+    }
+
+    if (a >= 0xa000 && a <= 0xbfff && ram_enable)
+    {
+        return slice(ram, ram_bank * 0x2000 + a - 0xa000, 0xc000 - a, len);
+    }
+
+    return NULL;
+}
+
+void Mbc5::state(State &s)
+{
+    s.io(rom_bank);
+    s.io(ram_bank);
+    s.io(ram_enable);
+    s.io(ram.data(), ram.size());
+}
+
 void Mbc5::save(std::string path)
 {
     if (path.empty())
@@ -33,6 +33,8 @@ private:
 protected:
     uint8_t get(unsigned int a);
     void set(unsigned int a, uint8_t v);
+    const uint8_t *host(unsigned int a, unsigned int &len);
+    void state(State &s);
     void save(std::string path);
 
 public:    
@@ -53,30 +55,53 @@ private:
 protected:
     uint8_t get(unsigned int a);
     void set(unsigned int a, uint8_t v);
+    const uint8_t *host(unsigned int a, unsigned int &len);
+    void state(State &s);
     void save(std::string path);
 
 public:    
     Mbc2(std::vector<uint8_t> o, std::vector<uint8_t> a, std::string path);
 };
 
+// The MBC3 clock counts emulated time, taken from the base clock cycles of the machine, so it runs at the speed of
+// the emulation: it is fast forwarded, paused and replayed with it. Host time is only looked at when the clock is
+// loaded (sync_host) and saved, never while the game runs.
+//
+// The counter is brought up to date lazily, when the game latches or writes it.
 class RealTimeClock: public Memory, public Stable
 {
 private:
+    // Latched registers: seconds, minutes, hours, day counter low and high. In dh, bit 0 is bit 8 of the day counter,
+    // bit 6 halts the clock and bit 7 is the day counter carry.
     uint8_t s;
     uint8_t m;
     uint8_t h;
     uint8_t dl;
     uint8_t dh;
-    uint64_t zero;
-    std::string save_path;  
+    // Seconds counted, as of base clock cycle base. base only moves by whole seconds, so the fraction of a second
+    // carries over between updates.
+    uint64_t seconds;
+    uint64_t base;
+    const uint64_t *clock;
+    // Host time (seconds since the epoch) of the last save, 0 if there is none.
+    uint64_t saved_at;
+
+    void catch_up();
+    // Folds an overflow of the day counter into the carry bit of dh.
+    void wrap();
 
 public:
+    std::string save_path;
+
     RealTimeClock(std::string path);
+    void set_clock(const uint64_t *c);
+    void sync_host();
     void tic();
 
     uint8_t get(unsigned int a);
     void set(unsigned int a, uint8_t v);
     void save(std::string path);  
+    void state(State &s);
 };
 
 class Mbc3: public Cartridge
@@ -92,6 +117,10 @@ private:
 protected:
     uint8_t get(unsigned int a);
     void set(unsigned int a, uint8_t v);
+    const uint8_t *host(unsigned int a, unsigned int &len);
+    void state(State &s);
+    void set_clock(const uint64_t *clock);
+    void sync_host();
     void save(std::string path);
 
 public:    
@@ -111,11 +140,12 @@ private:
 protected:
     uint8_t get(unsigned int a);
     void set(unsigned int a, uint8_t v);
+    const uint8_t *host(unsigned int a, unsigned int &len);
+    void state(State &s);
     void save(std::string path);
 
 public:    
     Mbc5(std::vector<uint8_t> o, std::vector<uint8_t> a, std::string path);
-    ~Mbc5();
 };
 
 #endif
\ No newline at end of file
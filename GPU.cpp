@@ -1,6 +1,8 @@
 #include "GPU.h"
 #include "Util.h"
+#include "Renderer.h"
 #include <iostream>
+#include <iomanip>
 #include <assert.h>
 
 using namespace std;
@@ -95,10 +97,19 @@ void initalArray(uint8_t v, uint8_t *array, int d1, int d2, int d3)
 Gpu::Gpu(Term term, Intf *intf) {    
 
     initalArray(0xff, &data[0][0][0], SCREEN_H, SCREEN_W, 3);
-    intf = intf;    
-    term = term;
+    screen = data;
+    renderer = NULL;
+    this->intf = intf;
+    this->term = term;
     h_blank = false;
     v_blank = false;
+    frame_count = 0;
+    frame_hash = 0;
+    hash_frames = false;
+    log_frames = false;
+    render = true;
+    track_lines = false;
+    forget_lines();
 
     lcdc = new Lcdc();
     stat = new Stat();
@@ -117,10 +128,10 @@ Gpu::Gpu(Term term, Intf *intf) {
     cobpi = new Bgpi();        
     initalArray(0, &cobpd[0][0][0], 8, 4, 3);    
 
-    ram = (uint8_t *)malloc(sizeof(uint8_t) * 0x4000);
+    ram = (uint8_t *)calloc(0x4000, sizeof(uint8_t));
     // ram = [0x00; 0x4000], // 默认是 0
     ram_bank = 0x00;
-    oam = (uint8_t *)malloc(sizeof(uint8_t) * 0xa0);
+    oam = (uint8_t *)calloc(0xa0, sizeof(uint8_t));
     // oam = [0x00; 0xa0],    
     prio = (Priority *)malloc(sizeof(Priority) * SCREEN_W);
     for (size_t i = 0; i < SCREEN_W; i++)
@@ -132,6 +143,7 @@ Gpu::Gpu(Term term, Intf *intf) {
 
 Gpu::~Gpu()
 {
+    delete renderer;
     // free(data);
     // free(cobpi);
     // free(cbgpd);
@@ -187,9 +199,9 @@ GrayShades Gpu::get_gray_shades(uint8_t v, uint8_t i) {
 
 // Grey scale.
 void Gpu::set_gre(uint8_t x, uint8_t g) {
-    data[ly][x][0] = g;
-    data[ly][x][1] = g;
-    data[ly][x][2] = g;
+    screen[ly][x][0] = g;
+    screen[ly][x][1] = g;
+    screen[ly][x][2] = g;
 }
 
 // When developing graphics on PCs, note that the RGB values will have different appearance on CGB displays as on
@@ -201,15 +213,15 @@ void Gpu::set_gre(uint8_t x, uint8_t g) {
 // of 03EFh (Blue=0, Green=1Fh, Red=0Fh) will appear as Neon Green on VGA displays, but on the CGB it'll produce a
 // decently washed out Yellow. See image on the right.
 void Gpu::set_rgb(uint8_t x, uint8_t r, uint8_t g, uint8_t b) {
-    assert(r > 0x1f);
-    assert(g > 0x1f);
-    assert(b > 0x1f);
+    assert(r <= 0x1f);
+    assert(g <= 0x1f);
+    assert(b <= 0x1f);
     uint32_t r_ = (uint32_t)r;
     uint32_t g_ = (uint32_t)g;
     uint32_t b_ = (uint32_t)b;
-    data[ly][x][0] = (uint8_t)((r_ * 13 + g_ * 2 + b_) >> 1);
-    data[ly][x][1] = (uint8_t)((g_ * 3 + b_) << 1);
-    data[ly][x][2] = (uint8_t)((r_ * 3 + g_ * 2 + b_ * 11) >> 1);    
+    screen[ly][x][0] = (uint8_t)((r_ * 13 + g_ * 2 + b_) >> 1);
+    screen[ly][x][1] = (uint8_t)((g_ * 3 + b_) << 1);
+    screen[ly][x][2] = (uint8_t)((r_ * 3 + g_ * 2 + b_ * 11) >> 1);    
 }
 
 void Gpu::next(uint32_t cycles) {
@@ -254,6 +266,25 @@ void Gpu::next(uint32_t cycles) {
             }
             stat->mode = 1;
             v_blank = true;
+            frame_count++;
+            finish();
+            if (render) {
+                if (track_lines) {
+                    track_changes();
+                }
+                if (hash_frames) {
+                    // Hashing the lines costs as much as hashing the frame, a frame that did not change is not hashed
+                    // twice.
+                    if (!(track_lines && hash_fresh && changed_lines == 0)) {
+                        frame_hash = xxhash64(&data[0][0][0], sizeof(data), 0);
+                    }
+                    if (log_frames) {
+                        cout << "frame " << frame_count << " " << hex << setw(16) << setfill('0') << frame_hash << dec
+                             << setfill(' ') << endl;
+                    }
+                }
+                hash_fresh = track_lines && hash_frames;
+            }
             intf->hi(Flags_VBlank);
             if (stat->enable_m1_interrupt) {
                 intf->hi(Flags_LCDStat);
@@ -278,6 +309,13 @@ void Gpu::next(uint32_t cycles) {
                 intf->hi(Flags_LCDStat);
             }
             // Render scanline
+            if (!render) {
+                continue;
+            }
+            if (renderer) {
+                renderer->line();
+                continue;
+            }
             if (term == Term_GBC || lcdc->bit0()) {
                 draw_bg();
             }
@@ -288,6 +326,91 @@ void Gpu::next(uint32_t cycles) {
     }
 }
 
+uint32_t Gpu::horizon() {
+    if (!lcdc->bit7()) {
+        return 0xffffffff;
+    }
+    if (ly >= 144 || dots > 80 + 172) {
+        return 456 - dots;
+    }
+    if (dots <= 80) {
+        return 81 - dots;
+    }
+    return 80 + 172 + 1 - dots;
+}
+
+void Gpu::set_render_threads(unsigned int n)
+{
+    delete renderer;
+    renderer = n > 0 ? new Renderer(this, n) : NULL;
+}
+
+void Gpu::track_changes()
+{
+    changed_lines = 0;
+    for (int y = 0; y < 144; y++)
+    {
+        uint64_t h = xxhash64(&data[y][0][0], sizeof(data[y]), 0);
+        line_changed[y] = h != line_hash[y];
+        if (line_changed[y])
+        {
+            line_hash[y] = h;
+            changed_lines++;
+        }
+    }
+}
+
+void Gpu::forget_lines()
+{
+    for (int y = 0; y < 144; y++)
+    {
+        line_changed[y] = true;
+        line_hash[y] = 0;
+    }
+    changed_lines = 144;
+    hash_fresh = false;
+}
+
+void Gpu::finish()
+{
+    if (renderer)
+    {
+        renderer->finish();
+    }
+}
+
+// data is what was drawn, not machine state, and is left out. So is prio, which only lives for one scanline. A load
+// replaces the memory the render thread mirrors, so it is copied over again.
+void Gpu::state(State &s)
+{
+    s.io(h_blank);
+    s.io(v_blank);
+    s.io(frame_count);
+    s.io(lcdc->data);
+    s.io(*stat);
+    s.io(sy);
+    s.io(sx);
+    s.io(wy);
+    s.io(wx);
+    s.io(ly);
+    s.io(lc);
+    s.io(bgp);
+    s.io(op0);
+    s.io(op1);
+    s.io(*cbgpi);
+    s.io(cbgpd);
+    s.io(*cobpi);
+    s.io(cobpd);
+    s.io(ram, 0x4000);
+    s.io(ram_bank);
+    s.io(oam, 0xa0);
+    s.io(dots);
+    if (s.loading && renderer)
+    {
+        renderer->resync();
+    }
+}
+
 void Gpu::draw_bg() {
     bool show_window = (lcdc->bit5() && wy <= ly);
     uint16_t tile_base = lcdc->bit4() ? 0x8000 : 0x8800;
@@ -455,12 +578,12 @@ void Gpu::draw_sprites() {
 }
 
 uint8_t Gpu::get(unsigned int a) {
-    if (a >= 0x8000 && a < 0x9fff)
+    if (a >= 0x8000 && a <= 0x9fff)
     {
         return ram[ram_bank * 0x2000 + a - 0x8000];
     }
 
-    if (a >= 0xfe00 && a < 0xfe9f)
+    if (a >= 0xfe00 && a <= 0xfe9f)
     {
         return oam[a - 0xfe00];
     }
@@ -524,18 +647,29 @@ uint8_t Gpu::get(unsigned int a) {
             cout << "Gpu::get error" << endl;
             break;
     }
+    return 0x00;
 }
 
 void Gpu::set(unsigned int a, uint8_t v)
 {
-    if (a >= 0x8000 && a < 0x9fff)
+    if (a >= 0x8000 && a <= 0x9fff)
     {
         ram[ram_bank * 0x2000 + a - 0x8000] = v;
+        if (renderer)
+        {
+            renderer->ram((uint16_t)(ram_bank * 0x2000 + a - 0x8000), 1);
+        }
+        return;
     }
 
-    if (a >= 0xfe00 && a < 0xfe9f)
+    if (a >= 0xfe00 && a <= 0xfe9f)
     {
         oam[a - 0xfe00] = v;
+        if (renderer)
+        {
+            renderer->oam((uint16_t)(a - 0xfe00), 1);
+        }
+        return;
     }
     
     switch (a)
@@ -548,7 +682,15 @@ void Gpu::set(unsigned int a, uint8_t v)
                 dots = 0;
                 ly = 0;
                 stat->mode = 0;
-                initalArray(0xff, &data[0][0][0], SCREEN_H, SCREEN_W, 3);
+                if (renderer)
+                {
+                    renderer->clear();
+                } else
+                {
+                    initalArray(0xff, &data[0][0][0], SCREEN_H, SCREEN_W, 3);
+                }
+                // The white screen is shown without a v-blank that would track it.
+                forget_lines();
                 v_blank = true;
             }                
         }
@@ -587,6 +729,10 @@ void Gpu::set(unsigned int a, uint8_t v)
                 cbgpd[r][c][1] = (cbgpd[r][c][1] & 0x07) | ((v & 0x03) << 3);
                 cbgpd[r][c][2] = (v >> 2) & 0x1f;
             }
+            if (renderer)
+            {
+                renderer->palette(false, (uint8_t)(r * 4 + c));
+            }
             if (cbgpi->auto_increment) {
                 cbgpi->i += 0x01;
                 cbgpi->i &= 0x3f;
@@ -605,6 +751,10 @@ void Gpu::set(unsigned int a, uint8_t v)
                 cobpd[r][c][1] = (cobpd[r][c][1] & 0x07) | ((v & 0x03) << 3);
                 cobpd[r][c][2] = (v >> 2) & 0x1f;
             }
+            if (renderer)
+            {
+                renderer->palette(true, (uint8_t)(r * 4 + c));
+            }
             if (cobpi->auto_increment) {
                 cobpi->i += 0x01;
                 cobpi->i &= 0x3f;
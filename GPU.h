@@ -5,6 +5,8 @@
 #include "CPU.h"
 #include <vector>
 
+class Renderer;
+
 typedef enum {
     // When using this transfer method, all data is transferred at once. The execution of the program is halted until
     // the transfer has completed. Note that the General Purpose DMA blindly attempts to copy the data, even if the
@@ -234,11 +236,35 @@ public:
     // ---------- 160
     //        144
     uint8_t data[144][160][3];
+    // Where scanlines are drawn: data, or the data of the Gpu this one mirrors for a Renderer.
+    uint8_t (*screen)[160][3];
+    // Draws the scanlines on a second thread while set, see Renderer. NULL draws them in next().
+    Renderer *renderer;
     Intf *intf;
     Term term;
     bool h_blank;
     bool v_blank;
 
+    // Frames finished since power up, and the XXH64 of data for the last of them. The hash is taken when v_blank is
+    // raised if hash_frames is set, and printed as "frame <n> <hash>" if log_frames is set as well.
+    uint32_t frame_count;
+    uint64_t frame_hash;
+    bool hash_frames;
+    bool log_frames;
+    // Scanlines are drawn into data only while render is set. Clearing it skips the drawing of a frame, timing,
+    // interrupts and frame_count are not affected.
+    bool render;
+    // With track_lines set, v-blank hashes every line of a drawn frame and marks in line_changed the ones that differ
+    // from the frame drawn before, changed_lines counts them. A frame with none changed looks exactly like the one
+    // before, so the window, the video capture and frame_hash can skip their work for it. The first frame tracked has
+    // all lines changed.
+    bool track_lines;
+    bool line_changed[144];
+    uint32_t changed_lines;
+    uint64_t line_hash[144];
+    // Set while frame_hash and line_hash both describe the last drawn frame.
+    bool hash_fresh;
+
     Lcdc *lcdc;
     Stat *stat;
 
@@ -338,9 +364,20 @@ public:
     void set_rgb(uint8_t x, uint8_t r, uint8_t g, uint8_t b);
 
     void next(uint32_t cycles);
+    // Number of dots before next() may change mode or line, and with it request an interrupt or render a scanline.
+    uint32_t horizon();
 
     void draw_bg();
     void draw_sprites();
+    // Number of threads that draw the scanlines besides the one running next(), see Renderer. 0 draws them in next().
+    void set_render_threads(unsigned int n);
+    // Waits until the scanlines handed to the render thread are in data. Does nothing without one.
+    void finish();
+    // Updates line_changed and changed_lines for the frame in data.
+    void track_changes();
+    // Marks every line changed and forgets the hashes, after data changed outside of a tracked frame.
+    void forget_lines();
+    void state(State &s);
 
     uint8_t get(unsigned int a);
     void set(unsigned int a, uint8_t v);
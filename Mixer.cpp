@@ -0,0 +1,254 @@
+#include "Mixer.h"
+#include <cmath>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MIXER_X86 1
+#endif
+
+using namespace std;
+
+// Kernels, one set per instruction set. mix_* writes n interleaved stereo samples, dot_* the left and right output of
+// one resampler row.
+
+static void mix_scalar(const float *const ch[4], const float gl[4], const float gr[4], uint32_t n, float *dst)
+{
+    for (uint32_t j = 0; j < n; j++)
+    {
+        float l = ch[0][j] * gl[0] + ch[1][j] * gl[1] + ch[2][j] * gl[2] + ch[3][j] * gl[3];
+        float r = ch[0][j] * gr[0] + ch[1][j] * gr[1] + ch[2][j] * gr[2] + ch[3][j] * gr[3];
+        dst[2 * j] = l;
+        dst[2 * j + 1] = r;
+    }
+}
+
+static void dot_scalar(const float *src, const float *k, float *dst)
+{
+    float l = 0.0f;
+    float r = 0.0f;
+    for (int i = 0; i < Mixer::TAPS; i++)
+    {
+        l += src[2 * i] * k[2 * i];
+        r += src[2 * i + 1] * k[2 * i + 1];
+    }
+    dst[0] = l;
+    dst[1] = r;
+}
+
+#ifdef MIXER_X86
+
+#ifdef __SSE2__
+static void mix_sse2(const float *const ch[4], const float gl[4], const float gr[4], uint32_t n, float *dst)
+{
+    __m128 l0 = _mm_set1_ps(gl[0]), l1 = _mm_set1_ps(gl[1]), l2 = _mm_set1_ps(gl[2]), l3 = _mm_set1_ps(gl[3]);
+    __m128 r0 = _mm_set1_ps(gr[0]), r1 = _mm_set1_ps(gr[1]), r2 = _mm_set1_ps(gr[2]), r3 = _mm_set1_ps(gr[3]);
+    uint32_t j = 0;
+    for (; j + 4 <= n; j += 4)
+    {
+        __m128 c0 = _mm_loadu_ps(ch[0] + j);
+        __m128 c1 = _mm_loadu_ps(ch[1] + j);
+        __m128 c2 = _mm_loadu_ps(ch[2] + j);
+        __m128 c3 = _mm_loadu_ps(ch[3] + j);
+        __m128 l = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c0, l0), _mm_mul_ps(c1, l1)),
+                              _mm_add_ps(_mm_mul_ps(c2, l2), _mm_mul_ps(c3, l3)));
+        __m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c0, r0), _mm_mul_ps(c1, r1)),
+                              _mm_add_ps(_mm_mul_ps(c2, r2), _mm_mul_ps(c3, r3)));
+        _mm_storeu_ps(dst + 2 * j, _mm_unpacklo_ps(l, r));
+        _mm_storeu_ps(dst + 2 * j + 4, _mm_unpackhi_ps(l, r));
+    }
+    const float *const rest[4] = { ch[0] + j, ch[1] + j, ch[2] + j, ch[3] + j };
+    mix_scalar(rest, gl, gr, n - j, dst + 2 * j);
+}
+
+// Two taps of both sides per multiply, the even and odd taps are summed at the end.
+static void dot_sse2(const float *src, const float *k, float *dst)
+{
+    __m128 acc = _mm_setzero_ps();
+    for (int i = 0; i < Mixer::TAPS; i += 2)
+    {
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(src + 2 * i), _mm_loadu_ps(k + 2 * i)));
+    }
+    acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+    _mm_storel_pi((__m64 *)dst, acc);
+}
+#endif
+
+__attribute__((target("avx2")))
+static void mix_avx2(const float *const ch[4], const float gl[4], const float gr[4], uint32_t n, float *dst)
+{
+    __m256 l0 = _mm256_set1_ps(gl[0]), l1 = _mm256_set1_ps(gl[1]), l2 = _mm256_set1_ps(gl[2]), l3 = _mm256_set1_ps(gl[3]);
+    __m256 r0 = _mm256_set1_ps(gr[0]), r1 = _mm256_set1_ps(gr[1]), r2 = _mm256_set1_ps(gr[2]), r3 = _mm256_set1_ps(gr[3]);
+    uint32_t j = 0;
+    for (; j + 8 <= n; j += 8)
+    {
+        __m256 c0 = _mm256_loadu_ps(ch[0] + j);
+        __m256 c1 = _mm256_loadu_ps(ch[1] + j);
+        __m256 c2 = _mm256_loadu_ps(ch[2] + j);
+        __m256 c3 = _mm256_loadu_ps(ch[3] + j);
+        __m256 l = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(c0, l0), _mm256_mul_ps(c1, l1)),
+                                 _mm256_add_ps(_mm256_mul_ps(c2, l2), _mm256_mul_ps(c3, l3)));
+        __m256 r = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(c0, r0), _mm256_mul_ps(c1, r1)),
+                                 _mm256_add_ps(_mm256_mul_ps(c2, r2), _mm256_mul_ps(c3, r3)));
+        // unpack interleaves within each 128-bit half, the permutes put the halves back in order.
+        __m256 lo = _mm256_unpacklo_ps(l, r);
+        __m256 hi = _mm256_unpackhi_ps(l, r);
+        _mm256_storeu_ps(dst + 2 * j, _mm256_permute2f128_ps(lo, hi, 0x20));
+        _mm256_storeu_ps(dst + 2 * j + 8, _mm256_permute2f128_ps(lo, hi, 0x31));
+    }
+    const float *const rest[4] = { ch[0] + j, ch[1] + j, ch[2] + j, ch[3] + j };
+    mix_scalar(rest, gl, gr, n - j, dst + 2 * j);
+}
+
+__attribute__((target("avx2")))
+static void dot_avx2(const float *src, const float *k, float *dst)
+{
+    __m256 acc = _mm256_setzero_ps();
+    for (int i = 0; i < Mixer::TAPS; i += 4)
+    {
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(src + 2 * i), _mm256_loadu_ps(k + 2 * i)));
+    }
+    __m128 a = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    a = _mm_add_ps(a, _mm_movehl_ps(a, a));
+    _mm_storel_pi((__m64 *)dst, a);
+}
+
+#endif
+
+MixerIsa Mixer::best_isa()
+{
+#ifdef MIXER_X86
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return MixerIsa_Avx2;
+    }
+#ifdef __SSE2__
+    return MixerIsa_Sse2;
+#endif
+#endif
+    return MixerIsa_Scalar;
+}
+
+Mixer::Mixer(uint32_t in_rate, uint32_t out_rate)
+{
+    isa = best_isa();
+    step = (uint64_t)((double)in_rate / out_rate * 4294967296.0 + 0.5);
+    pos = 0;
+    dc_x[0] = dc_x[1] = 0.0f;
+    dc_y[0] = dc_y[1] = 0.0f;
+    const double pi = 3.14159265358979323846;
+    dc_r = (float)std::exp(-2.0 * pi * 10.0 / in_rate);
+    memset(pending, 0, sizeof(pending));
+    // Start with a history of silence, so the first output sample already has all its taps.
+    pending_n = TAPS;
+    // A pass resamples at most BLOCK + 1 new positions.
+    max_out = (uint32_t)(((uint64_t)(BLOCK + 2) << 32) / step) + 2;
+    resampled.assign(2 * max_out, 0.0f);
+
+    // Blackman windowed sinc with its cutoff at 90% of the lower of the two Nyquist frequencies, in input samples.
+    // Each row is normalized to a gain of exactly 1.
+    double cutoff = (out_rate < in_rate) ? 0.9 * out_rate / in_rate : 0.9;
+    double half = TAPS / 2;
+    for (int p = 0; p < PHASES; p++)
+    {
+        double row[TAPS];
+        double sum = 0.0;
+        for (int k = 0; k < TAPS; k++)
+        {
+            double t = k - (TAPS / 2 - 1) - (double)p / PHASES;
+            double x = pi * cutoff * t;
+            double sinc = (x == 0.0) ? 1.0 : std::sin(x) / x;
+            double w = (t <= -half || t >= half) ? 0.0 :
+                0.42 + 0.5 * std::cos(pi * t / half) + 0.08 * std::cos(2.0 * pi * t / half);
+            row[k] = sinc * w;
+            sum += row[k];
+        }
+        for (int k = 0; k < TAPS; k++)
+        {
+            kernel[p][2 * k] = kernel[p][2 * k + 1] = (float)(row[k] / sum);
+        }
+    }
+}
+
+void Mixer::mix(const float *const ch[4], const float gl[4], const float gr[4], uint32_t n, float *dst)
+{
+    switch (isa)
+    {
+#ifdef MIXER_X86
+    case MixerIsa_Avx2:
+        mix_avx2(ch, gl, gr, n, dst);
+        return;
+#ifdef __SSE2__
+    case MixerIsa_Sse2:
+        mix_sse2(ch, gl, gr, n, dst);
+        return;
+#endif
+#endif
+    default:
+        mix_scalar(ch, gl, gr, n, dst);
+        return;
+    }
+}
+
+uint32_t Mixer::resample(const float *src, uint32_t n, float *dst, uint32_t &produced)
+{
+    void (*dot)(const float *, const float *, float *) = dot_scalar;
+#ifdef MIXER_X86
+    if (isa == MixerIsa_Avx2)
+    {
+        dot = dot_avx2;
+    }
+#ifdef __SSE2__
+    if (isa == MixerIsa_Sse2)
+    {
+        dot = dot_sse2;
+    }
+#endif
+#endif
+    produced = 0;
+    while ((pos >> 32) + TAPS <= n)
+    {
+        dot(src + 2 * (pos >> 32), kernel[(pos >> (32 - 7)) & (PHASES - 1)], dst + 2 * produced);
+        produced++;
+        pos += step;
+    }
+    uint32_t used = (uint32_t)(pos >> 32);
+    pos -= (uint64_t)used << 32;
+    return used;
+}
+
+void Mixer::process(const float *const ch[4], const float gl[4], const float gr[4], uint32_t n, AudioRing &out)
+{
+    const float *cur[4] = { ch[0], ch[1], ch[2], ch[3] };
+    while (n > 0)
+    {
+        uint32_t m = (n < (uint32_t)BLOCK) ? n : (uint32_t)BLOCK;
+        float *dst = pending + 2 * pending_n;
+        mix(cur, gl, gr, m, dst);
+
+        for (uint32_t j = 0; j < 2 * m; j += 2)
+        {
+            for (int c = 0; c < 2; c++)
+            {
+                float x = dst[j + c];
+                float y = x - dc_x[c] + dc_r * dc_y[c];
+                dc_x[c] = x;
+                dc_y[c] = y;
+                dst[j + c] = y;
+            }
+        }
+
+        pending_n += m;
+        uint32_t produced;
+        uint32_t used = resample(pending, pending_n, &resampled[0], produced);
+        out.write(&resampled[0], produced);
+        pending_n -= used;
+        memmove(pending, pending + 2 * used, 2 * pending_n * sizeof(float));
+
+        for (int c = 0; c < 4; c++)
+        {
+            cur[c] += m;
+        }
+        n -= m;
+    }
+}
@@ -0,0 +1,72 @@
+#ifndef Mixer_1
+#define Mixer_1
+
+#include <cstdint>
+#include <vector>
+#include "AudioRing.h"
+
+// Instruction set the Mixer kernels run on. The widest one the host supports is picked at construction, SSE2 and
+// AVX2 only exist on x86.
+typedef enum {
+    MixerIsa_Scalar,
+    MixerIsa_Sse2,
+    MixerIsa_Avx2,
+} MixerIsa;
+
+// Output stage of the APU. Takes the four channels at the synthesis rate, and for each block:
+//
+//   1. mixes them into stereo with a gain per channel and side, which is where NR50 and NR51 are applied,
+//   2. removes the DC offset with a one pole high-pass filter (about 10 Hz),
+//   3. resamples to the output rate with a polyphase windowed sinc filter.
+//
+// Steps 1 and 3 are vectorized with AVX2 or SSE2 when available and are plain loops otherwise. The filter of step 2
+// is a recurrence over time and stays scalar, it is two multiply-adds per stereo sample.
+class Mixer
+{
+public:
+    // Resampler taps per output sample, and number of sub-sample phases of its kernel table.
+    static const int TAPS = 16;
+    static const int PHASES = 128;
+    // Input samples mixed and resampled in one pass. process() takes any number, a block at a time.
+    static const int BLOCK = 512;
+
+    MixerIsa isa;
+
+    Mixer(uint32_t in_rate, uint32_t out_rate);
+
+    // Mixes n samples of ch[0..3] with gains gl (left) and gr (right), and writes the resampled stereo output to out.
+    // Output that does not fit is dropped. Nothing is allocated.
+    void process(const float *const ch[4], const float gl[4], const float gr[4], uint32_t n, AudioRing &out);
+
+    static MixerIsa best_isa();
+
+    // The stages on their own, for the benchmark. mix() writes n interleaved stereo samples to dst. resample() writes
+    // every output sample whose taps lie within the n stereo samples at src to dst, sets produced to their number, and
+    // returns the number of input samples it consumed. n is at most TAPS + BLOCK + 1, and dst has room for
+    // max_output() stereo samples.
+    void mix(const float *const ch[4], const float gl[4], const float gr[4], uint32_t n, float *dst);
+    uint32_t resample(const float *src, uint32_t n, float *dst, uint32_t &produced);
+    uint32_t max_output() const
+    {
+        return max_out;
+    }
+
+private:
+    // Input samples per output sample and the position of the next output sample in the input, 32.32 fixed point.
+    uint64_t step;
+    uint64_t pos;
+    // High-pass filter state: last input and output of each side.
+    float dc_x[2];
+    float dc_y[2];
+    float dc_r;
+    // Input not consumed yet by the resampler, interleaved stereo, followed by room for one block.
+    float pending[2 * (TAPS + BLOCK + 1)];
+    uint32_t pending_n;
+    // Kernel, each tap stored twice (left and right) so a row multiplies the interleaved input directly.
+    float kernel[PHASES][2 * TAPS];
+    // Output of one pass, allocated once for max_out stereo samples.
+    uint32_t max_out;
+    std::vector<float> resampled;
+};
+
+#endif
@@ -1,4 +1,6 @@
 #include "Mmunit.h"
+#include "Renderer.h"
+#include <cstring>
 
 using namespace std;
 
@@ -28,9 +30,17 @@ Mmunit::Mmunit(string path) {
     inte = 0x00;
     intf = ii;
     hdma = new Hdma();
-    hram = (uint8_t *)malloc(sizeof(uint8_t) * 0x7f);
-    wram = (uint8_t *)malloc(sizeof(uint8_t) * 0x8000);
+    hram = (uint8_t *)calloc(0x7f, sizeof(uint8_t));
+    wram = (uint8_t *)calloc(0x8000, sizeof(uint8_t));
     wram_bank = 0x01;
+    rom0 = cart->bank0();
+    clock = 0;
+    cart->set_clock(&clock);
+    oam_dma_src = 0x0000;
+    oam_dma_done = 0;
+    oam_dma_clock = 0;
+    oam_dma_start = false;
+    bus_lock = 0;
 
     set(0xff05, 0x00);
     set(0xff06, 0x00);
@@ -63,10 +73,14 @@ Mmunit::Mmunit(string path) {
     set(0xff49, 0xff);
     set(0xff4a, 0x00);
     set(0xff4b, 0x00);
+    // Created after the writes above, the APU starts from the state the boot ROM leaves it in by itself.
+    apu = new Apu(APU_SAMPLE_RATE);
+    apu->set_clock(&clock);
 }
 
 Mmunit::~Mmunit()
 {
+    delete apu;
     delete gpu;
     delete hdma;
     delete m_timer;
@@ -77,15 +91,65 @@ Mmunit::~Mmunit()
 
 uint32_t Mmunit::next(uint32_t cycles) {
     uint32_t cpu_divider = (uint32_t)speed;
+    if (bus_lock) {
+        run_oam_dma(cycles);
+    }
     uint32_t vram_cycles = run_dma();
     uint32_t gpu_cycles = cycles / cpu_divider + vram_cycles;
     uint32_t cpu_cycles = cycles + vram_cycles * cpu_divider;
     m_timer->next(cpu_cycles);
     gpu->next(gpu_cycles);
-    // apu->as_mut().map_or((), |s| s.next(gpu_cycles));
+    clock += gpu_cycles;
     return gpu_cycles;
 }
 
+// Number of CPU cycles that can pass before the timer or the GPU may request an interrupt. A pending GDMA/HDMA block
+// is copied on the next call to next(), and a running OAM DMA locks the bus, so nothing may be fused over either.
+uint32_t Mmunit::horizon() {
+    if (bus_lock) {
+        return 0;
+    }
+    if (hdma->active && (hdma->mode == HdmaMode_Gdma || gpu->h_blank)) {
+        return 0;
+    }
+    uint32_t g = gpu->horizon();
+    uint32_t gpu_cycles = (g > 0xffffffff / (uint32_t)speed) ? 0xffffffff : g * (uint32_t)speed;
+    uint32_t timer_cycles = m_timer->horizon();
+    return (gpu_cycles < timer_cycles) ? gpu_cycles : timer_cycles;
+}
+
+void Mmunit::state(State &s) {
+    s.io(clock);
+    cartridge->state(s);
+    gpu->state(s);
+    apu->state(s);
+    s.io(joypad.matrix);
+    s.io(joypad.select);
+    s.io(serial.data);
+    s.io(serial.control);
+    s.io(shift);
+    s.io(speed);
+    s.io(m_timer->reg);
+    s.io(m_timer->div_clock->n);
+    s.io(m_timer->tma_clock->n);
+    s.io(m_timer->tma_clock->period);
+    s.io(inte);
+    s.io(intf->data);
+    s.io(hdma->src);
+    s.io(hdma->dst);
+    s.io(hdma->active);
+    s.io(hdma->mode);
+    s.io(hdma->remain);
+    s.io(hram, 0x7f);
+    s.io(wram, 0x8000);
+    s.io(wram_bank);
+    s.io(oam_dma_src);
+    s.io(oam_dma_done);
+    s.io(oam_dma_clock);
+    s.io(oam_dma_start);
+    s.io(bus_lock);
+}
+
 void Mmunit::switch_speed() {
     if (shift) {
         if (speed == Speed_Double) {
@@ -136,13 +200,50 @@ uint32_t Mmunit::run_dma() {
     return 0;
 }
 
+// OAM DMA takes one machine cycle to start, then copies one byte per machine cycle for 160 machine cycles. The bytes
+// that are due are copied in a block each time the CPU hands over its cycles. The first cycles handed over are those
+// of the instruction that wrote 0xff46, which all passed before the write, so counting starts after them.
+void Mmunit::run_oam_dma(uint32_t cycles) {
+    if (oam_dma_start) {
+        oam_dma_start = false;
+        return;
+    }
+    oam_dma_clock += cycles;
+    uint32_t due = oam_dma_clock / 4;
+    due = (due > 1) ? due - 1 : 0;
+    if (due > 0xa0) {
+        due = 0xa0;
+    }
+    if (due > oam_dma_done) {
+        get_block(oam_dma_src + oam_dma_done, gpu->oam + oam_dma_done, due - oam_dma_done);
+        if (gpu->renderer)
+        {
+            gpu->renderer->oam((uint16_t)oam_dma_done, (uint16_t)(due - oam_dma_done));
+        }
+        oam_dma_done = due;
+    }
+    if (oam_dma_done == 0xa0) {
+        bus_lock = 0;
+    }
+}
+
 void Mmunit::run_dma_hrampart() {
-    uint16_t mmu_src = hdma->src;    
-    for (size_t i = 0; i < 0x10; i++)
+    uint16_t dst = hdma->dst;
+    if (dst >= 0x8000 && dst + 0x10 <= 0xa000)
     {
-        uint8_t b = get(mmu_src + i);
-        gpu->set(hdma->dst + i, b);
-    }    
+        get_block(hdma->src, &gpu->ram[gpu->ram_bank * 0x2000 + dst - 0x8000], 0x10);
+        if (gpu->renderer)
+        {
+            gpu->renderer->ram((uint16_t)(gpu->ram_bank * 0x2000 + dst - 0x8000), 0x10);
+        }
+    } else
+    {
+        for (size_t i = 0; i < 0x10; i++)
+        {
+            uint8_t b = get_mapped((uint16_t)(hdma->src + i));
+            gpu->set((uint16_t)(dst + i), b);
+        }
+    }
 
     hdma->src += 0x10;
     hdma->dst += 0x10;
@@ -153,7 +254,45 @@ void Mmunit::run_dma_hrampart() {
     }
 }
 
-uint8_t Mmunit::get(unsigned int a)
+const uint8_t *Mmunit::host(unsigned int a, unsigned int &len)
+{
+    if (a >= 0x0000 && a <= 0x7fff) { return cartridge->host(a, len); }
+    if (a >= 0x8000 && a <= 0x9fff) { len = 0xa000 - a; return &gpu->ram[gpu->ram_bank * 0x2000 + a - 0x8000]; }
+    if (a >= 0xa000 && a <= 0xbfff) { return cartridge->host(a, len); }
+    if (a >= 0xc000 && a <= 0xcfff) { len = 0xd000 - a; return &wram[a - 0xc000]; }
+    if (a >= 0xd000 && a <= 0xdfff) { len = 0xe000 - a; return &wram[a - 0xd000 + 0x1000 * wram_bank]; }
+    if (a >= 0xe000 && a <= 0xefff) { len = 0xf000 - a; return &wram[a - 0xe000]; }
+    if (a >= 0xf000 && a <= 0xfdff) { len = 0xfe00 - a; return &wram[a - 0xf000 + 0x1000 * wram_bank]; }
+    if (a >= 0xfe00 && a <= 0xfe9f) { len = 0xfea0 - a; return &gpu->oam[a - 0xfe00]; }
+    if (a >= 0xff80 && a <= 0xfffe) { len = 0xffff - a; return &hram[a - 0xff80]; }
+    return NULL;
+}
+
+void Mmunit::get_block(unsigned int a, uint8_t *dst, unsigned int n)
+{
+    while (n > 0)
+    {
+        unsigned int len = 0;
+        const uint8_t *p = host(a & 0xffff, len);
+        if (p)
+        {
+            if (len > n)
+            {
+                len = n;
+            }
+            memcpy(dst, p, len);
+        } else
+        {
+            len = 1;
+            *dst = get_mapped(a & 0xffff);
+        }
+        a += len;
+        dst += len;
+        n -= len;
+    }
+}
+
+uint8_t Mmunit::get_mapped(unsigned int a)
 {
     if (a >= 0x0000 && a <= 0x7fff) { return cartridge->get(a); }
     if (a >= 0x8000 && a <= 0x9fff) { return gpu->get(a); }
@@ -172,11 +311,14 @@ uint8_t Mmunit::get(unsigned int a)
     {
         if (apu)
         {
+            apu->sync();
             return apu->get(a);
         }
         return 0x00;
     }
     
+    if (a == 0xff46) return (uint8_t)(oam_dma_src >> 8);
+
     if (a == 0xff4d) {
         uint8_t a = (speed == Speed_Double) ? 0x80 : 0x00;
         uint8_t b = shift ? 0x01 : 0x00;
@@ -197,7 +339,7 @@ uint8_t Mmunit::get(unsigned int a)
     return 0x00;
 }
 
-void Mmunit::set(unsigned int a, uint8_t v)
+void Mmunit::set_mapped(unsigned int a, uint8_t v)
 {
     if (a >= 0x0000 && a <= 0x7fff) { cartridge->set(a, v); }
     if (a >= 0x8000 && a <= 0x9fff) { gpu->set(a, v); }
@@ -207,19 +349,18 @@ void Mmunit::set(unsigned int a, uint8_t v)
     if (a >= 0xe000 && a <= 0xefff) { wram[a  - 0xe000] = v; }
     if (a >= 0xf000 && a <= 0xfdff) { wram[a  - 0xf000 + 0x1000 * wram_bank] = v; }
     if (a >= 0xfe00 && a <= 0xfe9f) { gpu->set(a, v); }
-    if (a >= 0xfea0 && a <= 0xfeff) { 0x00; }
+    if (a >= 0xfea0 && a <= 0xfeff) { return; } // Unusable, writes are ignored.
     if (a == 0xff00) joypad.set(a, v);
     if (a >= 0xff01 && a <= 0xff02) { serial.set(a, v); }
     if (a >= 0xff04 && a <= 0xff07) { m_timer->set(a, v); }    
-    // 0xff10..=0xff3f => self.apu.as_mut().map_or((), |s| s.set(a, v)),
+    if (a >= 0xff10 && a <= 0xff3f && apu) { apu->sync(); apu->set(a, v); }
     if (a == 0xff46)
     {
-        uint16_t base = (uint16_t)v << 8;
-        for (size_t i = 0; i < 0xa0; i++)
-        {
-            uint16_t b = get(base + i);
-            set(0xfe00 + i, b);
-        }        
+        oam_dma_src = (uint16_t)v << 8;
+        oam_dma_done = 0;
+        oam_dma_clock = 0;
+        oam_dma_start = true;
+        bus_lock = 0xff00;
     }
     
     if (a == 0xff4d) {
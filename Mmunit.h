@@ -40,7 +40,7 @@ typedef struct Joypad
     }
 
     void keydown(JoypadKey key) {
-        matrix &= !(uint8_t)key;
+        matrix &= ~(uint8_t)key;
         intf->hi(Flags_Joypad);
     }
 
@@ -48,6 +48,14 @@ typedef struct Joypad
         matrix |= (uint8_t)key;
     }
 
+    // Replaces the whole key matrix. The joypad interrupt is requested if a key goes down.
+    void press(uint8_t m) {
+        if ((matrix & ~m) != 0x00) {
+            intf->hi(Flags_Joypad);
+        }
+        matrix = m;
+    }
+
     uint8_t get(uint16_t a) {
         // assert_eq!(a, 0xff00);
         if ((select & 0b00010000) == 0x00) {
@@ -77,6 +85,9 @@ typedef struct Serial {
     // Bit 1 - Clock Speed (0=Normal, 1=Fast) ** CGB Mode Only **
     // Bit 0 - Shift Clock (0=External Clock, 1=Internal Clock)
     uint8_t control;
+    // Bytes sent with the internal clock are appended here when it is not NULL, test ROMs report their results this
+    // way.
+    std::string *log;
 
     static Serial power_up(Intf *i)
     {
@@ -84,6 +95,8 @@ typedef struct Serial {
         serial._intf = i;
         serial.data = 0x00;
         serial.control = 0x00;
+        serial.log = NULL;
+        return serial;
     }
 
     uint8_t get(uint16_t a) {
@@ -111,6 +124,17 @@ typedef struct Serial {
             break;
         case 0xff02:
             control = v;
+            // No link partner is ever connected: a transfer on the internal clock completes at once, shifting in 0xff.
+            if ((v & 0x81) == 0x81)
+            {
+                if (log)
+                {
+                    log->push_back((char)data);
+                }
+                data = 0xff;
+                control &= 0x7f;
+                _intf->hi(Flags_Serial);
+            }
             break;
         
         default:
@@ -152,6 +176,11 @@ struct Timer {
 
     Timer(Intf *ii) {
         intf = ii;        
+        // DIV is not among the registers written at power up, and games seed their random numbers from it.
+        reg.div = 0x00;
+        reg.tima = 0x00;
+        reg.tma = 0x00;
+        reg.tac = 0x00;
         div_clock = new Clock(256);
         tma_clock = new Clock(1024);
     }
@@ -219,6 +248,14 @@ struct Timer {
         }
     }
 
+    // Number of cycles before TIMA overflows and requests an interrupt.
+    uint32_t horizon() {
+        if ((reg.tac & 0x04) == 0x00) {
+            return 0xffffffff;
+        }
+        return (0x100 - (uint32_t)reg.tima) * tma_clock->period - tma_clock->n;
+    }
+
     void next(uint32_t cycles) {
         // Increment div at rate of 16384Hz. Because the clock cycles is 4194304, so div increment every 256 cycles.
         reg.div = wrapping_add(reg.div, (uint8_t)div_clock->next(cycles));
@@ -245,7 +282,7 @@ typedef enum {
     Speed_Double = 0x02,
 } Speed;
 
-class Mmunit: public Memory {
+class Mmunit final: public Memory {
 public:
     Cartridge *cartridge;
     Apu *apu;
@@ -263,18 +300,77 @@ public:
     uint8_t *hram;
     uint8_t *wram;    
     uint8_t wram_bank;
-
+    const uint8_t *rom0;
+    // Base clock cycles since power up. It only depends on the emulated machine: input is stamped with it and the
+    // cartridge RTC counts time with it.
+    uint64_t clock;
+
+    // OAM DMA in flight: source address, bytes copied so far and CPU cycles since the 0xff46 write. While it runs the
+    // CPU can only reach 0xff00-0xffff, accesses below bus_lock read 0xff and drop writes. bus_lock is 0 otherwise.
+    // oam_dma_start is set by the write, until the cycles of the instruction that made it have been discarded.
+    uint16_t oam_dma_src;
+    uint32_t oam_dma_done;
+    uint32_t oam_dma_clock;
+    bool oam_dma_start;
+    unsigned int bus_lock;
 
     Mmunit(std::string path);
     ~Mmunit();
 
     uint8_t get(unsigned int a);
     void set(unsigned int a, uint8_t v);
+    uint16_t get_word(unsigned int a);
+    void set_word(unsigned int a, uint16_t v);
+
+    // The full range chain, for everything not handled inline by get() and set().
+    uint8_t get_mapped(unsigned int a);
+    void set_mapped(unsigned int a, uint8_t v);
 
     uint32_t next(uint32_t cycles);
+    uint32_t horizon();
+    void state(State &s);
     void switch_speed();
     uint32_t run_dma();
     void run_dma_hrampart();
+    void run_oam_dma(uint32_t cycles);
+
+    // Bulk transfers. host() resolves a bus address to the memory behind it and the number of contiguous bytes that
+    // follow, get_block() copies with one memcpy per region and falls back to get_mapped() for anything memory mapped.
+    // Neither is subject to bus_lock.
+    const uint8_t *host(unsigned int a, unsigned int &len);
+    void get_block(unsigned int a, uint8_t *dst, unsigned int n);
 };
 
+// Mmunit is final, so calls from Cpu<Mmunit> are bound statically. ROM bank 0, WRAM and HRAM, which take nearly all
+// instruction fetches, operands and stack accesses, are decoded here so that they are inlined into the CPU.
+inline uint8_t Mmunit::get(unsigned int a)
+{
+    if (a < bus_lock) { return 0xff; }
+    if (a <= 0x3fff && rom0) { return rom0[a]; }
+    if (a >= 0xc000 && a <= 0xcfff) { return wram[a - 0xc000]; }
+    if (a >= 0xd000 && a <= 0xdfff) { return wram[a - 0xd000 + 0x1000 * wram_bank]; }
+    if (a >= 0xff80 && a <= 0xfffe) { return hram[a - 0xff80]; }
+    return get_mapped(a);
+}
+
+inline void Mmunit::set(unsigned int a, uint8_t v)
+{
+    if (a < bus_lock) { return; }
+    if (a >= 0xc000 && a <= 0xcfff) { wram[a - 0xc000] = v; return; }
+    if (a >= 0xd000 && a <= 0xdfff) { wram[a - 0xd000 + 0x1000 * wram_bank] = v; return; }
+    if (a >= 0xff80 && a <= 0xfffe) { hram[a - 0xff80] = v; return; }
+    set_mapped(a, v);
+}
+
+inline uint16_t Mmunit::get_word(unsigned int a)
+{
+    return (uint16_t)get(a) | (uint16_t)get(a + 1) << 8;
+}
+
+inline void Mmunit::set_word(unsigned int a, uint16_t v)
+{
+    set(a, (uint8_t)(v & 0xff));
+    set(a + 1, (uint8_t)(v >> 8));
+}
+
 #endif
\ No newline at end of file
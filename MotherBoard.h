@@ -3,18 +3,71 @@
 
 #include "CPU.h"
 #include "Mmunit.h"
+#include "Movie.h"
+#include "AudioRing.h"
 #include <string>
+#include <atomic>
+#include <limits>
+#include <algorithm>
 
 using namespace std;
 
+// Base clock cycles of one frame, 154 lines of 456 dots.
+static const uint32_t FRAME_DOTS = 70224;
+
+// Frames of audio the ring is kept at with audio pacing, about 43 ms at 48 kHz. It covers a video frame of samples
+// arriving at once plus a few device periods taken at once.
+static const size_t AUDIO_LATENCY = 2048;
+// Most the emulation speed is trimmed to follow the audio device, 0.5% is not heard as a change of pitch.
+static const double AUDIO_MAX_SKEW = 0.005;
+
+typedef enum {
+    MovieMode_Off,
+    MovieMode_Record, // Input changes are appended to the movie as they are latched.
+    MovieMode_Play,   // Input comes from the movie, keys of the host are ignored.
+} MovieMode;
+
 struct MotherBoard
 {
     Rtc *cpu;
     Mmunit *mmu;
+    // Frames per second the display can present. Frames beyond that are emulated but not drawn, which is what lets
+    // fast forward run faster than rendering. 0 draws every frame.
+    double present_fps;
+    std::chrono::steady_clock::time_point next_present;
+    // Frames emulated ahead of the real one to hide input lag, 0 turns run-ahead off. See run_frame().
+    uint32_t run_ahead;
+    // Snapshot of the real frame while run-ahead frames are emulated on top of it. It is kept between frames, so
+    // after the first one saving it does not allocate.
+    State ahead;
+
+    // Keys held on the host, as a Joypad::matrix. The window may write it from any thread, it reaches the joypad only
+    // when run_frame() latches it, at the start of a frame.
+    std::atomic<uint8_t> keys;
+    Movie movie;
+    MovieMode movie_mode;
+    // Next event of the movie to play, and the cycle it is due at.
+    size_t movie_pos;
+    uint64_t input_due;
+
+    // Where the samples of the APU go, NULL leaves them in Apu::out. Only samples of 1x are kept, at other speeds they
+    // are dropped.
+    AudioRing *audio;
+    // Pace by the fill level of audio rather than the host clock, see pace_frame().
+    bool audio_pacing;
 
     MotherBoard(string path) {
         mmu = new Mmunit(path);
         cpu = new Rtc(mmu->term, mmu);
+        present_fps = 0.0;
+        next_present = std::chrono::steady_clock::now();
+        run_ahead = 0;
+        keys = 0xff;
+        movie_mode = MovieMode_Off;
+        movie_pos = 0;
+        input_due = std::numeric_limits<uint64_t>::max();
+        audio = NULL;
+        audio_pacing = false;
     }
 
     ~MotherBoard() {
@@ -25,17 +78,238 @@ struct MotherBoard
     uint32_t next()
     {
         cout << "pc ->> " << cpu->cpu->reg->pc << endl;
+        return step();
+    }
 
-        if (mmu->get(cpu->cpu->reg->pc) == 0x10)
+    // One instruction without the trace of next(). Returns the CPU cycles it took.
+    uint32_t step()
+    {
+        uint32_t dots;
+        return step(dots);
+    }
+
+    // Like step(), dots is set to the base clock cycles that passed, which differ from CPU cycles in double speed mode.
+    uint32_t step(uint32_t &dots)
+    {
+        if (mmu->clock >= input_due)
+        {
+            play_input();
+        }
+
+        Cpu<Mmunit> *c = cpu->cpu;
+        if (mmu->get(c->reg->pc) == 0x10)
         {
             mmu->switch_speed();
         }
 
-        uint32_t cycles = cpu->next();
-        mmu->next(cycles);
+        if (c->fusion)
+        {
+            c->horizon = mmu->horizon();
+            // The next movie event must be fed before the same instruction as without fusion, so no sequence may run
+            // over its cycle either.
+            if (input_due != std::numeric_limits<uint64_t>::max())
+            {
+                uint64_t left = (input_due > mmu->clock) ? (input_due - mmu->clock) * (uint32_t)mmu->speed : 0;
+                if (left < c->horizon)
+                {
+                    c->horizon = (uint32_t)left;
+                }
+            }
+        }
+        uint32_t cycles = c->next();
+        dots = mmu->next(cycles);
         return cycles;
     }
 
+    // Records the input of the run into the movie from now on.
+    void record()
+    {
+        movie.events.clear();
+        movie_mode = MovieMode_Record;
+    }
+
+    // Replays the input of the movie, which must have been recorded from power up. Every change is fed to the joypad
+    // before the first instruction that starts at or after its cycle, which is the instruction it was latched before
+    // when it was recorded.
+    void play()
+    {
+        movie_mode = MovieMode_Play;
+        movie_pos = 0;
+        update_input_due();
+    }
+
+    void update_input_due()
+    {
+        bool pending = movie_mode == MovieMode_Play && movie_pos < movie.events.size();
+        input_due = pending ? movie.events[movie_pos].cycle : std::numeric_limits<uint64_t>::max();
+    }
+
+    void play_input()
+    {
+        while (movie_pos < movie.events.size() && movie.events[movie_pos].cycle <= mmu->clock)
+        {
+            mmu->joypad.press(movie.events[movie_pos].keys);
+            movie_pos++;
+        }
+        update_input_due();
+    }
+
+    // Hands the keys of the host to the joypad, at a cycle that only depends on the emulation.
+    void latch_input()
+    {
+        uint8_t k = keys;
+        if (movie_mode == MovieMode_Play || k == mmu->joypad.matrix)
+        {
+            return;
+        }
+        mmu->joypad.press(k);
+        if (movie_mode == MovieMode_Record)
+        {
+            MovieEvent e;
+            e.cycle = mmu->clock;
+            e.keys = k;
+            movie.events.push_back(e);
+        }
+    }
+
+    void save_state(State &s)
+    {
+        s.begin(false);
+        state(s);
+    }
+
+    void load_state(State &s)
+    {
+        s.begin(true);
+        state(s);
+        update_input_due();
+    }
+
+    void state(State &s)
+    {
+        s.io(movie_pos);
+        cpu->cpu->state(s);
+        mmu->state(s);
+    }
+
+    // Runs until the GPU finishes a frame, or for a frame worth of cycles while the LCD is off. Returns the base clock
+    // cycles that passed.
+    uint32_t emulate_frame()
+    {
+        uint32_t frame = mmu->gpu->frame_count;
+        uint32_t dots = 0;
+        while (mmu->gpu->frame_count == frame && dots < FRAME_DOTS)
+        {
+            uint32_t d;
+            step(d);
+            dots += d;
+        }
+        // A frame the LCD was off for ends without v-blank, where the render thread is waited for otherwise.
+        mmu->gpu->finish();
+        return dots;
+    }
+
+    // Emulates one frame, hands its sound to audio, then paces the emulation with pace_frame(). Pacing is only checked
+    // here, once per frame.
+    //
+    // At 1x every frame is drawn. At other speeds a frame is only drawn once the display is due for the next one, so
+    // 4x at 60 fps draws about every fourth frame and an unthrottled run draws as many as the display shows. Returns
+    // whether the frame was drawn.
+    //
+    // With run_ahead set, the real frame is emulated without drawing and saved, run_ahead more frames are emulated
+    // with the same input and only the last of them is drawn, then the saved state is restored. What is shown is
+    // run_ahead frames in the future of the machine, so a game that reacts to input a few frames late appears to react
+    // at once. Pacing still follows the real frame.
+    bool run_frame()
+    {
+        latch_input();
+
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        bool skipping = present_fps > 0.0 && cpu->speed != 1.0;
+        bool draw = !skipping || now >= next_present;
+        if (skipping && draw)
+        {
+            std::chrono::steady_clock::duration interval =
+                std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                    std::chrono::duration<double>(1.0 / present_fps));
+            // Catch up at most one interval, a burst of draws after a stall would only be skipped by the display.
+            next_present = (next_present + interval > now) ? next_present + interval : now + interval;
+        }
+
+        if (run_ahead == 0)
+        {
+            mmu->gpu->render = draw;
+            uint32_t dots = emulate_frame();
+            push_audio();
+            pace_frame(dots);
+            return draw;
+        }
+
+        mmu->gpu->render = false;
+        uint32_t dots = emulate_frame();
+        // Synthesize the sound of the real frame now, the APU would otherwise catch up on it in a hidden frame.
+        mmu->apu->sync();
+        save_state(ahead);
+        // Only the real frame is heard, the sound of frames that are rolled back is dropped, and so are their saves.
+        mmu->apu->output = false;
+        mmu->cartridge->persist = false;
+        for (uint32_t i = 1; i <= run_ahead; i++)
+        {
+            mmu->gpu->render = draw && i == run_ahead;
+            emulate_frame();
+        }
+        mmu->cartridge->persist = true;
+        mmu->apu->output = true;
+        load_state(ahead);
+        push_audio();
+        pace_frame(dots);
+        return draw;
+    }
+
+    // Moves the samples of the APU to audio.
+    void push_audio()
+    {
+        if (!audio)
+        {
+            return;
+        }
+        float buf[512 * 2];
+        size_t n;
+        while ((n = mmu->apu->read(buf, 512)) > 0)
+        {
+            if (cpu->speed == 1.0)
+            {
+                audio->write(buf, n);
+            }
+        }
+    }
+
+    // Waits for the host to catch up with the frame that was emulated.
+    //
+    // With audio pacing at 1x, the audio device is the clock. The wall clock deadline of Rtc is kept, so frames stay
+    // evenly spaced, but its rate is trimmed by how far the ring is from AUDIO_LATENCY: the emulation runs slightly
+    // faster while the ring is low and slightly slower while it is high. This is dynamic rate control applied to the
+    // emulation speed instead of the resampling ratio, the pitch moves by at most AUDIO_MAX_SKEW. The host clock and
+    // the device clock can disagree by any amount within that and the ring neither runs dry nor fills up, the video
+    // simply follows the audio. A ring below half the latency, after a stall or at start up, is refilled without
+    // waiting.
+    void pace_frame(uint32_t dots)
+    {
+        if (!audio || !audio_pacing || cpu->speed != 1.0)
+        {
+            cpu->pace(dots);
+            return;
+        }
+        double fill = (double)audio->fill() / AUDIO_LATENCY;
+        if (fill < 0.5)
+        {
+            cpu->pace(dots, 0.0);
+            return;
+        }
+        double skew = std::max(-AUDIO_MAX_SKEW, std::min(AUDIO_MAX_SKEW, 2.0 * AUDIO_MAX_SKEW * (1.0 - fill)));
+        cpu->pace(dots, 1.0 + skew);
+    }
+
     bool check_and_reset_gpu_updated()
     {
         bool result = mmu->gpu->v_blank;
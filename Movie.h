@@ -0,0 +1,58 @@
+#ifndef Movie_1
+#define Movie_1
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// A change of the joypad, stamped with the base clock cycle it happened at.
+struct MovieEvent {
+    // Base clock cycles since power up, see Mmunit::clock.
+    uint64_t cycle;
+    // The new Joypad::matrix, a cleared bit is a pressed key.
+    uint8_t keys;
+};
+
+// Joypad input of a run, recorded as the changes of the key matrix at the cycles they happened. The emulation is
+// deterministic given its input, so replaying a movie from power up reproduces the run exactly, no matter how fast
+// the host runs it or whether it is paced at all.
+//
+// File format, one event per line:
+//     <cycle> <keys>
+// with cycle in decimal and keys in hex.
+class Movie
+{
+public:
+    std::vector<MovieEvent> events;
+
+    bool load(const std::string &path)
+    {
+        std::ifstream in(path);
+        if (!in)
+        {
+            return false;
+        }
+        events.clear();
+        MovieEvent e;
+        unsigned int keys;
+        while (in >> std::dec >> e.cycle >> std::hex >> keys)
+        {
+            e.keys = (uint8_t)keys;
+            events.push_back(e);
+        }
+        return in.eof();
+    }
+
+    bool save(const std::string &path) const
+    {
+        std::ofstream out(path);
+        for (size_t i = 0; i < events.size(); i++)
+        {
+            out << std::dec << events[i].cycle << " " << std::hex << (unsigned int)events[i].keys << "\n";
+        }
+        return (bool)out;
+    }
+};
+
+#endif
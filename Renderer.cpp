@@ -0,0 +1,374 @@
+#include "Renderer.h"
+#include <cstdlib>
+#include <cstring>
+
+using namespace std;
+
+// A render thread that finds the ring empty yields this many times before it goes to sleep. Lines come every 456
+// dots, which unthrottled is a few microseconds, so it usually finds the next one before sleeping.
+static const int SPINS = 1000;
+
+// Draws line c on g, with the registers it carries.
+static void draw_line(Gpu *g, const RenderCommand &c)
+{
+    g->lcdc->data = c.v[0];
+    g->sx = c.v[1];
+    g->sy = c.v[2];
+    g->wx = c.v[3];
+    g->wy = c.v[4];
+    g->bgp = c.v[5];
+    g->op0 = c.v[6];
+    g->op1 = c.v[7];
+    g->ly = c.v[8];
+    if (g->term == Term_GBC || g->lcdc->bit0())
+    {
+        g->draw_bg();
+    }
+    if (g->lcdc->bit1())
+    {
+        g->draw_sprites();
+    }
+}
+
+Renderer::Renderer(Gpu *g, unsigned int threads)
+{
+    gpu = g;
+    mirror = new Gpu(g->term, &mirror_intf);
+    mirror->screen = g->data;
+    ring = new RenderCommand[SIZE];
+    head = 0;
+    tail = 0;
+    sleeping = false;
+    running = true;
+    batch_n = 0;
+    generation = 0;
+    pool_running = true;
+    next_line = 0;
+    lanes_done = 0;
+    last_owner = NULL;
+    for (unsigned int i = 1; i < threads; i++)
+    {
+        // A lane reads the memory of the mirror, its own is given back.
+        Gpu *lane = new Gpu(g->term, &mirror_intf);
+        free(lane->ram);
+        free(lane->oam);
+        lane->ram = mirror->ram;
+        lane->oam = mirror->oam;
+        lane->screen = g->data;
+        lanes.push_back(lane);
+    }
+    for (size_t i = 0; i < lanes.size(); i++)
+    {
+        helpers.push_back(std::thread(&Renderer::helper, this, i));
+    }
+    worker = std::thread(&Renderer::loop, this);
+    resync();
+}
+
+Renderer::~Renderer()
+{
+    finish();
+    {
+        lock_guard<mutex> l(lock);
+        running = false;
+    }
+    wake.notify_one();
+    worker.join();
+    {
+        lock_guard<mutex> l(pool_lock);
+        pool_running = false;
+    }
+    pool_wake.notify_all();
+    for (size_t i = 0; i < helpers.size(); i++)
+    {
+        helpers[i].join();
+        lanes[i]->ram = NULL;
+        lanes[i]->oam = NULL;
+        delete lanes[i];
+    }
+    delete mirror;
+    delete[] ring;
+}
+
+void Renderer::push(const RenderCommand &c, bool wake_up)
+{
+    uint64_t h = head.load(memory_order_relaxed);
+    while (h - tail.load(memory_order_acquire) == SIZE)
+    {
+        notify();
+        this_thread::yield();
+    }
+    ring[h & (SIZE - 1)] = c;
+    head.store(h + 1, memory_order_seq_cst);
+    if (wake_up)
+    {
+        notify();
+    }
+}
+
+// sleeping is stored before the render thread checks head for the last time, and head is stored before it is checked
+// here, both in sequential order. So either the render thread sees the new command, or this sees it sleeping.
+void Renderer::notify()
+{
+    if (sleeping.load(memory_order_seq_cst))
+    {
+        lock_guard<mutex> l(lock);
+        wake.notify_one();
+    }
+}
+
+void Renderer::line()
+{
+    RenderCommand c;
+    c.op = RenderOp_Line;
+    c.n = 0;
+    c.a = 0;
+    c.v[0] = gpu->lcdc->data;
+    c.v[1] = gpu->sx;
+    c.v[2] = gpu->sy;
+    c.v[3] = gpu->wx;
+    c.v[4] = gpu->wy;
+    c.v[5] = gpu->bgp;
+    c.v[6] = gpu->op0;
+    c.v[7] = gpu->op1;
+    c.v[8] = gpu->ly;
+    push(c, true);
+}
+
+void Renderer::ram(uint16_t offset, uint16_t n)
+{
+    RenderCommand c;
+    c.op = RenderOp_Ram;
+    while (n > 0)
+    {
+        c.n = (uint8_t)(n < sizeof(c.v) ? n : sizeof(c.v));
+        c.a = offset;
+        memcpy(c.v, gpu->ram + offset, c.n);
+        push(c, false);
+        offset += c.n;
+        n -= c.n;
+    }
+}
+
+void Renderer::oam(uint16_t offset, uint16_t n)
+{
+    RenderCommand c;
+    c.op = RenderOp_Oam;
+    while (n > 0)
+    {
+        c.n = (uint8_t)(n < sizeof(c.v) ? n : sizeof(c.v));
+        c.a = offset;
+        memcpy(c.v, gpu->oam + offset, c.n);
+        push(c, false);
+        offset += c.n;
+        n -= c.n;
+    }
+}
+
+void Renderer::palette(bool sprite, uint8_t index)
+{
+    RenderCommand c;
+    c.op = sprite ? RenderOp_Obpd : RenderOp_Bgpd;
+    c.n = 3;
+    c.a = index;
+    memcpy(c.v, sprite ? gpu->cobpd[index >> 2][index & 3] : gpu->cbgpd[index >> 2][index & 3], 3);
+    push(c, false);
+}
+
+void Renderer::clear()
+{
+    RenderCommand c;
+    c.op = RenderOp_Clear;
+    c.n = 0;
+    c.a = 0;
+    push(c, true);
+}
+
+void Renderer::finish()
+{
+    if (!lanes.empty())
+    {
+        RenderCommand c;
+        c.op = RenderOp_Flush;
+        c.n = 0;
+        c.a = 0;
+        push(c, true);
+    }
+    uint64_t h = head.load(memory_order_relaxed);
+    if (tail.load(memory_order_acquire) == h)
+    {
+        return;
+    }
+    notify();
+    while (tail.load(memory_order_acquire) != h)
+    {
+        this_thread::yield();
+    }
+}
+
+// The render thread is idle once finish() returns, so the mirror can be written from here.
+void Renderer::resync()
+{
+    finish();
+    memcpy(mirror->ram, gpu->ram, 0x4000);
+    memcpy(mirror->oam, gpu->oam, 0xa0);
+    memcpy(mirror->cbgpd, gpu->cbgpd, sizeof(gpu->cbgpd));
+    memcpy(mirror->cobpd, gpu->cobpd, sizeof(gpu->cobpd));
+}
+
+void Renderer::loop()
+{
+    int spins = 0;
+    while (true)
+    {
+        uint64_t t = tail.load(memory_order_relaxed);
+        uint64_t h = head.load(memory_order_acquire);
+        if (t != h)
+        {
+            for (; t != h; t++)
+            {
+                run(ring[t & (SIZE - 1)]);
+            }
+            tail.store(t, memory_order_release);
+            spins = 0;
+            continue;
+        }
+        if (spins < SPINS)
+        {
+            spins++;
+            this_thread::yield();
+            continue;
+        }
+        unique_lock<mutex> l(lock);
+        sleeping.store(true, memory_order_seq_cst);
+        while (running && head.load(memory_order_seq_cst) == t)
+        {
+            wake.wait(l);
+        }
+        sleeping.store(false, memory_order_relaxed);
+        if (!running)
+        {
+            return;
+        }
+        spins = 0;
+    }
+}
+
+void Renderer::run(const RenderCommand &c)
+{
+    if (c.op != RenderOp_Line)
+    {
+        flush();
+    }
+    switch (c.op)
+    {
+    case RenderOp_Line:
+        // A DMG line without background leaves prio as the line before it, its sprites depend on the order.
+        if (lanes.empty() || (mirror->term != Term_GBC && !(c.v[0] & 0x01)))
+        {
+            flush();
+            draw_line(mirror, c);
+            break;
+        }
+        batch[batch_n++] = c;
+        if (batch_n == BATCH)
+        {
+            flush();
+        }
+        break;
+    case RenderOp_Ram:
+        memcpy(mirror->ram + c.a, c.v, c.n);
+        break;
+    case RenderOp_Oam:
+        memcpy(mirror->oam + c.a, c.v, c.n);
+        break;
+    case RenderOp_Bgpd:
+        memcpy(mirror->cbgpd[c.a >> 2][c.a & 3], c.v, 3);
+        break;
+    case RenderOp_Obpd:
+        memcpy(mirror->cobpd[c.a >> 2][c.a & 3], c.v, 3);
+        break;
+    case RenderOp_Clear:
+        memset(mirror->screen, 0xff, 144 * 160 * 3);
+        break;
+    case RenderOp_Flush:
+        break;
+    }
+}
+
+// Draws the batched lines, across the pool if there are enough of them.
+void Renderer::flush()
+{
+    if (batch_n == 0)
+    {
+        return;
+    }
+    if (batch_n < MIN_PARALLEL)
+    {
+        for (uint32_t i = 0; i < batch_n; i++)
+        {
+            draw_line(mirror, batch[i]);
+        }
+        batch_n = 0;
+        return;
+    }
+    for (size_t i = 0; i < lanes.size(); i++)
+    {
+        memcpy(lanes[i]->cbgpd, mirror->cbgpd, sizeof(mirror->cbgpd));
+        memcpy(lanes[i]->cobpd, mirror->cobpd, sizeof(mirror->cobpd));
+    }
+    next_line.store(0, memory_order_relaxed);
+    lanes_done.store(0, memory_order_relaxed);
+    {
+        lock_guard<mutex> l(pool_lock);
+        generation++;
+    }
+    pool_wake.notify_all();
+    draw_lines(mirror);
+    while (lanes_done.load(memory_order_acquire) != lanes.size())
+    {
+        this_thread::yield();
+    }
+    // The mirror goes on with the prio of the last line, as if it had drawn them all.
+    if (last_owner != mirror)
+    {
+        memcpy(mirror->prio, last_owner->prio, sizeof(Priority) * SCREEN_W);
+    }
+    batch_n = 0;
+}
+
+void Renderer::draw_lines(Gpu *g)
+{
+    uint32_t i;
+    while ((i = next_line.fetch_add(1, memory_order_relaxed)) < batch_n)
+    {
+        draw_line(g, batch[i]);
+        if (i == batch_n - 1)
+        {
+            last_owner = g;
+        }
+    }
+}
+
+// Each helper draws one share of every batch handed out, then waits for the next.
+void Renderer::helper(size_t i)
+{
+    uint64_t seen = 0;
+    while (true)
+    {
+        {
+            unique_lock<mutex> l(pool_lock);
+            while (pool_running && generation == seen)
+            {
+                pool_wake.wait(l);
+            }
+            if (!pool_running)
+            {
+                return;
+            }
+            seen = generation;
+        }
+        draw_lines(lanes[i]);
+        lanes_done.fetch_add(1, memory_order_release);
+    }
+}
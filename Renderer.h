@@ -0,0 +1,116 @@
+#ifndef Renderer_1
+#define Renderer_1
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "GPU.h"
+
+typedef enum {
+    RenderOp_Line,    // Draw line v[8] with the registers in v[0..7], see Renderer::line().
+    RenderOp_Ram,     // n bytes of VRAM at offset a (both banks, 0x0000-0x3fff) are now v[0..n-1].
+    RenderOp_Oam,     // n bytes of OAM at offset a are now v[0..n-1].
+    RenderOp_Bgpd,    // Color a of the CGB background palettes (palette * 4 + color) is now v[0..2].
+    RenderOp_Obpd,    // Same for the sprite palettes.
+    RenderOp_Clear,   // The LCD was turned off, the screen is white.
+    RenderOp_Flush,   // Draw the lines batched so far, see finish().
+} RenderOp;
+
+struct RenderCommand {
+    uint8_t op;
+    uint8_t n;
+    uint16_t a;
+    uint8_t v[12];
+};
+
+// Draws the scanlines of a Gpu on a second thread.
+//
+// Emulated timing stays on the thread that runs the Gpu: at the start of each mode 0, instead of drawing the line,
+// it records the registers the line is drawn with. Writes to VRAM, OAM and the CGB palettes are recorded as they
+// happen. The commands go through a single producer, single consumer ring to the render thread, which applies them
+// in order to a mirror Gpu and draws each line with the unchanged draw_bg() and draw_sprites() of the mirror, into
+// the data of the real Gpu. The mirror sees exactly the state the line would have been drawn with, so the frames are
+// the same as without the thread.
+//
+// The CPU thread emulates the next line while the last one is drawn. finish() waits for the render thread to catch
+// up, the Gpu calls it at v-blank, so data is complete whenever a frame is.
+//
+// With more than one thread, lines are not drawn as they come but batched, and a batch is split across a pool: the
+// render thread and threads - 1 helpers each take lines until none is left. Every helper draws on a lane, a Gpu of its
+// own that shares the VRAM and OAM of the mirror and has its own copy of the palettes and its own prio. The lines of a
+// batch only differ in their registers, so they can be drawn in any order. The exception is a DMG line with the
+// background off, whose sprites see the prio of the line before; it ends the batch and is drawn by the mirror. A batch
+// ends with the frame, and early when a VRAM, OAM or palette write comes in, since the lines before it have to see the
+// old memory. Games mostly write video memory during v-blank, so a frame is usually a single batch of 144 lines.
+class Renderer
+{
+public:
+    // Commands the ring holds. A full ring makes the CPU thread wait, it takes a frame writing VRAM nonstop.
+    static const uint32_t SIZE = 1 << 14;
+    // Most lines in a batch, and fewest for which the pool is woken, smaller batches are drawn by the render thread
+    // alone.
+    static const uint32_t BATCH = 154;
+    static const uint32_t MIN_PARALLEL = 16;
+
+    // threads is the number of threads that draw, at least 1.
+    Renderer(Gpu *g, unsigned int threads);
+    ~Renderer();
+
+    // Producer side, called by the Gpu and the DMA of Mmunit.
+    void line();
+    void ram(uint16_t offset, uint16_t n);
+    void oam(uint16_t offset, uint16_t n);
+    void palette(bool sprite, uint8_t index);
+    void clear();
+    // Waits until every command so far has been carried out.
+    void finish();
+    // Copies all of the VRAM, OAM and palettes to the mirror, after they changed behind the commands (a state load).
+    void resync();
+
+private:
+    Gpu *gpu;
+    Gpu *mirror;
+    Intf mirror_intf;
+    RenderCommand *ring;
+    char pad0[64];
+    std::atomic<uint64_t> head;
+    char pad1[64];
+    std::atomic<uint64_t> tail;
+    char pad2[64];
+    // Set while the render thread sleeps on wake, a producer that sees it notifies.
+    std::atomic<bool> sleeping;
+    std::atomic<bool> running;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::thread worker;
+
+    // The pool. A batch is handed out by bumping generation, lines are claimed with next_line and each helper counts
+    // itself in lanes_done when it finds none left.
+    std::vector<Gpu *> lanes;
+    std::vector<std::thread> helpers;
+    RenderCommand batch[BATCH];
+    uint32_t batch_n;
+    std::mutex pool_lock;
+    std::condition_variable pool_wake;
+    uint64_t generation;
+    bool pool_running;
+    std::atomic<uint32_t> next_line;
+    std::atomic<uint32_t> lanes_done;
+    // The Gpu that drew the last line of the batch, its prio is the one the next line sees.
+    Gpu *last_owner;
+
+    // Appends c. wake_up wakes the render thread if it sleeps, memory deltas do not: they only matter to the next
+    // line, which wakes it.
+    void push(const RenderCommand &c, bool wake_up);
+    void notify();
+    void loop();
+    void run(const RenderCommand &c);
+    void flush();
+    void draw_lines(Gpu *g);
+    void helper(size_t i);
+};
+
+#endif
@@ -0,0 +1,391 @@
+#include "Scaler.h"
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#include <immintrin.h>
+#define SCALER_X86 1
+#endif
+
+using namespace std;
+
+// Row kernels, one set per instruction set. A row2_* kernel scales the w pixels at cur, with the rows above and
+// below at up and dn, into the two output rows o0 and o1; a row3_* kernel into three rows. The pixels at index -1
+// and w of all three input rows are read as well.
+//
+// With the source pixel E and its neighbours
+//
+//   A B C
+//   D E F
+//   G H I
+//
+// nothing is done unless B != H and D != F, that is unless E lies on an edge. Then each corner of the output takes
+// the color of the two neighbours it touches if they are equal.
+
+static void row2_scalar(const uint32_t *up, const uint32_t *cur, const uint32_t *dn, int w, uint32_t *o0,
+                        uint32_t *o1)
+{
+    for (int x = 0; x < w; x++)
+    {
+        uint32_t b = up[x];
+        uint32_t d = cur[x - 1];
+        uint32_t e = cur[x];
+        uint32_t f = cur[x + 1];
+        uint32_t h = dn[x];
+        if (b != h && d != f)
+        {
+            o0[2 * x] = d == b ? d : e;
+            o0[2 * x + 1] = b == f ? f : e;
+            o1[2 * x] = d == h ? d : e;
+            o1[2 * x + 1] = h == f ? f : e;
+        } else
+        {
+            o0[2 * x] = o0[2 * x + 1] = o1[2 * x] = o1[2 * x + 1] = e;
+        }
+    }
+}
+
+static void row3_scalar(const uint32_t *up, const uint32_t *cur, const uint32_t *dn, int w, uint32_t *o0,
+                        uint32_t *o1, uint32_t *o2)
+{
+    for (int x = 0; x < w; x++)
+    {
+        uint32_t a = up[x - 1], b = up[x], c = up[x + 1];
+        uint32_t d = cur[x - 1], e = cur[x], f = cur[x + 1];
+        uint32_t g = dn[x - 1], h = dn[x], i = dn[x + 1];
+        uint32_t *p0 = o0 + 3 * x;
+        uint32_t *p1 = o1 + 3 * x;
+        uint32_t *p2 = o2 + 3 * x;
+        if (b != h && d != f)
+        {
+            p0[0] = d == b ? d : e;
+            p0[1] = (d == b && e != c) || (b == f && e != a) ? b : e;
+            p0[2] = b == f ? f : e;
+            p1[0] = (d == b && e != g) || (d == h && e != a) ? d : e;
+            p1[1] = e;
+            p1[2] = (b == f && e != i) || (h == f && e != c) ? f : e;
+            p2[0] = d == h ? d : e;
+            p2[1] = (d == h && e != i) || (h == f && e != g) ? h : e;
+            p2[2] = h == f ? f : e;
+        } else
+        {
+            p0[0] = p0[1] = p0[2] = e;
+            p1[0] = p1[1] = p1[2] = e;
+            p2[0] = p2[1] = p2[2] = e;
+        }
+    }
+}
+
+#ifdef SCALER_X86
+
+// m ? a : b for each pixel.
+static inline __m128i select_sse2(__m128i m, __m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b));
+}
+
+// Stores a0 b0 c0 a1 b1 c1 a2 b2 c2 a3 b3 c3 at o.
+static inline void store3_sse2(uint32_t *o, __m128i a, __m128i b, __m128i c)
+{
+    __m128 ab_lo = _mm_castsi128_ps(_mm_unpacklo_epi32(a, b)); // a0 b0 a1 b1
+    __m128 ab_hi = _mm_castsi128_ps(_mm_unpackhi_epi32(a, b)); // a2 b2 a3 b3
+    __m128 ca_lo = _mm_castsi128_ps(_mm_unpacklo_epi32(c, a)); // c0 a0 c1 a1
+    __m128 ca_hi = _mm_castsi128_ps(_mm_unpackhi_epi32(c, a)); // c2 a2 c3 a3
+    __m128 bc_lo = _mm_castsi128_ps(_mm_unpacklo_epi32(b, c)); // b0 c0 b1 c1
+    __m128 bc_hi = _mm_castsi128_ps(_mm_unpackhi_epi32(b, c)); // b2 c2 b3 c3
+    _mm_storeu_ps((float *)o, _mm_shuffle_ps(ab_lo, ca_lo, _MM_SHUFFLE(3, 0, 1, 0)));
+    _mm_storeu_ps((float *)o + 4, _mm_shuffle_ps(bc_lo, ab_hi, _MM_SHUFFLE(1, 0, 3, 2)));
+    _mm_storeu_ps((float *)o + 8, _mm_shuffle_ps(ca_hi, bc_hi, _MM_SHUFFLE(3, 2, 3, 0)));
+}
+
+static void row2_sse2(const uint32_t *up, const uint32_t *cur, const uint32_t *dn, int w, uint32_t *o0, uint32_t *o1)
+{
+    int x = 0;
+    for (; x + 4 <= w; x += 4)
+    {
+        __m128i b = _mm_loadu_si128((const __m128i *)(up + x));
+        __m128i d = _mm_loadu_si128((const __m128i *)(cur + x - 1));
+        __m128i e = _mm_loadu_si128((const __m128i *)(cur + x));
+        __m128i f = _mm_loadu_si128((const __m128i *)(cur + x + 1));
+        __m128i h = _mm_loadu_si128((const __m128i *)(dn + x));
+        __m128i flat = _mm_or_si128(_mm_cmpeq_epi32(b, h), _mm_cmpeq_epi32(d, f));
+        __m128i e0 = select_sse2(_mm_andnot_si128(flat, _mm_cmpeq_epi32(d, b)), d, e);
+        __m128i e1 = select_sse2(_mm_andnot_si128(flat, _mm_cmpeq_epi32(b, f)), f, e);
+        __m128i e2 = select_sse2(_mm_andnot_si128(flat, _mm_cmpeq_epi32(d, h)), d, e);
+        __m128i e3 = select_sse2(_mm_andnot_si128(flat, _mm_cmpeq_epi32(h, f)), f, e);
+        _mm_storeu_si128((__m128i *)(o0 + 2 * x), _mm_unpacklo_epi32(e0, e1));
+        _mm_storeu_si128((__m128i *)(o0 + 2 * x + 4), _mm_unpackhi_epi32(e0, e1));
+        _mm_storeu_si128((__m128i *)(o1 + 2 * x), _mm_unpacklo_epi32(e2, e3));
+        _mm_storeu_si128((__m128i *)(o1 + 2 * x + 4), _mm_unpackhi_epi32(e2, e3));
+    }
+    row2_scalar(up + x, cur + x, dn + x, w - x, o0 + 2 * x, o1 + 2 * x);
+}
+
+static void row3_sse2(const uint32_t *up, const uint32_t *cur, const uint32_t *dn, int w, uint32_t *o0, uint32_t *o1,
+                      uint32_t *o2)
+{
+    int x = 0;
+    for (; x + 4 <= w; x += 4)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(up + x - 1));
+        __m128i b = _mm_loadu_si128((const __m128i *)(up + x));
+        __m128i c = _mm_loadu_si128((const __m128i *)(up + x + 1));
+        __m128i d = _mm_loadu_si128((const __m128i *)(cur + x - 1));
+        __m128i e = _mm_loadu_si128((const __m128i *)(cur + x));
+        __m128i f = _mm_loadu_si128((const __m128i *)(cur + x + 1));
+        __m128i g = _mm_loadu_si128((const __m128i *)(dn + x - 1));
+        __m128i h = _mm_loadu_si128((const __m128i *)(dn + x));
+        __m128i i = _mm_loadu_si128((const __m128i *)(dn + x + 1));
+        __m128i flat = _mm_or_si128(_mm_cmpeq_epi32(b, h), _mm_cmpeq_epi32(d, f));
+        __m128i db = _mm_cmpeq_epi32(d, b);
+        __m128i bf = _mm_cmpeq_epi32(b, f);
+        __m128i dh = _mm_cmpeq_epi32(d, h);
+        __m128i hf = _mm_cmpeq_epi32(h, f);
+        __m128i ea = _mm_cmpeq_epi32(e, a);
+        __m128i ec = _mm_cmpeq_epi32(e, c);
+        __m128i eg = _mm_cmpeq_epi32(e, g);
+        __m128i ei = _mm_cmpeq_epi32(e, i);
+        __m128i m0 = _mm_andnot_si128(flat, db);
+        __m128i m1 = _mm_andnot_si128(flat, _mm_or_si128(_mm_andnot_si128(ec, db), _mm_andnot_si128(ea, bf)));
+        __m128i m2 = _mm_andnot_si128(flat, bf);
+        __m128i m3 = _mm_andnot_si128(flat, _mm_or_si128(_mm_andnot_si128(eg, db), _mm_andnot_si128(ea, dh)));
+        __m128i m5 = _mm_andnot_si128(flat, _mm_or_si128(_mm_andnot_si128(ei, bf), _mm_andnot_si128(ec, hf)));
+        __m128i m6 = _mm_andnot_si128(flat, dh);
+        __m128i m7 = _mm_andnot_si128(flat, _mm_or_si128(_mm_andnot_si128(ei, dh), _mm_andnot_si128(eg, hf)));
+        __m128i m8 = _mm_andnot_si128(flat, hf);
+        store3_sse2(o0 + 3 * x, select_sse2(m0, d, e), select_sse2(m1, b, e), select_sse2(m2, f, e));
+        store3_sse2(o1 + 3 * x, select_sse2(m3, d, e), e, select_sse2(m5, f, e));
+        store3_sse2(o2 + 3 * x, select_sse2(m6, d, e), select_sse2(m7, h, e), select_sse2(m8, f, e));
+    }
+    row3_scalar(up + x, cur + x, dn + x, w - x, o0 + 3 * x, o1 + 3 * x, o2 + 3 * x);
+}
+
+// unpack works within each 128-bit half, the halves are put back in order when storing.
+__attribute__((target("avx2")))
+static void row2_avx2(const uint32_t *up, const uint32_t *cur, const uint32_t *dn, int w, uint32_t *o0, uint32_t *o1)
+{
+    int x = 0;
+    for (; x + 8 <= w; x += 8)
+    {
+        __m256i b = _mm256_loadu_si256((const __m256i *)(up + x));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(cur + x - 1));
+        __m256i e = _mm256_loadu_si256((const __m256i *)(cur + x));
+        __m256i f = _mm256_loadu_si256((const __m256i *)(cur + x + 1));
+        __m256i h = _mm256_loadu_si256((const __m256i *)(dn + x));
+        __m256i flat = _mm256_or_si256(_mm256_cmpeq_epi32(b, h), _mm256_cmpeq_epi32(d, f));
+        __m256i e0 = _mm256_blendv_epi8(e, d, _mm256_andnot_si256(flat, _mm256_cmpeq_epi32(d, b)));
+        __m256i e1 = _mm256_blendv_epi8(e, f, _mm256_andnot_si256(flat, _mm256_cmpeq_epi32(b, f)));
+        __m256i e2 = _mm256_blendv_epi8(e, d, _mm256_andnot_si256(flat, _mm256_cmpeq_epi32(d, h)));
+        __m256i e3 = _mm256_blendv_epi8(e, f, _mm256_andnot_si256(flat, _mm256_cmpeq_epi32(h, f)));
+        __m256i lo = _mm256_unpacklo_epi32(e0, e1);
+        __m256i hi = _mm256_unpackhi_epi32(e0, e1);
+        _mm256_storeu_si256((__m256i *)(o0 + 2 * x), _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *)(o0 + 2 * x + 8), _mm256_permute2x128_si256(lo, hi, 0x31));
+        lo = _mm256_unpacklo_epi32(e2, e3);
+        hi = _mm256_unpackhi_epi32(e2, e3);
+        _mm256_storeu_si256((__m256i *)(o1 + 2 * x), _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *)(o1 + 2 * x + 8), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    row2_scalar(up + x, cur + x, dn + x, w - x, o0 + 2 * x, o1 + 2 * x);
+}
+
+// The masks are worked out 8 pixels at a time, the three way interleave is done on each half with store3_sse2.
+__attribute__((target("avx2")))
+static void row3_avx2(const uint32_t *up, const uint32_t *cur, const uint32_t *dn, int w, uint32_t *o0, uint32_t *o1,
+                      uint32_t *o2)
+{
+    int x = 0;
+    for (; x + 8 <= w; x += 8)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(up + x - 1));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(up + x));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(up + x + 1));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(cur + x - 1));
+        __m256i e = _mm256_loadu_si256((const __m256i *)(cur + x));
+        __m256i f = _mm256_loadu_si256((const __m256i *)(cur + x + 1));
+        __m256i g = _mm256_loadu_si256((const __m256i *)(dn + x - 1));
+        __m256i h = _mm256_loadu_si256((const __m256i *)(dn + x));
+        __m256i i = _mm256_loadu_si256((const __m256i *)(dn + x + 1));
+        __m256i flat = _mm256_or_si256(_mm256_cmpeq_epi32(b, h), _mm256_cmpeq_epi32(d, f));
+        __m256i db = _mm256_cmpeq_epi32(d, b);
+        __m256i bf = _mm256_cmpeq_epi32(b, f);
+        __m256i dh = _mm256_cmpeq_epi32(d, h);
+        __m256i hf = _mm256_cmpeq_epi32(h, f);
+        __m256i ea = _mm256_cmpeq_epi32(e, a);
+        __m256i ec = _mm256_cmpeq_epi32(e, c);
+        __m256i eg = _mm256_cmpeq_epi32(e, g);
+        __m256i ei = _mm256_cmpeq_epi32(e, i);
+        __m256i m0 = _mm256_andnot_si256(flat, db);
+        __m256i m1 = _mm256_andnot_si256(flat, _mm256_or_si256(_mm256_andnot_si256(ec, db), _mm256_andnot_si256(ea, bf)));
+        __m256i m2 = _mm256_andnot_si256(flat, bf);
+        __m256i m3 = _mm256_andnot_si256(flat, _mm256_or_si256(_mm256_andnot_si256(eg, db), _mm256_andnot_si256(ea, dh)));
+        __m256i m5 = _mm256_andnot_si256(flat, _mm256_or_si256(_mm256_andnot_si256(ei, bf), _mm256_andnot_si256(ec, hf)));
+        __m256i m6 = _mm256_andnot_si256(flat, dh);
+        __m256i m7 = _mm256_andnot_si256(flat, _mm256_or_si256(_mm256_andnot_si256(ei, dh), _mm256_andnot_si256(eg, hf)));
+        __m256i m8 = _mm256_andnot_si256(flat, hf);
+        __m256i p[9] = {
+            _mm256_blendv_epi8(e, d, m0), _mm256_blendv_epi8(e, b, m1), _mm256_blendv_epi8(e, f, m2),
+            _mm256_blendv_epi8(e, d, m3), e, _mm256_blendv_epi8(e, f, m5),
+            _mm256_blendv_epi8(e, d, m6), _mm256_blendv_epi8(e, h, m7), _mm256_blendv_epi8(e, f, m8),
+        };
+        uint32_t *o[3] = { o0 + 3 * x, o1 + 3 * x, o2 + 3 * x };
+        for (int r = 0; r < 3; r++)
+        {
+            store3_sse2(o[r], _mm256_castsi256_si128(p[r * 3]), _mm256_castsi256_si128(p[r * 3 + 1]),
+                        _mm256_castsi256_si128(p[r * 3 + 2]));
+            store3_sse2(o[r] + 12, _mm256_extracti128_si256(p[r * 3], 1), _mm256_extracti128_si256(p[r * 3 + 1], 1),
+                        _mm256_extracti128_si256(p[r * 3 + 2], 1));
+        }
+    }
+    row3_scalar(up + x, cur + x, dn + x, w - x, o0 + 3 * x, o1 + 3 * x, o2 + 3 * x);
+}
+
+#endif
+
+// Fills the border of the w by h image in buf, which starts one row and one pixel before the image, with copies of
+// the pixels on the edge.
+static void fill_border(uint32_t *buf, int w, int h)
+{
+    int stride = w + 2;
+    for (int y = 1; y <= h; y++)
+    {
+        buf[y * stride] = buf[y * stride + 1];
+        buf[y * stride + w + 1] = buf[y * stride + w];
+    }
+    memcpy(buf, buf + stride, stride * sizeof(uint32_t));
+    memcpy(buf + (h + 1) * stride, buf + h * stride, stride * sizeof(uint32_t));
+}
+
+ScalerIsa Scaler::best_isa()
+{
+#ifdef SCALER_X86
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return ScalerIsa_Avx2;
+    }
+    return ScalerIsa_Sse2;
+#endif
+    return ScalerIsa_Scalar;
+}
+
+bool Scaler::parse(const string &name, ScaleFilter &f)
+{
+    static const char *const NAMES[4] = { "none", "scale2x", "scale3x", "scale4x" };
+    for (int i = 0; i < 4; i++)
+    {
+        if (name == NAMES[i])
+        {
+            f = (ScaleFilter)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+Scaler::Scaler(ScaleFilter f)
+{
+    isa = best_isa();
+    filter = f;
+    frame.assign((WIDTH + 2) * (HEIGHT + 2), 0);
+    if (filter == ScaleFilter_Scale4x)
+    {
+        half.assign((WIDTH * 2 + 2) * (HEIGHT * 2 + 2), 0);
+    }
+}
+
+int Scaler::factor() const
+{
+    switch (filter)
+    {
+    case ScaleFilter_Scale2x:
+        return 2;
+    case ScaleFilter_Scale3x:
+        return 3;
+    case ScaleFilter_Scale4x:
+        return 4;
+    default:
+        return 1;
+    }
+}
+
+void Scaler::pack(const uint8_t (*data)[WIDTH][3])
+{
+    for (int y = 0; y < HEIGHT; y++)
+    {
+        uint32_t *row = &frame[(y + 1) * (WIDTH + 2) + 1];
+        for (int x = 0; x < WIDTH; x++)
+        {
+            row[x] = 0xff000000 | (uint32_t)data[y][x][0] << 16 | (uint32_t)data[y][x][1] << 8 | data[y][x][2];
+        }
+    }
+    fill_border(&frame[0], WIDTH, HEIGHT);
+}
+
+void Scaler::scale2x(const uint32_t *src, int w, int h, int stride, uint32_t *dst, int dst_stride)
+{
+    void (*row)(const uint32_t *, const uint32_t *, const uint32_t *, int, uint32_t *, uint32_t *) = row2_scalar;
+#ifdef SCALER_X86
+    if (isa == ScalerIsa_Avx2)
+    {
+        row = row2_avx2;
+    }
+    if (isa == ScalerIsa_Sse2)
+    {
+        row = row2_sse2;
+    }
+#endif
+    for (int y = 0; y < h; y++)
+    {
+        const uint32_t *cur = src + y * stride;
+        uint32_t *o = dst + 2 * y * dst_stride;
+        row(cur - stride, cur, cur + stride, w, o, o + dst_stride);
+    }
+}
+
+void Scaler::scale3x(const uint32_t *src, int w, int h, int stride, uint32_t *dst, int dst_stride)
+{
+    void (*row)(const uint32_t *, const uint32_t *, const uint32_t *, int, uint32_t *, uint32_t *, uint32_t *) =
+        row3_scalar;
+#ifdef SCALER_X86
+    if (isa == ScalerIsa_Avx2)
+    {
+        row = row3_avx2;
+    }
+    if (isa == ScalerIsa_Sse2)
+    {
+        row = row3_sse2;
+    }
+#endif
+    for (int y = 0; y < h; y++)
+    {
+        const uint32_t *cur = src + y * stride;
+        uint32_t *o = dst + 3 * y * dst_stride;
+        row(cur - stride, cur, cur + stride, w, o, o + dst_stride, o + 2 * dst_stride);
+    }
+}
+
+void Scaler::process(const uint8_t (*data)[WIDTH][3], uint32_t *out)
+{
+    pack(data);
+    const int stride = WIDTH + 2;
+    const uint32_t *src = &frame[stride + 1];
+    switch (filter)
+    {
+    case ScaleFilter_Scale2x:
+        scale2x(src, WIDTH, HEIGHT, stride, out, WIDTH * 2);
+        break;
+    case ScaleFilter_Scale3x:
+        scale3x(src, WIDTH, HEIGHT, stride, out, WIDTH * 3);
+        break;
+    case ScaleFilter_Scale4x:
+        scale2x(src, WIDTH, HEIGHT, stride, &half[WIDTH * 2 + 3], WIDTH * 2 + 2);
+        fill_border(&half[0], WIDTH * 2, HEIGHT * 2);
+        scale2x(&half[WIDTH * 2 + 3], WIDTH * 2, HEIGHT * 2, WIDTH * 2 + 2, out, WIDTH * 4);
+        break;
+    default:
+        for (int y = 0; y < HEIGHT; y++)
+        {
+            memcpy(out + y * WIDTH, src + y * stride, WIDTH * sizeof(uint32_t));
+        }
+        break;
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef Scaler_1
+#define Scaler_1
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+typedef enum {
+    ScaleFilter_None,    // 160x144 as is.
+    ScaleFilter_Scale2x, // AdvMAME Scale2x (EPX), 320x288.
+    ScaleFilter_Scale3x, // AdvMAME Scale3x, 480x432.
+    ScaleFilter_Scale4x, // Scale2x applied twice, 640x576.
+} ScaleFilter;
+
+// Instruction set the Scaler kernels run on, picked like MixerIsa.
+typedef enum {
+    ScalerIsa_Scalar,
+    ScalerIsa_Sse2,
+    ScalerIsa_Avx2,
+} ScalerIsa;
+
+// Upscales finished frames for the window with the Scale2x family of pixel art filters. Each output pixel is either
+// the source pixel or one of its four neighbours, picked by comparing neighbours for equality. Edges and diagonals
+// made of equal colors come out smooth, everything else is plain pixel doubling, and no new colors appear, so the
+// palette of the Game Boy stays intact.
+//
+// Every comparison is independent of the others, so the kernels do 4 (SSE2) or 8 (AVX2) pixels at a time with
+// compare and select, and only fall back to a plain loop for the last pixels of a row.
+class Scaler
+{
+public:
+    static const int WIDTH = 160;
+    static const int HEIGHT = 144;
+
+    ScalerIsa isa;
+
+    Scaler(ScaleFilter f);
+
+    int factor() const;
+    int width() const { return WIDTH * factor(); }
+    int height() const { return HEIGHT * factor(); }
+
+    // Converts data of the Gpu to 0xffrrggbb and scales it into out, which holds width() * height() pixels.
+    void process(const uint8_t (*data)[WIDTH][3], uint32_t *out);
+
+    static ScalerIsa best_isa();
+    // Reads the name of a filter: none, scale2x, scale3x or scale4x.
+    static bool parse(const std::string &name, ScaleFilter &f);
+
+    // The stages on their own, for the benchmark. pack() converts data into the bordered source frame. scale2x() and
+    // scale3x() scale the w by h pixels at src, rows stride apart, whose border of one pixel all around must be
+    // readable, into dst, rows dst_stride apart.
+    void pack(const uint8_t (*data)[WIDTH][3]);
+    void scale2x(const uint32_t *src, int w, int h, int stride, uint32_t *dst, int dst_stride);
+    void scale3x(const uint32_t *src, int w, int h, int stride, uint32_t *dst, int dst_stride);
+
+private:
+    ScaleFilter filter;
+    // The source frame and the Scale2x pass of Scale4x, with a border of one pixel that repeats the edge.
+    std::vector<uint32_t> frame;
+    std::vector<uint32_t> half;
+};
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef State_1
+#define State_1
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Save state of the whole machine, as one flat buffer.
+//
+// Every component describes its state once, in a state(State &s) method that passes each field to io(). The same
+// method both saves and restores, depending on the direction given to begin(), so the two can never disagree on the
+// layout. The buffer keeps its size between states: once a machine has been saved, saving and restoring it again does
+// not allocate, which is what run-ahead relies on to snapshot every frame.
+//
+// Only emulated state is kept. Host side data such as the rendered frame in Gpu::data, configuration and file paths
+// are left alone.
+class State
+{
+public:
+    std::vector<uint8_t> buf;
+    size_t pos;
+    bool loading;
+
+    State()
+    {
+        pos = 0;
+        loading = false;
+    }
+
+    // Start saving into the buffer (loading = false) or restoring from it (loading = true).
+    void begin(bool load)
+    {
+        pos = 0;
+        loading = load;
+    }
+
+    void io(void *p, size_t n)
+    {
+        if (n == 0)
+        {
+            return;
+        }
+        if (loading)
+        {
+            memcpy(p, &buf[pos], n);
+        } else
+        {
+            if (pos + n > buf.size())
+            {
+                buf.resize(pos + n);
+            }
+            memcpy(&buf[pos], p, n);
+        }
+        pos += n;
+    }
+
+    template <typename T>
+    void io(T &v)
+    {
+        io(&v, sizeof(T));
+    }
+};
+
+#endif
@@ -1,4 +1,5 @@
 #include "Util.h"
+#include <cstring>
 
 uint8_t wrapping_sub(uint8_t a, uint8_t b)
 {
@@ -30,4 +31,100 @@ uint8_t trailing_zeros(uint8_t v)
         if (!t) v = q;  
     }
     return v;
-}
\ No newline at end of file
+}
+
+static const uint64_t XXH_P1 = 0x9e3779b185ebca87ULL;
+static const uint64_t XXH_P2 = 0xc2b2ae3d27d4eb4fULL;
+static const uint64_t XXH_P3 = 0x165667b19e3779f9ULL;
+static const uint64_t XXH_P4 = 0x85ebca77c2b2ae63ULL;
+static const uint64_t XXH_P5 = 0x27d4eb2f165667c5ULL;
+
+static inline uint64_t xxh_rotl(uint64_t v, int r)
+{
+    return (v << r) | (v >> (64 - r));
+}
+
+static inline uint64_t xxh_read64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t xxh_read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t v)
+{
+    acc += v * XXH_P2;
+    acc = xxh_rotl(acc, 31);
+    return acc * XXH_P1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t v)
+{
+    acc ^= xxh_round(0, v);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+// Reads are little endian, as on every host the emulator is built for.
+uint64_t xxhash64(const uint8_t *p, size_t n, uint64_t seed)
+{
+    const uint8_t *end = p + n;
+    uint64_t h;
+    if (n >= 32)
+    {
+        uint64_t v1 = seed + XXH_P1 + XXH_P2;
+        uint64_t v2 = seed + XXH_P2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_P1;
+        const uint8_t *limit = end - 32;
+        do
+        {
+            v1 = xxh_round(v1, xxh_read64(p));
+            v2 = xxh_round(v2, xxh_read64(p + 8));
+            v3 = xxh_round(v3, xxh_read64(p + 16));
+            v4 = xxh_round(v4, xxh_read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+        h = xxh_rotl(v1, 1) + xxh_rotl(v2, 7) + xxh_rotl(v3, 12) + xxh_rotl(v4, 18);
+        h = xxh_merge(h, v1);
+        h = xxh_merge(h, v2);
+        h = xxh_merge(h, v3);
+        h = xxh_merge(h, v4);
+    } else
+    {
+        h = seed + XXH_P5;
+    }
+    h += (uint64_t)n;
+
+    while (p + 8 <= end)
+    {
+        h ^= xxh_round(0, xxh_read64(p));
+        h = xxh_rotl(h, 27) * XXH_P1 + XXH_P4;
+        p += 8;
+    }
+    if (p + 4 <= end)
+    {
+        h ^= (uint64_t)xxh_read32(p) * XXH_P1;
+        h = xxh_rotl(h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    while (p < end)
+    {
+        h ^= (uint64_t)(*p) * XXH_P5;
+        h = xxh_rotl(h, 11) * XXH_P1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
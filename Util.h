@@ -2,6 +2,8 @@
 #define Util_1
 
 #include <vector>
+#include <cstddef>
+#include <cstdint>
 
 uint8_t wrapping_add(uint8_t a, uint8_t b);
 uint8_t wrapping_sub(uint8_t a, uint8_t b);
@@ -10,4 +12,7 @@ uint16_t wrapping_add_16(uint16_t a, uint16_t b);
 
 uint8_t trailing_zeros(uint8_t v);
 
+// XXH64 of n bytes at p. Used to fingerprint finished frames, it is not a cryptographic hash.
+uint64_t xxhash64(const uint8_t *p, size_t n, uint64_t seed);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,305 @@
+#include "VideoCapture.h"
+#include <chrono>
+#include <cstring>
+
+using namespace std;
+
+// Size of the AVI header up to the first frame chunk: RIFF, the hdrl list and the head of the movi list.
+static const uint32_t AVI_HEADER = 224;
+
+VideoCapture::VideoCapture()
+{
+    dropped = 0;
+    produced = 0;
+    consumed = 0;
+    all_changed = true;
+    format = VideoFormat_Y4m;
+    running = false;
+    opened = false;
+}
+
+VideoCapture::~VideoCapture()
+{
+    close();
+}
+
+bool VideoCapture::open(const string &path, VideoFormat f)
+{
+    file.open(path, ios::binary | ios::trunc);
+    if (!file)
+    {
+        return false;
+    }
+    format = f;
+    pool.assign((size_t)POOL * FRAME_BYTES, 0);
+    changed.assign((size_t)POOL * HEIGHT, 1);
+    all_changed = true;
+    produced = 0;
+    consumed = 0;
+    dropped = 0;
+    chunks.clear();
+    if (format == VideoFormat_Y4m)
+    {
+        // 4194304 / 70224 frames per second, about 59.73.
+        file << "YUV4MPEG2 W" << WIDTH << " H" << HEIGHT << " F4194304:70224 Ip A1:1 C444\n";
+    } else if (format == VideoFormat_Avi)
+    {
+        write_avi_header();
+    }
+    running = true;
+    writer = std::thread(&VideoCapture::loop, this);
+    opened = true;
+    return true;
+}
+
+void VideoCapture::capture(Gpu *gpu)
+{
+    uint64_t p = produced.load(memory_order_relaxed);
+    if (p - consumed.load(memory_order_acquire) == POOL)
+    {
+        dropped++;
+        all_changed = true;
+        return;
+    }
+    uint8_t *lines = &changed[(p % POOL) * HEIGHT];
+    bool any = false;
+    for (int y = 0; y < HEIGHT; y++)
+    {
+        lines[y] = all_changed || !gpu->track_lines || gpu->line_changed[y];
+        any = any || lines[y];
+    }
+    if (any)
+    {
+        memcpy(&pool[(p % POOL) * FRAME_BYTES], &gpu->data[0][0][0], FRAME_BYTES);
+    }
+    all_changed = false;
+    produced.store(p + 1, memory_order_release);
+}
+
+void VideoCapture::close()
+{
+    if (!opened)
+    {
+        return;
+    }
+    running = false;
+    writer.join();
+    if (format == VideoFormat_Avi)
+    {
+        // The index follows the movi list: one entry per frame, offsets from the 'movi' tag.
+        file.write("idx1", 4);
+        uint32_t size = (uint32_t)chunks.size() * 16;
+        file.write((const char *)&size, 4);
+        for (size_t i = 0; i < chunks.size(); i++)
+        {
+            uint32_t e[4] = { 0, 0x10, chunks[i], FRAME_BYTES };
+            memcpy(&e[0], "00db", 4);
+            file.write((const char *)e, sizeof(e));
+        }
+        write_avi_header();
+    }
+    file.close();
+    opened = false;
+}
+
+// Writes the published slots in order, then returns them. An empty pool is polled every few milliseconds, so the
+// emulation side never has to wake the writer. out holds the last frame written, converted.
+void VideoCapture::loop()
+{
+    vector<uint8_t> out(FRAME_BYTES + 8);
+    while (true)
+    {
+        bool stopping = !running;
+        uint64_t c = consumed.load(memory_order_relaxed);
+        uint64_t p = produced.load(memory_order_acquire);
+        if (c == p)
+        {
+            if (stopping)
+            {
+                return;
+            }
+            this_thread::sleep_for(chrono::milliseconds(2));
+            continue;
+        }
+        for (; c < p; c++)
+        {
+            write_frame(&pool[(c % POOL) * FRAME_BYTES], &changed[(c % POOL) * HEIGHT], out);
+            consumed.store(c + 1, memory_order_release);
+        }
+    }
+}
+
+// Converts the changed lines of one frame of Gpu::data into out, which holds the frame before, and writes it.
+// Integers in the file are little endian, as on every host this runs on.
+void VideoCapture::write_frame(const uint8_t *rgb, const uint8_t *lines, vector<uint8_t> &out)
+{
+    switch (format)
+    {
+    case VideoFormat_Y4m:
+    {
+        // Studio range BT.601, one plane each of Y, Cb and Cr.
+        const uint32_t n = WIDTH * HEIGHT;
+        for (int row = 0; row < HEIGHT; row++)
+        {
+            if (!lines[row])
+            {
+                continue;
+            }
+            uint8_t *y = &out[row * WIDTH];
+            uint8_t *u = y + n;
+            uint8_t *v = u + n;
+            const uint8_t *s = rgb + row * WIDTH * 3;
+            for (int i = 0; i < WIDTH; i++)
+            {
+                int r = s[i * 3];
+                int g = s[i * 3 + 1];
+                int b = s[i * 3 + 2];
+                y[i] = (uint8_t)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+                u[i] = (uint8_t)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+                v[i] = (uint8_t)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+            }
+        }
+        file.write("FRAME\n", 6);
+        file.write((const char *)&out[0], FRAME_BYTES);
+        break;
+    }
+    case VideoFormat_Rgb:
+        for (int row = 0; row < HEIGHT; row++)
+        {
+            if (lines[row])
+            {
+                memcpy(&out[row * WIDTH * 3], rgb + row * WIDTH * 3, WIDTH * 3);
+            }
+        }
+        file.write((const char *)&out[0], FRAME_BYTES);
+        break;
+    case VideoFormat_Avi:
+    {
+        uint32_t offset = 4 + (uint32_t)chunks.size() * (8 + FRAME_BYTES);
+        if (offset + 8 + FRAME_BYTES > AVI_LIMIT)
+        {
+            dropped++;
+            return;
+        }
+        // A DIB is stored bottom up, in BGR order.
+        uint32_t size = FRAME_BYTES;
+        memcpy(&out[0], "00db", 4);
+        memcpy(&out[4], &size, 4);
+        uint8_t *dib = &out[8];
+        for (int row = 0; row < HEIGHT; row++)
+        {
+            if (!lines[HEIGHT - 1 - row])
+            {
+                continue;
+            }
+            const uint8_t *s = rgb + (HEIGHT - 1 - row) * WIDTH * 3;
+            uint8_t *d = dib + row * WIDTH * 3;
+            for (int x = 0; x < WIDTH; x++)
+            {
+                d[x * 3] = s[x * 3 + 2];
+                d[x * 3 + 1] = s[x * 3 + 1];
+                d[x * 3 + 2] = s[x * 3];
+            }
+        }
+        file.write((const char *)&out[0], 8 + FRAME_BYTES);
+        chunks.push_back(offset);
+        break;
+    }
+    }
+}
+
+static void put_fourcc(vector<uint8_t> &h, const char *c)
+{
+    h.insert(h.end(), c, c + 4);
+}
+
+static void put_u32(vector<uint8_t> &h, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        h.push_back((uint8_t)(v >> (i * 8)));
+    }
+}
+
+static void put_u16(vector<uint8_t> &h, uint16_t v)
+{
+    h.push_back((uint8_t)v);
+    h.push_back((uint8_t)(v >> 8));
+}
+
+// The AVI header for the frames written so far. It is written with no frames by open() and again by close(), both
+// times AVI_HEADER bytes at the start of the file.
+void VideoCapture::write_avi_header()
+{
+    uint32_t frames = (uint32_t)chunks.size();
+    uint32_t movi = 4 + frames * (8 + FRAME_BYTES);
+    uint32_t idx = 8 + frames * 16;
+    vector<uint8_t> h;
+    put_fourcc(h, "RIFF");
+    put_u32(h, AVI_HEADER - 8 + movi - 4 + idx);
+    put_fourcc(h, "AVI ");
+
+    put_fourcc(h, "LIST");
+    put_u32(h, 192);
+    put_fourcc(h, "hdrl");
+    put_fourcc(h, "avih");
+    put_u32(h, 56);
+    put_u32(h, 16743);                       // microseconds per frame
+    put_u32(h, FRAME_BYTES * 60);            // max bytes per second
+    put_u32(h, 0);                           // padding granularity
+    put_u32(h, 0x10);                        // AVIF_HASINDEX
+    put_u32(h, frames);
+    put_u32(h, 0);                           // initial frames
+    put_u32(h, 1);                           // streams
+    put_u32(h, FRAME_BYTES);                 // suggested buffer size
+    put_u32(h, WIDTH);
+    put_u32(h, HEIGHT);
+    for (int i = 0; i < 4; i++)
+    {
+        put_u32(h, 0);
+    }
+
+    put_fourcc(h, "LIST");
+    put_u32(h, 116);
+    put_fourcc(h, "strl");
+    put_fourcc(h, "strh");
+    put_u32(h, 56);
+    put_fourcc(h, "vids");
+    put_fourcc(h, "DIB ");
+    put_u32(h, 0);                           // flags
+    put_u16(h, 0);                           // priority
+    put_u16(h, 0);                           // language
+    put_u32(h, 0);                           // initial frames
+    put_u32(h, 70224);                       // scale
+    put_u32(h, 4194304);                     // rate, frames per second is rate / scale
+    put_u32(h, 0);                           // start
+    put_u32(h, frames);                      // length
+    put_u32(h, FRAME_BYTES);                 // suggested buffer size
+    put_u32(h, 0xffffffff);                  // quality
+    put_u32(h, 0);                           // sample size
+    put_u16(h, 0);
+    put_u16(h, 0);
+    put_u16(h, WIDTH);
+    put_u16(h, HEIGHT);
+    put_fourcc(h, "strf");
+    put_u32(h, 40);
+    put_u32(h, 40);                          // BITMAPINFOHEADER size
+    put_u32(h, WIDTH);
+    put_u32(h, HEIGHT);                      // positive, bottom up
+    put_u16(h, 1);                           // planes
+    put_u16(h, 24);                          // bits per pixel
+    put_u32(h, 0);                           // BI_RGB
+    put_u32(h, FRAME_BYTES);
+    for (int i = 0; i < 4; i++)
+    {
+        put_u32(h, 0);
+    }
+
+    put_fourcc(h, "LIST");
+    put_u32(h, movi);
+    put_fourcc(h, "movi");
+
+    file.seekp(0);
+    file.write((const char *)&h[0], h.size());
+    file.seekp(0, ios::end);
+}
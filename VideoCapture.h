@@ -0,0 +1,73 @@
+#ifndef VideoCapture_1
+#define VideoCapture_1
+
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "GPU.h"
+
+typedef enum {
+    VideoFormat_Y4m, // YUV4MPEG2, 4:4:4 BT.601. Plays in mpv and ffmpeg reads it directly.
+    VideoFormat_Rgb, // Frames of 160x144 rgb24 back to back, without any header.
+    VideoFormat_Avi, // Uncompressed 24-bit DIB frames in an AVI 1.0 file with an index.
+} VideoFormat;
+
+// Streams finished frames of the GPU to a file. Frames go through a pool of POOL slots allocated once by open(): the
+// emulation thread copies a frame into the next free slot and publishes it, a writer thread converts and writes the
+// slots in order and hands them back. Slot k of the stream is pool[k % POOL], so the two sides share nothing but
+// the counters of frames handed over and frames written.
+//
+// The emulation thread never waits and never allocates. When all slots are still waiting for the writer, the frame
+// is dropped and counted in dropped.
+//
+// With Gpu::track_lines set, only the lines that changed are converted: the writer keeps the last frame in the
+// format of the file and redoes the changed lines of it. A frame with no line changed is not even copied, the last
+// one is written again.
+class VideoCapture
+{
+public:
+    static const int WIDTH = 160;
+    static const int HEIGHT = 144;
+    static const uint32_t FRAME_BYTES = WIDTH * HEIGHT * 3;
+    static const uint32_t POOL = 16;
+    // AVI 1.0 chunk offsets are 32-bit, frames past this size of the movi list are dropped.
+    static const uint64_t AVI_LIMIT = 1ull << 30;
+
+    std::atomic<uint64_t> dropped;
+
+    VideoCapture();
+    ~VideoCapture();
+
+    bool open(const std::string &path, VideoFormat f);
+    // Hands the frame in gpu->data to the writer. Call it once per finished frame, when Gpu::frame_count moves, and
+    // draw every frame while capturing, or line_changed would not be relative to the last frame captured.
+    void capture(Gpu *gpu);
+    // Writes the frames still in the pool, completes the header and closes the file.
+    void close();
+
+private:
+    std::vector<uint8_t> pool;
+    // Which lines of each slot changed since the frame before. A slot with none has no pixels copied into it.
+    std::vector<uint8_t> changed;
+    // Set after a drop, the lines of the next frame are relative to a frame the writer never saw.
+    bool all_changed;
+    // Frames handed to the writer and frames it has written, since open().
+    std::atomic<uint64_t> produced;
+    std::atomic<uint64_t> consumed;
+    std::ofstream file;
+    VideoFormat format;
+    // Offsets of the AVI chunks, for the index. Only the writer thread touches it.
+    std::vector<uint32_t> chunks;
+    std::thread writer;
+    std::atomic<bool> running;
+    bool opened;
+
+    void loop();
+    void write_frame(const uint8_t *rgb, const uint8_t *lines, std::vector<uint8_t> &out);
+    void write_avi_header();
+};
+
+#endif
@@ -0,0 +1,896 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <algorithm>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include "CPU.h"
+#include "Alu.h"
+#include "Cartridge.h"
+#include "Mmunit.h"
+#include "Scaler.h"
+
+using namespace std;
+
+// Microbenchmarks of the emulator hot paths, each kernel is timed in isolation.
+//
+// Usage: benchmark [-m] [-p] [-f filter] [rom]
+//     -m  machine readable output, one tab separated line per kernel: name, ns/iter, cycles/iter, iterations.
+//     -p  add hardware counters per kernel (Linux perf_event_open): host IPC, branch-miss rate, branch misses and L1d
+//         read misses per iteration.
+//     -f  only run kernels whose name contains filter.
+//     rom cartridge for the bus kernels, boxes.gb by default. They are skipped if it can not be read.
+//
+// Every kernel runs once to warm up and then REPEATS times, the median is reported. Cycles are TSC ticks on x86 and
+// are reported as 0 elsewhere.
+
+// Bit-twiddling versions of the table driven Cpu::alu_*, they are used both as the baseline for timing and as the
+// reference the tables are checked against.
+namespace twiddle {
+
+static inline uint8_t flags(bool z, bool n, bool h, bool c)
+{
+    return (z ? Flag_Z : 0x00) | (n ? Flag_N : 0x00) | (h ? Flag_H : 0x00) | (c ? Flag_C : 0x00);
+}
+
+static uint8_t inc(uint8_t &f, uint8_t a)
+{
+    uint8_t r = a + 1;
+    f = (f & Flag_C) | flags(r == 0x00, false, (a & 0x0f) + 0x01 > 0x0f, false);
+    return r;
+}
+
+static uint8_t dec(uint8_t &f, uint8_t a)
+{
+    uint8_t r = a - 1;
+    f = (f & Flag_C) | flags(r == 0x00, true, (a & 0x0f) == 0x00, false);
+    return r;
+}
+
+static uint8_t swap(uint8_t &f, uint8_t a)
+{
+    f = flags(a == 0x00, false, false, false);
+    return (a >> 4) | (a << 4);
+}
+
+static uint8_t rlc(uint8_t &f, uint8_t a)
+{
+    bool c = (a & 0x80) != 0x00;
+    uint8_t r = (a << 1) | (uint8_t)c;
+    f = flags(r == 0x00, false, false, c);
+    return r;
+}
+
+static uint8_t rl(uint8_t &f, uint8_t a)
+{
+    bool c = (a & 0x80) != 0x00;
+    uint8_t r = (a << 1) | ((f & Flag_C) ? 0x01 : 0x00);
+    f = flags(r == 0x00, false, false, c);
+    return r;
+}
+
+static uint8_t rrc(uint8_t &f, uint8_t a)
+{
+    bool c = (a & 0x01) != 0x00;
+    uint8_t r = c ? (0x80 | (a >> 1)) : (a >> 1);
+    f = flags(r == 0x00, false, false, c);
+    return r;
+}
+
+static uint8_t rr(uint8_t &f, uint8_t a)
+{
+    bool c = (a & 0x01) != 0x00;
+    uint8_t r = (f & Flag_C) ? (0x80 | (a >> 1)) : (a >> 1);
+    f = flags(r == 0x00, false, false, c);
+    return r;
+}
+
+static uint8_t sla(uint8_t &f, uint8_t a)
+{
+    bool c = (a & 0x80) != 0x00;
+    uint8_t r = a << 1;
+    f = flags(r == 0x00, false, false, c);
+    return r;
+}
+
+static uint8_t sra(uint8_t &f, uint8_t a)
+{
+    bool c = (a & 0x01) != 0x00;
+    uint8_t r = (a >> 1) | (a & 0x80);
+    f = flags(r == 0x00, false, false, c);
+    return r;
+}
+
+static uint8_t srl(uint8_t &f, uint8_t a)
+{
+    bool c = (a & 0x01) != 0x00;
+    uint8_t r = a >> 1;
+    f = flags(r == 0x00, false, false, c);
+    return r;
+}
+
+static uint8_t daa(uint8_t &f, uint8_t a)
+{
+    bool n = (f & Flag_N) != 0x00;
+    bool c = (f & Flag_C) != 0x00;
+    if (!n)
+    {
+        if (c || a > 0x99) { a += 0x60; c = true; }
+        if ((f & Flag_H) || (a & 0x0f) > 0x09) { a += 0x06; }
+    } else
+    {
+        if (c) { a -= 0x60; }
+        if (f & Flag_H) { a -= 0x06; }
+    }
+    f = flags(a == 0x00, n, false, c);
+    return a;
+}
+
+}
+
+typedef uint8_t (*TwiddleFn)(uint8_t &f, uint8_t a);
+typedef uint8_t (Cpu<Memory>::*TableFn)(uint8_t a);
+
+static const int REPEATS = 5;
+
+static bool machine_readable = false;
+static bool use_counters = false;
+static string filter;
+// Keeps the results of the measured loops alive.
+static uint32_t sink = 0;
+
+// Cheap xorshift, so the operand stream is not predictable by the branch predictor of the host.
+static inline uint32_t next_rand(uint32_t &s)
+{
+    s ^= s << 13;
+    s ^= s >> 17;
+    s ^= s << 5;
+    return s;
+}
+
+static inline uint64_t ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// Hardware counters of the calling thread, user space only, read as one group so that they cover the same interval.
+// They are unavailable on other systems and when perf_event_paranoid forbids them, open() then returns false.
+struct PerfCounters {
+    enum { Cycles, Instructions, Branches, BranchMisses, L1dMisses, Count };
+
+    int fd[Count];
+    uint64_t value[Count];
+
+    PerfCounters()
+    {
+        for (int i = 0; i < Count; i++)
+        {
+            fd[i] = -1;
+            value[i] = 0;
+        }
+    }
+
+    ~PerfCounters()
+    {
+        close_all();
+    }
+
+    bool open()
+    {
+#if defined(__linux__)
+        uint32_t types[Count] = {
+            PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE,
+        };
+        uint64_t configs[Count] = {
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_BRANCH_INSTRUCTIONS,
+            PERF_COUNT_HW_BRANCH_MISSES,
+            PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        };
+        for (int i = 0; i < Count; i++)
+        {
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = types[i];
+            attr.config = configs[i];
+            attr.disabled = (i == 0) ? 1 : 0;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP;
+            fd[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, (i == 0) ? -1 : fd[0], 0);
+            if (fd[i] < 0)
+            {
+                close_all();
+                return false;
+            }
+        }
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    void close_all()
+    {
+#if defined(__linux__)
+        for (int i = 0; i < Count; i++)
+        {
+            if (fd[i] >= 0)
+            {
+                close(fd[i]);
+                fd[i] = -1;
+            }
+        }
+#endif
+    }
+
+    void start()
+    {
+#if defined(__linux__)
+        ioctl(fd[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+    }
+
+    void stop()
+    {
+#if defined(__linux__)
+        ioctl(fd[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+        uint64_t buf[1 + Count];
+        if (read(fd[0], buf, sizeof(buf)) == (ssize_t)sizeof(buf))
+        {
+            for (int i = 0; i < Count; i++)
+            {
+                value[i] = buf[1 + i];
+            }
+        }
+#endif
+    }
+};
+
+static PerfCounters counters;
+
+static bool selected(const string &name)
+{
+    return filter.empty() || name.find(filter) != string::npos;
+}
+
+static void print_header()
+{
+    if (machine_readable)
+    {
+        cout << "kernel\tns_per_iter\tcycles_per_iter\titerations";
+        if (use_counters)
+        {
+            cout << "\tipc\tbranch_miss_rate\tbranch_misses_per_iter\tl1d_misses_per_iter";
+        }
+        cout << endl;
+    } else
+    {
+        cout << left << setw(24) << "kernel" << right << setw(12) << "ns/iter" << setw(14) << "cycles/iter"
+             << setw(12) << "iterations";
+        if (use_counters)
+        {
+            cout << setw(8) << "IPC" << setw(10) << "br-miss%" << setw(12) << "br-miss/it" << setw(12) << "l1d-miss/it";
+        }
+        cout << endl;
+    }
+}
+
+// Times fn, which runs its kernel iters times, and prints the median of REPEATS runs.
+template <typename F>
+static void bench(const string &name, uint32_t iters, F fn)
+{
+    if (!selected(name))
+    {
+        return;
+    }
+    fn(iters);
+    vector<double> ns;
+    vector<double> cycles;
+    // The counters span all repeats, the per iteration values are averages rather than medians.
+    if (use_counters)
+    {
+        counters.start();
+    }
+    for (int r = 0; r < REPEATS; r++)
+    {
+        chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        uint64_t c0 = ticks();
+        fn(iters);
+        uint64_t c1 = ticks();
+        chrono::steady_clock::time_point t1 = chrono::steady_clock::now();
+        ns.push_back(chrono::duration<double, nano>(t1 - t0).count() / iters);
+        cycles.push_back((double)(c1 - c0) / iters);
+    }
+    if (use_counters)
+    {
+        counters.stop();
+    }
+    sort(ns.begin(), ns.end());
+    sort(cycles.begin(), cycles.end());
+
+    const uint64_t *v = counters.value;
+    double n = (double)iters * REPEATS;
+    double ipc = v[PerfCounters::Cycles] ? (double)v[PerfCounters::Instructions] / v[PerfCounters::Cycles] : 0;
+    double miss_rate = v[PerfCounters::Branches] ? (double)v[PerfCounters::BranchMisses] / v[PerfCounters::Branches] : 0;
+    if (machine_readable)
+    {
+        cout << name << "\t" << fixed << setprecision(3) << ns[REPEATS / 2] << "\t" << cycles[REPEATS / 2] << "\t"
+             << iters;
+        if (use_counters)
+        {
+            cout << "\t" << ipc << "\t" << setprecision(5) << miss_rate << "\t" << setprecision(3)
+                 << v[PerfCounters::BranchMisses] / n << "\t" << v[PerfCounters::L1dMisses] / n;
+        }
+        cout << endl;
+    } else
+    {
+        cout << left << setw(24) << name << right << fixed << setprecision(3) << setw(12) << ns[REPEATS / 2]
+             << setw(14) << cycles[REPEATS / 2] << setw(12) << iters;
+        if (use_counters)
+        {
+            cout << setprecision(2) << setw(8) << ipc << setw(10) << miss_rate * 100 << setprecision(3) << setw(12)
+                 << v[PerfCounters::BranchMisses] / n << setw(12) << v[PerfCounters::L1dMisses] / n;
+        }
+        cout << endl;
+    }
+}
+
+// Exhaustively check every operand and flag combination of the table against the bit-twiddling version.
+static bool verify(Cpu<Memory> *cpu, TwiddleFn tw, TableFn tb)
+{
+    for (uint32_t f = 0; f < 0x100; f += 0x10)
+    {
+        for (uint32_t a = 0; a < 0x100; a++)
+        {
+            uint8_t f0 = (uint8_t)f;
+            uint8_t r0 = tw(f0, (uint8_t)a);
+            cpu->reg->f = (uint8_t)f;
+            uint8_t r1 = (cpu->*tb)((uint8_t)a);
+            if (r0 != r1 || f0 != cpu->reg->f)
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+struct AluCase {
+    string name;
+    TwiddleFn twiddle;
+    TableFn table;
+};
+
+// Flat 64K of RAM, so that the CPU kernels measure Cpu::ex and not the memory map.
+class FlatMemory: public Memory {
+public:
+    uint8_t m[0x10000];
+
+    FlatMemory() { memset(m, 0x00, sizeof(m)); }
+
+    uint8_t get(unsigned int a) { return m[a & 0xffff]; }
+    void set(unsigned int a, uint8_t v) { m[a & 0xffff] = v; }
+};
+
+// Cpu::alu_daa works on register A, wrap it so that it shares the signature of the other cases.
+struct DaaCpu: public Cpu<Memory> {
+    DaaCpu(): Cpu<Memory>(Term_GB, NULL) {}
+
+    uint8_t daa(uint8_t a)
+    {
+        reg->a = a;
+        alu_daa();
+        return reg->a;
+    }
+};
+
+static int bench_alu(uint32_t iters)
+{
+    DaaCpu cpu;
+    AluCase cases[] = {
+        { "alu_inc",  twiddle::inc,  &Cpu<Memory>::alu_inc  },
+        { "alu_dec",  twiddle::dec,  &Cpu<Memory>::alu_dec  },
+        { "alu_swap", twiddle::swap, &Cpu<Memory>::alu_swap },
+        { "alu_rlc",  twiddle::rlc,  &Cpu<Memory>::alu_rlc  },
+        { "alu_rrc",  twiddle::rrc,  &Cpu<Memory>::alu_rrc  },
+        { "alu_rl",   twiddle::rl,   &Cpu<Memory>::alu_rl   },
+        { "alu_rr",   twiddle::rr,   &Cpu<Memory>::alu_rr   },
+        { "alu_sla",  twiddle::sla,  &Cpu<Memory>::alu_sla  },
+        { "alu_sra",  twiddle::sra,  &Cpu<Memory>::alu_sra  },
+        { "alu_srl",  twiddle::srl,  &Cpu<Memory>::alu_srl  },
+        { "alu_daa",  twiddle::daa,  static_cast<TableFn>(&DaaCpu::daa) },
+    };
+
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        const AluCase &k = cases[i];
+        if (!selected(k.name))
+        {
+            continue;
+        }
+        if (!verify(&cpu, k.twiddle, k.table))
+        {
+            cout << "# " << k.name << " table does not match the reference" << endl;
+            failed++;
+        }
+        bench(k.name + ".twiddle", iters, [&](uint32_t n) {
+            uint32_t s = 0x2545f491;
+            uint8_t f = 0x00;
+            for (uint32_t j = 0; j < n; j++)
+            {
+                f = (uint8_t)(next_rand(s) & 0xf0);
+                sink += k.twiddle(f, (uint8_t)(s >> 8)) + f;
+            }
+        });
+        bench(k.name + ".table", iters, [&](uint32_t n) {
+            uint32_t s = 0x2545f491;
+            for (uint32_t j = 0; j < n; j++)
+            {
+                cpu.reg->f = (uint8_t)(next_rand(s) & 0xf0);
+                sink += (cpu.*k.table)((uint8_t)(s >> 8)) + cpu.reg->f;
+            }
+        });
+    }
+    return failed;
+}
+
+// A synthetic instruction stream: PROGRAM_LEN bytes of instructions drawn by pick() at 0x0100, executed in a loop.
+static const uint16_t PROGRAM_BASE = 0x0100;
+static const uint16_t PROGRAM_LEN = 0x1000;
+
+template <typename P>
+static void bench_ex(const string &name, uint32_t iters, P pick)
+{
+    if (!selected(name))
+    {
+        return;
+    }
+    FlatMemory *mem = new FlatMemory();
+    uint32_t s = 0x9e3779b9;
+    uint16_t end = PROGRAM_BASE;
+    while (end < PROGRAM_BASE + PROGRAM_LEN - 4)
+    {
+        end += pick(&mem->m[end], s);
+    }
+
+    Cpu<Memory> cpu(Term_GB, mem);
+    bench(name, iters, [&](uint32_t n) {
+        cpu.reg->pc = PROGRAM_BASE;
+        cpu.reg->set_bc(0xc000);
+        cpu.reg->set_de(0xc100);
+        cpu.reg->set_hl(0xc200);
+        cpu.reg->sp = 0xfffe;
+        for (uint32_t j = 0; j < n; j++)
+        {
+            if (cpu.reg->pc >= end)
+            {
+                cpu.reg->pc = PROGRAM_BASE;
+                cpu.reg->set_hl(0xc200);
+            }
+            sink += cpu.ex();
+        }
+    });
+    delete mem;
+}
+
+static void bench_cpu(uint32_t iters)
+{
+    // LD r, r' without (HL).
+    bench_ex("ex.ld_r_r", iters, [](uint8_t *p, uint32_t &s) {
+        uint8_t op;
+        do
+        {
+            op = 0x40 | (next_rand(s) & 0x3f);
+        } while ((op & 0x07) == 0x06 || (op & 0x38) == 0x30);
+        p[0] = op;
+        return 1;
+    });
+    // ADD/ADC/SUB/SBC/AND/XOR/OR/CP A, r without (HL).
+    bench_ex("ex.alu_r", iters, [](uint8_t *p, uint32_t &s) {
+        uint8_t op;
+        do
+        {
+            op = 0x80 | (next_rand(s) & 0x3f);
+        } while ((op & 0x07) == 0x06);
+        p[0] = op;
+        return 1;
+    });
+    // Loads and stores through BC, DE and HL into WRAM.
+    bench_ex("ex.ld_mem", iters, [](uint8_t *p, uint32_t &s) {
+        static const uint8_t ops[] = { 0x0a, 0x1a, 0x02, 0x12, 0x7e, 0x77, 0x46, 0x70 };
+        p[0] = ops[next_rand(s) & 0x07];
+        return 1;
+    });
+    // INC/DEC r and LD r, n.
+    bench_ex("ex.inc_dec_imm", iters, [](uint8_t *p, uint32_t &s) {
+        uint8_t r = (uint8_t)(next_rand(s) % 7);
+        r = (r == 6) ? 7 : r;
+        switch ((s >> 8) % 3)
+        {
+        case 0:
+            p[0] = 0x04 | (r << 3);
+            return 1;
+        case 1:
+            p[0] = 0x05 | (r << 3);
+            return 1;
+        default:
+            p[0] = 0x06 | (r << 3);
+            p[1] = (uint8_t)(s >> 16);
+            return 2;
+        }
+    });
+    // The 0xcb page, (HL) included. H and L are left out so that (HL) keeps pointing into WRAM and not at the program.
+    bench_ex("ex.cb", iters, [](uint8_t *p, uint32_t &s) {
+        uint8_t op;
+        do
+        {
+            op = (uint8_t)next_rand(s);
+        } while ((op & 0x07) == 0x04 || (op & 0x07) == 0x05);
+        p[0] = 0xcb;
+        p[1] = op;
+        return 2;
+    });
+    // JR and JR cc with a zero displacement, taken or not depending on the flags left by XOR/OR.
+    bench_ex("ex.jr", iters, [](uint8_t *p, uint32_t &s) {
+        static const uint8_t ops[] = { 0x18, 0x20, 0x28, 0x30, 0x38, 0xaf, 0xb7 };
+        uint8_t op = ops[next_rand(s) % 7];
+        p[0] = op;
+        if (op == 0xaf || op == 0xb7)
+        {
+            return 1;
+        }
+        p[1] = 0x00;
+        return 2;
+    });
+}
+
+struct BusRegion {
+    string name;
+    uint16_t base;
+    uint16_t size;
+    bool writable;
+};
+
+static void bench_bus(uint32_t iters, const string &rom)
+{
+    ifstream probe(rom, ios::binary);
+    if (!probe)
+    {
+        cout << "# no rom at " << rom << ", skipping the bus kernels" << endl;
+        return;
+    }
+    probe.close();
+
+    // The cartridge loader reports to cout.
+    cout.setstate(ios::badbit);
+    Mmunit *mmu = new Mmunit(rom);
+    cout.clear();
+
+    // IO is represented by the scroll registers, which have no side effects.
+    BusRegion regions[] = {
+        { "rom0",  0x0000, 0x4000, false },
+        { "romx",  0x4000, 0x4000, false },
+        { "vram",  0x8000, 0x2000, true  },
+        { "sram",  0xa000, 0x2000, false },
+        { "wram0", 0xc000, 0x1000, true  },
+        { "wramx", 0xd000, 0x1000, true  },
+        { "echo",  0xe000, 0x1e00, true  },
+        { "oam",   0xfe00, 0x00a0, true  },
+        { "io",    0xff42, 0x0002, true  },
+        { "hram",  0xff80, 0x007f, true  },
+    };
+
+    // Random addresses within the region, so both the region decode and the data access are measured.
+    vector<uint16_t> addr(4096);
+    for (size_t i = 0; i < sizeof(regions) / sizeof(regions[0]); i++)
+    {
+        const BusRegion &r = regions[i];
+        uint32_t s = 0x6a09e667;
+        for (size_t j = 0; j < addr.size(); j++)
+        {
+            addr[j] = r.base + (uint16_t)(next_rand(s) % r.size);
+        }
+        bench("get." + r.name, iters, [&](uint32_t n) {
+            for (uint32_t j = 0; j < n; j++)
+            {
+                sink += mmu->get(addr[j & 0x0fff]);
+            }
+        });
+        if (r.writable)
+        {
+            bench("set." + r.name, iters, [&](uint32_t n) {
+                for (uint32_t j = 0; j < n; j++)
+                {
+                    mmu->set(addr[j & 0x0fff], (uint8_t)j);
+                }
+            });
+        }
+    }
+
+    // A whole OAM DMA from WRAM per iteration, and one 16 byte HDMA block from WRAM to VRAM.
+    bench("dma.oam", iters >> 6, [&](uint32_t n) {
+        for (uint32_t j = 0; j < n; j++)
+        {
+            mmu->set(0xff46, 0xc0);
+            mmu->run_oam_dma(162 * 4);
+        }
+    });
+    bench("dma.hdma_block", iters >> 2, [&](uint32_t n) {
+        for (uint32_t j = 0; j < n; j++)
+        {
+            mmu->hdma->src = 0xc000 + (uint16_t)((j & 0xff) << 4);
+            mmu->hdma->dst = 0x8000 + (uint16_t)((j & 0x1ff) << 4);
+            mmu->run_dma_hrampart();
+        }
+    });
+    sink += mmu->gpu->oam[0x9f] + mmu->gpu->ram[0];
+    delete mmu;
+}
+
+// A fixed scene: random tiles and maps in both VRAM banks, and 40 sprites spread over the screen.
+static void bench_gpu(uint32_t iters)
+{
+    Intf intf;
+    Gpu *gpu = new Gpu(Term_GB, &intf);
+    uint32_t s = 0xbb67ae85;
+    for (size_t i = 0; i < 0x4000; i++)
+    {
+        gpu->ram[i] = (uint8_t)next_rand(s);
+    }
+    for (size_t i = 0; i < 40; i++)
+    {
+        gpu->oam[i * 4 + 0] = (uint8_t)(16 + next_rand(s) % 144);
+        gpu->oam[i * 4 + 1] = (uint8_t)(8 + next_rand(s) % 160);
+        gpu->oam[i * 4 + 2] = (uint8_t)next_rand(s);
+        gpu->oam[i * 4 + 3] = (uint8_t)(next_rand(s) & 0xf0);
+    }
+    // LCD, window, sprites and background on, window at (7, 72).
+    gpu->lcdc->data = 0xf3;
+    gpu->wx = 7;
+    gpu->wy = 72;
+    gpu->bgp = 0xe4;
+    gpu->op0 = 0xe4;
+    gpu->op1 = 0x1b;
+
+    // One iteration is one scanline.
+    bench("gpu.draw_bg", iters, [&](uint32_t n) {
+        for (uint32_t j = 0; j < n; j++)
+        {
+            gpu->ly = (uint8_t)(j % 144);
+            gpu->draw_bg();
+        }
+    });
+    bench("gpu.draw_sprites", iters, [&](uint32_t n) {
+        for (uint32_t j = 0; j < n; j++)
+        {
+            gpu->ly = (uint8_t)(j % 144);
+            gpu->draw_sprites();
+        }
+    });
+    sink += gpu->data[0][0][0];
+    delete gpu;
+}
+
+// Instruction lengths in cycles, as handed to Timer::next and Clock::next by Mmunit::next.
+static const uint32_t STEPS[8] = { 4, 8, 4, 12, 4, 16, 8, 24 };
+
+static void bench_timer(uint32_t iters)
+{
+    static const char *periods[4] = { "1024", "16", "64", "256" };
+    for (uint8_t q = 0; q < 4; q++)
+    {
+        Intf intf;
+        Timer timer(&intf);
+        timer.set(0xff07, 0x04 | q);
+        bench(string("timer.next.tac") + periods[q], iters, [&](uint32_t n) {
+            for (uint32_t j = 0; j < n; j++)
+            {
+                timer.next(STEPS[j & 0x07]);
+            }
+            sink += timer.reg.tima + intf.data;
+        });
+    }
+
+    Clock clock(256);
+    bench("clock.next", iters, [&](uint32_t n) {
+        for (uint32_t j = 0; j < n; j++)
+        {
+            sink += clock.next(STEPS[j & 0x07]);
+        }
+    });
+}
+
+// apu.next.* run the APU one instruction worth of cycles per iteration, which is what clocking it along with the CPU
+// costs. apu.sync.* let a frame of cycles pass and then catch up once, as Mmunit does when the game touches no audio
+// register during the frame. Output is drained as it is produced.
+static void bench_apu(uint32_t iters)
+{
+    static float drain[1024 * 2];
+    for (int playing = 0; playing < 2; playing++)
+    {
+        Apu apu(APU_SAMPLE_RATE);
+        uint64_t clock = 0;
+        if (playing)
+        {
+            // Every channel on and panned to both sides: two squares, the wave at full volume and 7-bit noise.
+            static const uint8_t WRITES[][2] = {
+                { 0x11, 0x80 }, { 0x12, 0xf0 }, { 0x13, 0x00 }, { 0x14, 0x87 },
+                { 0x16, 0x40 }, { 0x17, 0xf0 }, { 0x18, 0x80 }, { 0x19, 0x86 },
+                { 0x1a, 0x80 }, { 0x1c, 0x20 }, { 0x1d, 0x40 }, { 0x1e, 0x87 },
+                { 0x21, 0xf0 }, { 0x22, 0x18 }, { 0x23, 0x80 }, { 0x25, 0xff },
+            };
+            for (uint32_t i = 0x30; i < 0x40; i++)
+            {
+                apu.set(0xff00 + i, (uint8_t)(i * 0x37));
+            }
+            for (size_t i = 0; i < sizeof(WRITES) / sizeof(WRITES[0]); i++)
+            {
+                apu.set(0xff00 + WRITES[i][0], WRITES[i][1]);
+            }
+        }
+        bench(playing ? "apu.next.play" : "apu.next.silent", iters, [&](uint32_t n) {
+            for (uint32_t j = 0; j < n; j++)
+            {
+                apu.next(STEPS[j & 0x07]);
+                if (apu.out.fill() >= Blip::FRAME_SAMPLES)
+                {
+                    apu.read(drain, Blip::FRAME_SAMPLES);
+                }
+            }
+            sink += (uint64_t)(drain[0] * 1000.0f);
+        });
+
+        // One iteration is one video frame, 70224 cycles.
+        apu.set_clock(&clock);
+        bench(playing ? "apu.sync.play" : "apu.sync.silent", iters / 4096, [&](uint32_t n) {
+            for (uint32_t j = 0; j < n; j++)
+            {
+                clock += 70224;
+                apu.sync();
+                apu.read(drain, 1024);
+            }
+            sink += (uint64_t)(drain[0] * 1000.0f);
+        });
+    }
+}
+
+// The Mixer stages on their own, for every instruction set the host has. One iteration is one frame sequencer tick of
+// input, 128 samples at the synthesis rate.
+static void bench_mixer(uint32_t iters)
+{
+    static const char *const NAMES[3] = { "scalar", "sse2", "avx2" };
+    static const uint32_t N = 128;
+    static float ch[4][N];
+    static float stereo[2 * (N + Mixer::TAPS)];
+    uint32_t seed = 1;
+    for (int i = 0; i < 4; i++)
+    {
+        for (uint32_t j = 0; j < N; j++)
+        {
+            ch[i][j] = (float)(next_rand(seed) % 31) - 15.0f;
+        }
+    }
+    for (uint32_t j = 0; j < 2 * (N + Mixer::TAPS); j++)
+    {
+        stereo[j] = (float)(next_rand(seed) % 31) - 15.0f;
+    }
+    const float *const chs[4] = { ch[0], ch[1], ch[2], ch[3] };
+    const float gl[4] = { 0.25f, 0.0f, 0.25f, 0.25f };
+    const float gr[4] = { 0.25f, 0.25f, 0.0f, 0.25f };
+
+    Mixer mixer(65536, APU_SAMPLE_RATE);
+    MixerIsa best = Mixer::best_isa();
+    vector<float> out(2 * mixer.max_output());
+    uint32_t produced = 0;
+    for (int isa = MixerIsa_Scalar; isa <= best; isa++)
+    {
+        mixer.isa = (MixerIsa)isa;
+        bench(string("mixer.mix.") + NAMES[isa], iters, [&](uint32_t n) {
+            for (uint32_t j = 0; j < n; j++)
+            {
+                mixer.mix(chs, gl, gr, N, stereo);
+            }
+            sink += (uint32_t)stereo[1];
+        });
+        bench(string("mixer.resample.") + NAMES[isa], iters, [&](uint32_t n) {
+            for (uint32_t j = 0; j < n; j++)
+            {
+                mixer.resample(stereo, N + Mixer::TAPS, &out[0], produced);
+            }
+            sink += produced;
+        });
+    }
+}
+
+// The Scaler filters for every instruction set the host has, on a frame of a few colors in small patches, which has
+// as many edges as a game screen. One iteration is one frame.
+static void bench_scaler(uint32_t iters)
+{
+    static const char *const NAMES[3] = { "scalar", "sse2", "avx2" };
+    static const char *const FILTERS[3] = { "scale2x", "scale3x", "scale4x" };
+    static uint8_t data[Scaler::HEIGHT][Scaler::WIDTH][3];
+    uint32_t seed = 0x3c6ef372;
+    for (int y = 0; y < Scaler::HEIGHT; y++)
+    {
+        for (int x = 0; x < Scaler::WIDTH; x++)
+        {
+            uint8_t shade = (uint8_t)(((x / 4 + y / 4) % 2 == 0) ? 0xff : (next_rand(seed) % 4) * 0x55);
+            data[y][x][0] = data[y][x][1] = data[y][x][2] = shade;
+        }
+    }
+    ScalerIsa best = Scaler::best_isa();
+    for (int f = ScaleFilter_Scale2x; f <= ScaleFilter_Scale4x; f++)
+    {
+        Scaler scaler((ScaleFilter)f);
+        vector<uint32_t> out(scaler.width() * scaler.height());
+        for (int isa = ScalerIsa_Scalar; isa <= best; isa++)
+        {
+            scaler.isa = (ScalerIsa)isa;
+            bench(string("scaler.") + FILTERS[f - ScaleFilter_Scale2x] + "." + NAMES[isa], iters, [&](uint32_t n) {
+                for (uint32_t j = 0; j < n; j++)
+                {
+                    scaler.process(data, &out[0]);
+                }
+                sink += out[n % out.size()];
+            });
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    string rom = "boxes.gb";
+    for (int i = 1; i < argc; i++)
+    {
+        string a = argv[i];
+        if (a == "-m")
+        {
+            machine_readable = true;
+        } else if (a == "-p")
+        {
+            use_counters = true;
+        } else if (a == "-f" && i + 1 < argc)
+        {
+            filter = argv[++i];
+        } else
+        {
+            rom = a;
+        }
+    }
+
+    if (use_counters && !counters.open())
+    {
+        cout << "# hardware counters are not available, check /proc/sys/kernel/perf_event_paranoid" << endl;
+        use_counters = false;
+    }
+    print_header();
+    int failed = bench_alu(1 << 22);
+    bench_cpu(1 << 22);
+    bench_bus(1 << 22, rom);
+    bench_gpu(1 << 14);
+    bench_timer(1 << 22);
+    bench_apu(1 << 22);
+    bench_mixer(1 << 16);
+    bench_scaler(1 << 10);
+    cout << "# sink " << (sink & 0xff) << endl;
+    return failed == 0 ? 0 : 1;
+}
@@ -1,66 +1,83 @@
 #include "machine.h"
 #include "include/MiniFB_cpp.h"
 #include "MotherBoard.h"
+#include "AudioSink.h"
+#include "Scaler.h"
 #include <iostream>
-
-#define WIDTH      160
-#define HEIGHT     144
+#include <vector>
 
 using namespace std;
 static MotherBoard* m_mbrd = new MotherBoard("mem_timing.gb");
+static ScaleFilter m_filter = ScaleFilter_None;
 
 Machine::~Machine() {
     delete m_mbrd;
     m_mbrd = nullptr;
 }
 
+// Speeds selected with the keys 1 to 5, 0 is unthrottled.
+static const double SPEEDS[5] = { 1.0, 2.0, 4.0, 8.0, 0.0 };
+
+// Keys are only collected here, MotherBoard::run_frame hands them to the joypad at the start of the next frame.
+static void gb_key(JoypadKey key, bool pressed)
+{
+    if (pressed)
+    {
+        m_mbrd->keys &= (uint8_t)~key;
+    } else
+    {
+        m_mbrd->keys |= (uint8_t)key;
+    }
+}
+
 static void gb_keyboard_func(struct mfb_window *window, mfb_key key, mfb_key_mod mod, bool isPressed)
 {
-    if (!m_mbrd->cpu->flip())
+    if (isPressed && key >= KB_KEY_1 && key <= KB_KEY_5)
     {
+        m_mbrd->cpu->speed = SPEEDS[key - KB_KEY_1];
         return;
     }
-    
+
     switch (key)
     {
         case KB_KEY_RIGHT:
         {
-            isPressed ? m_mbrd->mmu->joypad.keydown(JoypadKey_Right) : m_mbrd->mmu->joypad.keyup(JoypadKey_Right);
+            gb_key(JoypadKey_Right, isPressed);
         }
         break;
         case KB_KEY_UP:
         {
-            isPressed ? m_mbrd->mmu->joypad.keydown(JoypadKey_Up) : m_mbrd->mmu->joypad.keyup(JoypadKey_Up);
+            gb_key(JoypadKey_Up, isPressed);
         }
         break;
         case KB_KEY_LEFT:
         {
-            isPressed ? m_mbrd->mmu->joypad.keydown(JoypadKey_Left) : m_mbrd->mmu->joypad.keyup(JoypadKey_Left);
+            gb_key(JoypadKey_Left, isPressed);
         }
         break;
         case KB_KEY_DOWN:
         {
-            isPressed ? m_mbrd->mmu->joypad.keydown(JoypadKey_Down) : m_mbrd->mmu->joypad.keyup(JoypadKey_Down);
+            gb_key(JoypadKey_Down, isPressed);
         }
         break;
         case KB_KEY_Z:
         {
-            isPressed ? m_mbrd->mmu->joypad.keydown(JoypadKey_A) : m_mbrd->mmu->joypad.keyup(JoypadKey_A);
+            gb_key(JoypadKey_A, isPressed);
         }
         break;
         case KB_KEY_X:
         {
-            isPressed ? m_mbrd->mmu->joypad.keydown(JoypadKey_B) : m_mbrd->mmu->joypad.keyup(JoypadKey_B);
+            gb_key(JoypadKey_B, isPressed);
         }
         break;
         case KB_KEY_SPACE:
         {
-            isPressed ? m_mbrd->mmu->joypad.keydown(JoypadKey_Select) : m_mbrd->mmu->joypad.keyup(JoypadKey_Select);
+            gb_key(JoypadKey_Select, isPressed);
         }
         break;
         case KB_KEY_ENTER:
         {
-            isPressed ? m_mbrd->mmu->joypad.keydown(JoypadKey_Start) : m_mbrd->mmu->joypad.keyup(JoypadKey_Start);
+            gb_key(JoypadKey_Start, isPressed);
         }
         break;
     
@@ -69,45 +86,114 @@ static void gb_keyboard_func(struct mfb_window *window, mfb_key key, mfb_key_mod
     }
 }
 
+void Machine::set_speed(double speed) {
+    m_mbrd->cpu->speed = speed;
+}
+
+void Machine::set_run_ahead(int frames) {
+    m_mbrd->run_ahead = frames > 0 ? frames : 0;
+}
+
+void Machine::set_audio_pacing(bool on) {
+    m_mbrd->audio_pacing = on;
+}
+
+void Machine::set_render_threads(int n) {
+    m_mbrd->mmu->gpu->set_render_threads(n > 0 ? n : 0);
+}
+
+bool Machine::set_filter(std::string name) {
+    if (!Scaler::parse(name, m_filter))
+    {
+        cout << "Unknown filter " << name << endl;
+        return false;
+    }
+    return true;
+}
+
+void Machine::record(std::string path) {
+    m_movie_path = path;
+    m_mbrd->record();
+}
+
+bool Machine::play(std::string path) {
+    if (!m_mbrd->movie.load(path))
+    {
+        cout << "Can not read movie " << path << endl;
+        return false;
+    }
+    m_mbrd->play();
+    return true;
+}
+
 void Machine::run() {
     int i, noise, carry, seed = 0xbeef;
 
-    uint32_t g_buffer[WIDTH * HEIGHT];
+    // The window gets the frame already scaled, so the backend only has to stretch it when the window is resized.
+    Scaler scaler(m_filter);
+    vector<uint32_t> g_buffer(scaler.width() * scaler.height());
     string rom_name = m_mbrd->mmu->cartridge->title();
     string title("Gameboy - { "+ rom_name +" }");
-    struct mfb_window *window = mfb_open_ex(title.c_str(), WIDTH, HEIGHT, WF_RESIZABLE);
+    struct mfb_window *window = mfb_open_ex(title.c_str(), scaler.width(), scaler.height(), WF_RESIZABLE);
     if (!window)
     {
         cout << "with out windows" << endl;
         return;
     }        
 
+    // A replay must see the clock of the recording, which only counted emulated time.
+    if (m_mbrd->movie_mode != MovieMode_Play)
+    {
+        m_mbrd->mmu->cartridge->sync_host();
+    }
+
+    // The ring holds a few times the pacing latency, so the unpaced speeds can not overflow it before they are noticed.
+    AudioRing ring(AUDIO_LATENCY * 4);
+    AudioSink sink(&ring, APU_SAMPLE_RATE);
+    if (sink.open())
+    {
+        m_mbrd->audio = &ring;
+    } else
+    {
+        cout << "Can not open the audio device, running without sound" << endl;
+    }
+
     mfb_set_keyboard_callback(window, gb_keyboard_func);
+    // Rtc paces the emulation, the window only has to present the frames that are drawn.
+    mfb_set_target_fps(0);
+    m_mbrd->present_fps = 60.0;
+    m_mbrd->mmu->gpu->track_lines = true;
     mfb_update_state state;
     do {        
-        m_mbrd->next();
-        if (m_mbrd->check_and_reset_gpu_updated())
+        bool drawn = m_mbrd->run_frame();
+        bool updated = m_mbrd->check_and_reset_gpu_updated();
+        if (!drawn)
+        {
+            // Skipped in fast forward, only keep the window responsive.
+            mfb_update_events(window);
+            continue;
+        }
+        // The window keeps showing the last upload, a frame without a changed line (or without v-blank, the LCD
+        // being off) is neither scaled nor uploaded again.
+        if (!updated || m_mbrd->mmu->gpu->changed_lines == 0)
         {
-            uint16_t i = 0;
-            for (size_t y = 0; y < 144; y++)
-            {
-                for (size_t w = 0; w < 160; i++)
-                {
-                    uint32_t b = m_mbrd->mmu->gpu->data[y][w][2];
-                    uint32_t g = m_mbrd->mmu->gpu->data[y][w][1];
-                    uint32_t r = m_mbrd->mmu->gpu->data[y][w][0];
-                    uint32_t a = 0xff000000;
-
-                    g_buffer[i++] = a|b|g|r;                    
-                }                
-            }            
+            mfb_update_events(window);
+            continue;
         }
-        
-        mfb_update(window, g_buffer);
+        scaler.process(m_mbrd->mmu->gpu->data, &g_buffer[0]);
+        mfb_update(window, &g_buffer[0]);
         // if (!mfb_is_window_active(window)) {
         //     window = 0x0;
         //     cout << "windows not active" << endl;
         //     break;
         // }
     } while(mfb_wait_sync(window));
+
+    sink.close();
+    m_mbrd->audio = NULL;
+
+    if (m_mbrd->movie_mode == MovieMode_Record && !m_mbrd->movie.save(m_movie_path))
+    {
+        cout << "Can not write movie " << m_movie_path << endl;
+    }
 }
\ No newline at end of file
@@ -1,13 +1,32 @@
 #ifndef MACHINE
 #define MACHINE
 
+#include <string>
+
 class Machine
 {
 public:
     Machine() { };
     ~Machine();
 
+    // Multiple of real time to run at, 0 runs unthrottled.
+    void set_speed(double speed);
+    // Frames to run ahead of the machine, 0 turns run-ahead off.
+    void set_run_ahead(int frames);
+    // Paces 1x by the audio device instead of the host clock, so sound never underruns or drifts from the video.
+    void set_audio_pacing(bool on);
+    // Draws the scanlines on n threads besides the CPU one, 0 draws them along with the CPU.
+    void set_render_threads(int n);
+    // Upscales the frames for the window with a filter of Scaler: none, scale2x, scale3x or scale4x.
+    bool set_filter(std::string name);
+    // Records the input of this run into a movie file, written when the window closes.
+    void record(std::string path);
+    // Replays the input of a movie file recorded by record(). Keys pressed in the window are ignored.
+    bool play(std::string path);
     void run();
+
+private:
+    std::string m_movie_path;
 };
 
 #endif
\ No newline at end of file
@@ -1,9 +1,54 @@
 #include <iostream>
+#include <string>
+#include <cstdlib>
 #include "machine.h"
 
+// Usage: main [-s speed] [-a] [-t threads] [-x filter] [-r frames] [-o movie | -i movie]
+//     -s  multiple of real time to run at, e.g. 2 for 2x. 0 runs as fast as the host can.
+//     -a  pace 1x by the audio device rather than the host clock.
+//     -t  draw the scanlines on this many threads besides the CPU one. 1 overlaps drawing with the CPU, more also
+//         split the lines of a frame between them.
+//     -x  upscale the frames with none (the default), scale2x, scale3x or scale4x.
+//     -r  frames to run ahead of the machine to hide input lag, 0 (the default) turns it off.
+//     -o  record the joypad input into a movie file.
+//     -i  replay the joypad input of a movie file, the run is the same as the recorded one.
+// While running, the keys 1 to 5 switch between 1x, 2x, 4x, 8x and unthrottled.
 int main(int argc, char **argv)
 {
     Machine *machine = new Machine();
+    for (int i = 1; i < argc; i++)
+    {
+        if (std::string(argv[i]) == "-s" && i + 1 < argc)
+        {
+            machine->set_speed(atof(argv[++i]));
+        } else if (std::string(argv[i]) == "-a")
+        {
+            machine->set_audio_pacing(true);
+        } else if (std::string(argv[i]) == "-t" && i + 1 < argc)
+        {
+            machine->set_render_threads(atoi(argv[++i]));
+        } else if (std::string(argv[i]) == "-x" && i + 1 < argc)
+        {
+            if (!machine->set_filter(argv[++i]))
+            {
+                delete machine;
+                return 1;
+            }
+        } else if (std::string(argv[i]) == "-r" && i + 1 < argc)
+        {
+            machine->set_run_ahead(atoi(argv[++i]));
+        } else if (std::string(argv[i]) == "-o" && i + 1 < argc)
+        {
+            machine->record(argv[++i]);
+        } else if (std::string(argv[i]) == "-i" && i + 1 < argc)
+        {
+            if (!machine->play(argv[++i]))
+            {
+                delete machine;
+                return 1;
+            }
+        }
+    }
     machine->run();
     delete machine;
     
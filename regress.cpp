@@ -0,0 +1,552 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <cstdlib>
+#include <dirent.h>
+#include "MotherBoard.h"
+#include "AudioCapture.h"
+#include "VideoCapture.h"
+
+using namespace std;
+
+// Headless regression driver. Every ROM listed in the manifest, and every other .gb/.gbc file next to it, is run
+// without a window until its completion condition, and the hash of its last finished frame is compared with the
+// golden one. ROMs run in parallel, one MotherBoard per worker thread.
+//
+// Manifest lines, '#' starts a comment:
+//     <rom> <until> <frames> <hash> [movie] [xfail]
+// until:
+//     frames          run exactly <frames> frames.
+//     ldbb            stop at the LD B,B breakpoint (opcode 0x40), it passes if B C D E H L hold 3 5 8 13 21 34.
+//     serial:<text>   stop once <text> has been sent over the serial port.
+// frames is the frame limit of the ldbb and serial conditions, a ROM that hits it fails.
+// hash is the XXH64 of Gpu::data after the last finished frame, or '-' if there is no golden frame yet.
+// movie is an input movie, recorded with main -o, that is replayed from power up. Without it no key is pressed.
+// xfail marks a ROM known to fail. It is reported as XFAIL and does not fail the run, but passing is reported as XPASS
+// and does, so the marker gets removed.
+//
+// Usage: regress [-j jobs] [-u] [-t threads] [-F | -D] [-l] [-w dir [-f wav|pcm]] [-v dir [-c y4m|rgb|avi]] [manifest]
+//     -j  number of worker threads, all cores by default.
+//     -u  write the observed hashes back to the manifest, for the ROMs that reached their completion condition. The
+//         others keep their golden hash.
+//     -t  draw the scanlines of every ROM on this many threads of its own, see Renderer. The hashes must not change.
+//     -F  run with the superinstructions of the CPU (Cpu::fusion) on. The hashes must not change.
+//     -D  run every ROM twice, with and without superinstructions, and fail it unless every frame hashes the same.
+//         The report and the captures are those of the run with them.
+//     -l  track the lines that changed between frames (Gpu::track_lines), which skips hashing frames that did not
+//         change. The hashes must not change.
+//     -w  capture the sound of every ROM to dir/<rom>.wav, or dir/<rom>.pcm with -f pcm (raw 16-bit stereo).
+//     -v  capture every frame of every ROM to dir/<rom>.y4m, or with -c to dir/<rom>.rgb (raw 160x144 rgb24) or
+//         dir/<rom>.avi (uncompressed).
+
+// ROMs found in the directory but not in the manifest run this many frames and only report their hash.
+static const uint32_t DEFAULT_FRAMES = 300;
+// One frame is 70224 dots. A ROM that turns the LCD off never finishes a frame, so runs are also bounded by cycles,
+// with room for double speed.
+static const uint64_t FRAME_CYCLES = 70224 * 2;
+
+static unsigned int render_threads = 0;
+static bool fusion = false;
+static bool compare_fusion = false;
+static bool track_lines = false;
+// Sound capture, off when capture_dir is empty.
+static string capture_dir;
+static CaptureFormat capture_format = CaptureFormat_Wav;
+static string video_dir;
+static VideoFormat video_format = VideoFormat_Y4m;
+static const char *const VIDEO_EXT[3] = { ".y4m", ".rgb", ".avi" };
+
+typedef enum {
+    Until_Frames,
+    Until_Ldbb,
+    Until_Serial,
+} Until;
+
+struct RegressCase {
+    string rom;
+    Until until;
+    string text;
+    uint32_t frames;
+    string golden;
+    string movie;
+    bool xfail;
+
+    // Results. completed is passed without the hash check.
+    bool reached;
+    bool completed;
+    bool passed;
+    string hash;
+    string note;
+    uint32_t frame_count;
+    uint64_t instructions;
+    double seconds;
+};
+
+static string hex64(uint64_t v)
+{
+    ostringstream s;
+    s << hex << setw(16) << setfill('0') << v;
+    return s.str();
+}
+
+static bool parse_line(const string &line, RegressCase &c)
+{
+    istringstream s(line);
+    string until;
+    if (!(s >> c.rom >> until >> c.frames >> c.golden))
+    {
+        return false;
+    }
+    c.xfail = false;
+    string extra;
+    while (s >> extra)
+    {
+        if (extra == "xfail")
+        {
+            c.xfail = true;
+        } else
+        {
+            c.movie = extra;
+        }
+    }
+    if (until == "frames")
+    {
+        c.until = Until_Frames;
+    } else if (until == "ldbb")
+    {
+        c.until = Until_Ldbb;
+    } else if (until.compare(0, 7, "serial:") == 0 && until.size() > 7)
+    {
+        c.until = Until_Serial;
+        c.text = until.substr(7);
+    } else
+    {
+        return false;
+    }
+    return true;
+}
+
+static string until_name(const RegressCase &c)
+{
+    switch (c.until)
+    {
+    case Until_Ldbb:
+        return "ldbb";
+    case Until_Serial:
+        return "serial:" + c.text;
+    default:
+        return "frames";
+    }
+}
+
+static bool has_suffix(const string &s, const string &suffix)
+{
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Runs c and fills in its results. The hash of every finished frame is appended to frames if given.
+static void run_case(const string &dir, RegressCase &c, bool fused, vector<uint64_t> *frames)
+{
+    MotherBoard mb(dir + c.rom);
+    mb.cpu->cpu->fusion = fused;
+    Gpu *gpu = mb.mmu->gpu;
+    gpu->hash_frames = true;
+    gpu->track_lines = track_lines;
+    gpu->set_render_threads(render_threads);
+    string serial;
+    mb.mmu->serial.log = &serial;
+    if (!c.movie.empty())
+    {
+        if (!mb.movie.load(dir + c.movie))
+        {
+            c.reached = c.completed = c.passed = false;
+            c.frame_count = 0;
+            c.instructions = 0;
+            c.seconds = 0;
+            c.hash = c.golden;
+            c.note = "can not read movie " + c.movie;
+            return;
+        }
+        mb.play();
+    }
+
+    AudioCapture *capture = NULL;
+    VideoCapture *video = NULL;
+    string capture_note;
+    string stem = c.rom.substr(0, c.rom.find_last_of('.'));
+    if (!capture_dir.empty())
+    {
+        string path = capture_dir + "/" + stem + (capture_format == CaptureFormat_Wav ? ".wav" : ".pcm");
+        capture = new AudioCapture();
+        if (!capture->open(path, capture_format, APU_SAMPLE_RATE))
+        {
+            capture_note = "can not write " + path;
+            delete capture;
+            capture = NULL;
+        }
+    }
+    if (!video_dir.empty())
+    {
+        string path = video_dir + "/" + stem + VIDEO_EXT[video_format];
+        video = new VideoCapture();
+        if (!video->open(path, video_format))
+        {
+            capture_note += (capture_note.empty() ? "" : ", ") + string("can not write ") + path;
+            delete video;
+            video = NULL;
+        }
+    }
+    uint32_t video_frame = gpu->frame_count;
+    uint32_t hashed_frame = gpu->frame_count;
+
+    uint64_t cycles = 0;
+    uint64_t cycle_limit = (uint64_t)c.frames * FRAME_CYCLES;
+    uint64_t instructions = 0;
+    // The APU keeps one second of samples, they are taken about once a frame.
+    uint64_t capture_due = FRAME_DOTS;
+    c.reached = false;
+
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    while (gpu->frame_count < c.frames && cycles < cycle_limit)
+    {
+        if (c.until == Until_Ldbb && mb.mmu->get(mb.cpu->cpu->reg->pc) == 0x40)
+        {
+            c.reached = true;
+            break;
+        }
+        cycles += mb.step();
+        instructions++;
+        if (capture && cycles >= capture_due)
+        {
+            capture->capture(mb.mmu->apu);
+            capture_due = cycles + FRAME_DOTS;
+        }
+        if (video && gpu->frame_count != video_frame)
+        {
+            video->capture(gpu);
+            video_frame = gpu->frame_count;
+        }
+        if (frames && gpu->frame_count != hashed_frame)
+        {
+            frames->push_back(gpu->frame_hash);
+            hashed_frame = gpu->frame_count;
+        }
+        if (c.until == Until_Serial && !serial.empty() && serial.find(c.text) != string::npos)
+        {
+            c.reached = true;
+            break;
+        }
+    }
+    chrono::steady_clock::time_point t1 = chrono::steady_clock::now();
+
+    if (capture)
+    {
+        capture->capture(mb.mmu->apu);
+        capture->close();
+        if (capture->dropped > 0)
+        {
+            capture_note += (capture_note.empty() ? "" : ", ") + to_string(capture->dropped) +
+                            " samples dropped from the capture";
+        }
+        delete capture;
+    }
+    if (video)
+    {
+        video->close();
+        if (video->dropped > 0)
+        {
+            capture_note += (capture_note.empty() ? "" : ", ") + to_string(video->dropped) +
+                            " frames dropped from the capture";
+        }
+        delete video;
+    }
+
+    if (c.until == Until_Frames)
+    {
+        c.reached = gpu->frame_count >= c.frames;
+    }
+    c.frame_count = gpu->frame_count;
+    c.instructions = instructions;
+    c.seconds = chrono::duration<double>(t1 - t0).count();
+    c.hash = hex64(gpu->frame_hash);
+
+    c.passed = c.reached;
+    if (!c.reached)
+    {
+        c.note = "limit reached";
+    } else if (c.until == Until_Ldbb)
+    {
+        Register *r = mb.cpu->cpu->reg;
+        if (r->b != 3 || r->c != 5 || r->d != 8 || r->e != 13 || r->h != 21 || r->l != 34)
+        {
+            c.passed = false;
+            c.note = "breakpoint registers report failure";
+        }
+    }
+    c.completed = c.passed;
+    if (c.passed && c.golden != "-" && c.golden != c.hash)
+    {
+        c.passed = false;
+        c.note = "frame hash differs from " + c.golden;
+    }
+    if (c.until == Until_Serial && !c.passed)
+    {
+        // Keep the report on one line.
+        string tail = serial.substr(serial.size() > 40 ? serial.size() - 40 : 0);
+        for (size_t i = 0; i < tail.size(); i++)
+        {
+            if (tail[i] == '\n' || tail[i] == '\r')
+            {
+                tail[i] = ' ';
+            }
+        }
+        c.note += (c.note.empty() ? "" : ", ") + string("serial: \"") + tail + "\"";
+    }
+    if (!capture_note.empty())
+    {
+        c.note += (c.note.empty() ? "" : ", ") + capture_note;
+    }
+}
+
+// Runs c without and then with superinstructions, c gets the results of the second run and fails if any frame of the
+// two runs differs.
+static void compare_case(const string &dir, RegressCase &c)
+{
+    vector<uint64_t> plain;
+    vector<uint64_t> fused;
+    RegressCase interpreted = c;
+    run_case(dir, interpreted, false, &plain);
+    run_case(dir, c, true, &fused);
+    if (plain == fused)
+    {
+        return;
+    }
+    size_t n = 0;
+    while (n < plain.size() && n < fused.size() && plain[n] == fused[n])
+    {
+        n++;
+    }
+    c.passed = c.completed = false;
+    c.note += (c.note.empty() ? "" : ", ") + string("frame ") + to_string(n + 1) + " differs without fusion";
+}
+
+int main(int argc, char **argv)
+{
+    string manifest = "regress.txt";
+    unsigned int jobs = thread::hardware_concurrency();
+    bool update = false;
+    for (int i = 1; i < argc; i++)
+    {
+        string a = argv[i];
+        if (a == "-j" && i + 1 < argc)
+        {
+            jobs = (unsigned int)atoi(argv[++i]);
+        } else if (a == "-u")
+        {
+            update = true;
+        } else if (a == "-t" && i + 1 < argc)
+        {
+            render_threads = (unsigned int)atoi(argv[++i]);
+        } else if (a == "-F")
+        {
+            fusion = true;
+        } else if (a == "-D")
+        {
+            compare_fusion = true;
+        } else if (a == "-l")
+        {
+            track_lines = true;
+        } else if (a == "-w" && i + 1 < argc)
+        {
+            capture_dir = argv[++i];
+        } else if (a == "-f" && i + 1 < argc)
+        {
+            string f = argv[++i];
+            if (f != "wav" && f != "pcm")
+            {
+                cout << "Unknown capture format " << f << endl;
+                return 2;
+            }
+            capture_format = f == "wav" ? CaptureFormat_Wav : CaptureFormat_Pcm;
+        } else if (a == "-v" && i + 1 < argc)
+        {
+            video_dir = argv[++i];
+        } else if (a == "-c" && i + 1 < argc)
+        {
+            string f = argv[++i];
+            if (f == "y4m")
+            {
+                video_format = VideoFormat_Y4m;
+            } else if (f == "rgb")
+            {
+                video_format = VideoFormat_Rgb;
+            } else if (f == "avi")
+            {
+                video_format = VideoFormat_Avi;
+            } else
+            {
+                cout << "Unknown video format " << f << endl;
+                return 2;
+            }
+        } else
+        {
+            manifest = a;
+        }
+    }
+    if (jobs == 0)
+    {
+        jobs = 1;
+    }
+
+    size_t slash = manifest.find_last_of('/');
+    string dir = (slash == string::npos) ? "" : manifest.substr(0, slash + 1);
+
+    vector<RegressCase> cases;
+    vector<string> lines;
+    ifstream in(manifest);
+    if (!in)
+    {
+        cout << "Can not open manifest " << manifest << endl;
+        return 2;
+    }
+    string line;
+    while (getline(in, line))
+    {
+        lines.push_back(line);
+        size_t p = line.find_first_not_of(" \t");
+        if (p == string::npos || line[p] == '#')
+        {
+            continue;
+        }
+        RegressCase c;
+        if (!parse_line(line, c))
+        {
+            cout << "Invalid manifest line: " << line << endl;
+            return 2;
+        }
+        cases.push_back(c);
+    }
+    size_t listed = cases.size();
+
+    DIR *d = opendir(dir.empty() ? "." : dir.c_str());
+    if (d)
+    {
+        vector<string> found;
+        while (struct dirent *e = readdir(d))
+        {
+            string name = e->d_name;
+            if (has_suffix(name, ".gb") || has_suffix(name, ".gbc"))
+            {
+                found.push_back(name);
+            }
+        }
+        closedir(d);
+        sort(found.begin(), found.end());
+        for (size_t i = 0; i < found.size(); i++)
+        {
+            bool known = false;
+            for (size_t j = 0; j < listed; j++)
+            {
+                known = known || cases[j].rom == found[i];
+            }
+            if (!known)
+            {
+                RegressCase c;
+                c.rom = found[i];
+                c.until = Until_Frames;
+                c.frames = DEFAULT_FRAMES;
+                c.golden = "-";
+                c.xfail = false;
+                cases.push_back(c);
+            }
+        }
+    }
+
+    // The emulator core reports to cout, keep it out of the report while the workers run.
+    cout.setstate(ios::badbit);
+
+    atomic<size_t> next_case(0);
+    vector<thread> workers;
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    for (unsigned int i = 0; i < jobs && i < cases.size(); i++)
+    {
+        workers.push_back(thread([&]() {
+            for (size_t k = next_case++; k < cases.size(); k = next_case++)
+            {
+                if (compare_fusion)
+                {
+                    compare_case(dir, cases[k]);
+                } else
+                {
+                    run_case(dir, cases[k], fusion, NULL);
+                }
+            }
+        }));
+    }
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+        workers[i].join();
+    }
+    chrono::steady_clock::time_point t1 = chrono::steady_clock::now();
+    cout.clear();
+
+    int failed = 0;
+    int expected = 0;
+    cout << left << setw(7) << "result" << setw(20) << "rom" << setw(18) << "until" << right << setw(8) << "frames"
+         << setw(12) << "MIPS" << "  " << left << setw(18) << "hash" << "note" << endl;
+    for (size_t i = 0; i < cases.size(); i++)
+    {
+        const RegressCase &c = cases[i];
+        double mips = c.seconds > 0 ? c.instructions / c.seconds / 1e6 : 0;
+        const char *result = c.passed ? (c.xfail ? "XPASS" : "PASS") : (c.xfail ? "XFAIL" : "FAIL");
+        cout << left << setw(7) << result << setw(20) << c.rom << setw(18) << until_name(c)
+             << right << setw(8) << c.frame_count << setw(12) << fixed << setprecision(2) << mips << "  " << left
+             << setw(18) << c.hash << c.note << endl;
+        if (c.passed == c.xfail)
+        {
+            failed++;
+        } else if (c.xfail)
+        {
+            expected++;
+        }
+    }
+    cout << cases.size() - failed - expected << " passed, " << failed << " failed, " << expected
+         << " expected to fail, " << setprecision(2)
+         << chrono::duration<double>(t1 - t0).count() << "s on " << workers.size() << " threads" << endl;
+
+    if (update)
+    {
+        // Rewrite the hash column of listed ROMs in place and append the ones found in the directory.
+        ofstream o(manifest);
+        size_t k = 0;
+        for (size_t i = 0; i < lines.size(); i++)
+        {
+            size_t p = lines[i].find_first_not_of(" \t");
+            if (p == string::npos || lines[i][p] == '#')
+            {
+                o << lines[i] << endl;
+                continue;
+            }
+            const RegressCase &c = cases[k++];
+            o << left << setw(16) << c.rom << " " << setw(18) << until_name(c) << " " << setw(6) << c.frames << " "
+              << (c.completed ? c.hash : c.golden) << (c.movie.empty() ? "" : " " + c.movie)
+              << (c.xfail ? " xfail" : "") << endl;
+        }
+        for (; k < cases.size(); k++)
+        {
+            const RegressCase &c = cases[k];
+            o << left << setw(16) << c.rom << " " << setw(18) << until_name(c) << " " << setw(6) << c.frames << " "
+              << (c.completed ? c.hash : c.golden) << endl;
+        }
+        cout << "Updated " << manifest << endl;
+    }
+
+    return failed == 0 ? 0 : 1;
+}